@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+
+#include "cpurender.h"
+#include "scheduler.h"
+#include "colour.h"
+#include "antialias.h"
+
+// Points per batch, and per scheduler task
+#define AA_BATCH (1 << 20)
+#define AA_CHUNK 1024
+
+struct SampleList {
+  RenderParams params;
+  std::vector<float> xs, ys;
+  std::vector<uint32_t> res;
+  std::vector<int> pixels; // Edge pixels, samples points each
+};
+
+static struct {
+  int npixels;
+  int edges;
+  int samples;
+  double ms;
+} stats;
+
+// The list is cut into tiles of points, x being the first and w how many.
+static void sample_tile(const Tile &tile, void *arg) {
+  SampleList *list = (SampleList*)arg;
+  cpu_render_samples(list->params, &list->xs[tile.x], &list->ys[tile.x],
+                     tile.w, &list->res[tile.x]);
+}
+
+// Scramble a pixel and sample number into the jitter for it, so the
+// same frame always comes out the same.
+static inline uint32_t jitter_hash(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
+
+struct CountOrder {
+  const uint32_t *counts;
+  CountOrder(const uint32_t *c) : counts(c) {}
+  bool operator()(int a, int b) const { return counts[a] < counts[b]; }
+};
+
+// Render the points in the list and average each edge pixel's colour.
+static void flush(SampleList &list, int samples, const unsigned *palette,
+                  uint32_t mask, uint8_t *rgb) {
+  int n = list.xs.size();
+  if (n == 0) return;
+  list.res.resize(n);
+  std::vector<Tile> tiles;
+  for (int i = 0; i < n; i += AA_CHUNK) {
+    Tile t = { i, 0, std::min(AA_CHUNK, n - i), 1 };
+    tiles.push_back(t);
+  }
+  sched_run(&tiles[0], tiles.size(), sample_tile, &list);
+  for (size_t j = 0; j < list.pixels.size(); j++) {
+    uint8_t *p = rgb + 3*list.pixels[j];
+    // The original point counts as one of them
+    unsigned r = p[0], g = p[1], b = p[2];
+    for (int k = 0; k < samples; k++) {
+      unsigned c = palette[list.res[j*samples + k] & mask];
+      r += palette_r(c);
+      g += palette_g(c);
+      b += palette_b(c);
+    }
+    p[0] = (r + samples/2) / (samples+1);
+    p[1] = (g + samples/2) / (samples+1);
+    p[2] = (b + samples/2) / (samples+1);
+  }
+  list.xs.clear();
+  list.ys.clear();
+  list.pixels.clear();
+}
+
+void aa_render(const RenderParams &params, const uint32_t *counts,
+               int width, int height, int samples, uint8_t *rgb)
+{
+  timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  unsigned palette[256];
+  make_palette(palette, params.maxiterations);
+  uint32_t mask = (params.maxiterations-1) & 0xff;
+  int grid = (int)(sqrt((double)samples) + 0.5);
+
+  for (int i = 0; i < width*height; i++) {
+    unsigned c = palette[counts[i] & mask];
+    rgb[3*i] = palette_r(c);
+    rgb[3*i+1] = palette_g(c);
+    rgb[3*i+2] = palette_b(c);
+  }
+
+  // Find the edges
+  std::vector<int> edges;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      const uint32_t *p = counts + y*width + x;
+      uint32_t c = *p & mask;
+      if ((x > 0 && (p[-1] & mask) != c) ||
+          (x < width-1 && (p[1] & mask) != c) ||
+          (y > 0 && (p[-width] & mask) != c) ||
+          (y < height-1 && (p[width] & mask) != c)) {
+        edges.push_back(y*width + x);
+      }
+    }
+  }
+  stats.npixels = width*height;
+  stats.edges = edges.size();
+  stats.samples = samples;
+
+  // A vector of 16 points takes as long as the slowest of them, and
+  // along an edge neighbouring pixels are by definition different, so
+  // go through them in order of their counts: the extra points of a
+  // pixel mostly take about as long as the pixel did.
+  std::stable_sort(edges.begin(), edges.end(), CountOrder(counts));
+
+  SampleList list;
+  list.params = params;
+  for (size_t i = 0; i < edges.size(); i++) {
+    int x = edges[i] % width, y = edges[i] / width;
+    list.pixels.push_back(edges[i]);
+    // A point in each square of the grid, at a multiple of 1/256 of
+    // a pixel so that x + dx is exact in a float.
+    for (int k = 0; k < samples; k++) {
+      uint32_t h = jitter_hash(edges[i]*samples + k);
+      int gx = k % grid, gy = k / grid;
+      float dx = ((gx*256 + (h & 0xff)) / grid) / 256.0f - 0.5f;
+      float dy = ((gy*256 + ((h >> 8) & 0xff)) / grid) / 256.0f - 0.5f;
+      list.xs.push_back(x + dx);
+      list.ys.push_back(y + dy);
+    }
+    if ((int)list.xs.size() >= AA_BATCH) {
+      flush(list, samples, palette, mask, rgb);
+    }
+  }
+  flush(list, samples, palette, mask, rgb);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  stats.ms = (end.tv_sec - start.tv_sec) * 1e3 +
+    (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+void aa_print_stats(FILE *fp)
+{
+  fprintf(fp, "Anti-aliasing: %d edge pixels (%.1f%%), %d x %d points, "
+          "%.3f ms\n", stats.edges, 100.0*stats.edges/stats.npixels,
+          stats.edges, stats.samples, stats.ms);
+}
@@ -0,0 +1,22 @@
+// Anti-aliasing just the edges, for headless .ppm output.
+//
+// At one point a pixel thin filaments break up into dots, but rendering
+// every pixel n times over would make the frame n times slower, and
+// most pixels have the same colour as all their neighbours anyway. So
+// the frame is rendered as usual, then each pixel whose colour differs
+// from one of its four neighbours gets n more points, one jittered
+// about each square of an n-point grid over it, and is coloured with
+// the average of those and the original. The extra points of the whole
+// frame go in one packed list (in batches, to bound the memory) which
+// is cut into chunks for the scheduler threads, so the kernels get
+// whole vectors however ragged the edges are, and the work goes with
+// the length of the edges rather than the area.
+
+// Colour the width x height frame of counts (raw or masked, stride
+// width) into rgb, 3 bytes a pixel, the edges with samples (a square
+// number) extra points each. Needs the scheduler running.
+void aa_render(const RenderParams &params, const uint32_t *counts,
+               int width, int height, int samples, uint8_t *rgb);
+
+// Edge pixels and time taken for the last frame.
+void aa_print_stats(FILE *fp);
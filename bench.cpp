@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "cpurender.h"
+#include "scheduler.h"
+#include "deepzoom.h"
+#include "subdivide.h"
+#include "qpusim.h"
+#include "headless.h"
+#include "bench.h"
+
+struct BenchView {
+  const char *name;
+  double xcentre;
+  double ycentre;
+  double xscale;
+};
+
+static const BenchView views[] = {
+  { "default",   -0.7449,      0.1,        1   },
+  { "seahorse",  -0.7453,      0.1127,     100 },
+  { "fullset",   -0.75,        0,          0.8 },
+  { "interior",  -0.1226,      0.7449,     20  }, // The period 3 bulb
+  { "filaments", -0.10109636,  0.95628651, 50  },
+};
+static const int NVIEWS = sizeof(views)/sizeof(views[0]);
+
+static const int limits[] = { 256, 1024, 4096 };
+static const int NLIMITS = sizeof(limits)/sizeof(limits[0]);
+
+struct BenchFrame {
+  RenderParams params;
+  uint32_t *counts;
+  int width;
+};
+
+static void bench_tile(const Tile &tile, void *arg) {
+  BenchFrame *frame = (BenchFrame*)arg;
+  cpu_render_counts(frame->params, tile.x, tile.y, tile.w, tile.h,
+                    frame->counts, frame->width);
+}
+
+static double seconds(const timespec &start, const timespec &end) {
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Print and write out one configuration, returning its mean frame time.
+static double report(FILE *csv, const char *backend, const char *kernel,
+                     int workers, const BenchView &view, int maxiterations,
+                     int width, int height, const std::vector<double> &times,
+                     uint64_t iterations) {
+  int n = times.size();
+  double mean = 0, min = times[0];
+  for (int i = 0; i < n; i++) {
+    mean += times[i];
+    if (times[i] < min) min = times[i];
+  }
+  mean /= n;
+  double var = 0;
+  for (int i = 0; i < n; i++) var += (times[i]-mean)*(times[i]-mean);
+  double stddev = n > 1 ? sqrt(var/(n-1)) : 0;
+  double mpixels = (double)width*height/mean/1e6;
+  double giterations = iterations/mean/1e9;
+  fprintf(stderr, "%-9s %2d %-9s %4d: %9.3f ms +- %7.3f (min %9.3f) "
+          "%8.2f Mpixels/s %7.3f Giterations/s\n",
+          backend, workers, view.name, maxiterations, mean*1e3, stddev*1e3,
+          min*1e3, mpixels, giterations);
+  fprintf(csv, "%s,%s,%d,%s,%.10g,%.10g,%g,%d,%d,%d,%d,%.6f,%.6f,%.6f,%.4f,%.6f\n",
+          backend, kernel, workers, view.name, view.xcentre, view.ycentre,
+          view.xscale, maxiterations, width, height, n, mean*1e3,
+          stddev*1e3, min*1e3, mpixels, giterations);
+  return mean;
+}
+
+static void print_scaling(const char *backend, const char *unit,
+                          const std::vector<double> &totals) {
+  fprintf(stderr, "%s scaling (whole catalogue):\n", backend);
+  for (size_t i = 0; i < totals.size(); i++) {
+    fprintf(stderr, "  %2zu %s: %9.3f ms, %5.2fx\n", i+1, unit,
+            totals[i]*1e3, totals[0]/totals[i]);
+  }
+}
+
+int bench_main(const BenchOptions &options)
+{
+  int width = options.width;
+  int height = options.height;
+  size_t npixels = (size_t)width*height;
+  int maxthreads = options.maxthreads;
+  if (maxthreads <= 0) maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (maxthreads <= 0) maxthreads = 1;
+  int frames = options.frames > 0 ? options.frames : 5;
+
+  FILE *csv = fopen(options.output, "w");
+  if (!csv) {
+    fprintf(stderr, "Can't open %s for writing\n", options.output);
+    return EXIT_FAILURE;
+  }
+  fprintf(csv, "backend,kernel,workers,view,xcentre,ycentre,zoom,"
+          "maxiterations,width,height,frames,mean_ms,stddev_ms,min_ms,"
+          "mpixels_per_s,giterations_per_s\n");
+
+  // The iterations each view takes are the same whatever renders it,
+  // so count them once, from the CPU's counts. The subdivision fills
+  // rectangles rather than iterating them, but gets the same counts.
+  BenchFrame frame;
+  frame.counts = new uint32_t[npixels];
+  frame.width = width;
+  uint64_t iterations[NVIEWS][NLIMITS];
+  sched_start(maxthreads);
+  for (int v = 0; v < NVIEWS; v++) {
+    for (int l = 0; l < NLIMITS; l++) {
+      view_params(frame.params, views[v].xcentre, views[v].ycentre,
+                  views[v].xscale, width, height, limits[l]);
+      sched_frame(width, height, options.tilesize, bench_tile, &frame);
+      iterations[v][l] = 0;
+      for (size_t j = 0; j < npixels; j++) iterations[v][l] += frame.counts[j];
+    }
+  }
+  sched_stop();
+
+  fprintf(stderr, "Bench: %d views x %d limits, %dx%d, %d frames each\n",
+          NVIEWS, NLIMITS, width, height, frames);
+  std::vector<double> times;
+  if (options.cpu) {
+    const char *backend = options.subdivide ? "subdivide" : "cpu";
+    std::vector<double> totals;
+    for (int n = 1; n <= maxthreads; n++) {
+      sched_start(n);
+      double total = 0;
+      for (int v = 0; v < NVIEWS; v++) {
+        for (int l = 0; l < NLIMITS; l++) {
+          view_params(frame.params, views[v].xcentre, views[v].ycentre,
+                      views[v].xscale, width, height, limits[l]);
+          times.clear();
+          // The first frame warms the caches up and isn't counted
+          for (int i = 0; i <= frames; i++) {
+            timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            if (options.subdivide) {
+              subdiv_render(frame.params, width, height, options.verify,
+                            frame.counts, width);
+            } else {
+              sched_frame(width, height, options.tilesize, bench_tile, &frame);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            if (i > 0) times.push_back(seconds(start, end));
+          }
+          total += report(csv, backend, cpu_kernel_name(), n, views[v],
+                          limits[l], width, height, times,
+                          iterations[v][l]);
+        }
+      }
+      sched_stop();
+      totals.push_back(total);
+    }
+    print_scaling(backend, "threads", totals);
+  }
+
+  if (options.simrender) {
+    uint8_t *fb = new uint8_t[npixels];
+    std::vector<double> totals;
+    for (int n = 1; n <= options.maxqpus; n++) {
+      options.simqpus(n);
+      double total = 0;
+      for (int v = 0; v < NVIEWS; v++) {
+        for (int l = 0; l < NLIMITS; l++) {
+          view_params(frame.params, views[v].xcentre, views[v].ycentre,
+                      views[v].xscale, width, height, limits[l]);
+          options.simrender(frame.params, width, height, fb, width);
+          times.assign(1, (double)qpusim_cycles() / QPUSIM_CLOCK_HZ);
+          total += report(csv, "sim", "qpu", n, views[v], limits[l],
+                          width, height, times, iterations[v][l]);
+        }
+      }
+      totals.push_back(total);
+    }
+    print_scaling("sim", "QPUs", totals);
+    delete [] fb;
+  }
+
+  delete [] frame.counts;
+  if (fclose(csv) != 0) {
+    fprintf(stderr, "Error writing %s\n", options.output);
+    return EXIT_FAILURE;
+  }
+  return 0;
+}
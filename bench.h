@@ -0,0 +1,30 @@
+// Benchmark over a fixed catalogue of views.
+//
+// Each view in the catalogue (the default one, seahorse valley, the
+// whole set, a view filled with the inside of a bulb the cardioid test
+// doesn't catch and one of thin filaments) is rendered at a few
+// iteration limits, on the CPU with 1, 2, ... threads and on 1, 2, ...
+// 12 simulated QPUs, so how each backend scales can be seen and two
+// builds compared. Every configuration gets a frame to warm up and then
+// the timed ones, whose mean, standard deviation and minimum go to
+// stderr and, one line per configuration, to a CSV file.
+//
+// The simulated QPUs always take the same time for the same frame, so
+// they only get one timed frame, timed by simulated cycles.
+
+struct BenchOptions {
+  int width;
+  int height;
+  int tilesize;
+  int frames;              // Timed frames per configuration
+  bool cpu;                // Sweep the CPU threads
+  int maxthreads;          // Up to this many, 0 for one per core
+  bool subdivide;          // CPU frames by subdivision (see subdivide.h)
+  int verify;
+  FrameRenderer simrender; // Simulated QPUs, NULL for none
+  void (*simqpus)(int nqpus);
+  int maxqpus;
+  const char *output;      // CSV file
+};
+
+int bench_main(const BenchOptions &options);
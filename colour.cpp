@@ -0,0 +1,44 @@
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+
+#include "colour.h"
+
+static const float PI = 3.14159;
+
+void make_palette(unsigned palette[256], int maxiterations)
+{
+  palette[0] = 0;
+  for (int i = 1; i < 256; ++i) {
+    float f = 2*PI * i / maxiterations;
+
+    int k = 255; int j = 150;
+    int r = j + cos(f + PI/3) * k;
+    int g = j + cos(f + 3 * PI / 3) * k;
+    int b = j + cos(f + 5 * PI / 3) * k;
+
+    r = std::min(r, 255);
+    g = std::min(g, 255);
+    b = std::min(b, 255);
+    r = r < 0 ? 0 : r;
+    g = g < 0 ? 0 : g;
+    b = b < 0 ? 0 : b;
+    palette[i] =  (b << 16) | (g << 8) | r;
+  }
+}
+
+void colourise(const uint32_t *counts, int stride, int width, int height,
+               uint8_t *fb, int pitch, int maxiterations,
+               int modulus, int offset)
+{
+  uint32_t mask = modulus - 1;
+  uint32_t limit = maxiterations;
+  for (int y = 0; y < height; y++) {
+    const uint32_t *c = counts + y*stride;
+    uint8_t *p = fb + y*pitch;
+    for (int x = 0; x < width; x++) {
+      uint8_t v = (c[x] + offset) & mask;
+      p[x] = c[x] < limit ? v : 0;
+    }
+  }
+}
@@ -0,0 +1,20 @@
+// Colouring iteration counts.
+
+// Fill in the 256 entry palette used for the framebuffer: entry 0 (the
+// interior of the set) is black, the rest cycle round the colour wheel
+// once every maxiterations. Entries are 0x00BBGGRR, as the firmware
+// wants them.
+void make_palette(unsigned palette[256], int maxiterations);
+
+static inline uint8_t palette_r(unsigned c) { return c & 0xff; }
+static inline uint8_t palette_g(unsigned c) { return (c >> 8) & 0xff; }
+static inline uint8_t palette_b(unsigned c) { return (c >> 16) & 0xff; }
+
+// Turn raw iteration counts into palette indices for the framebuffer:
+// counts of maxiterations or more (inside the set) give 0, the others
+// have offset added and are taken mod modulus (a power of 2), keeping
+// the bottom 8 bits. With offset 0 and modulus maxiterations this is
+// what the QPUs write in 8 bit mode, for power of 2 limits.
+void colourise(const uint32_t *counts, int stride, int width, int height,
+               uint8_t *fb, int pitch, int maxiterations,
+               int modulus, int offset);
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <assert.h>
+#include <vector>
+#include <deque>
+
+#include "device.h"
+#include "v3d.h"
+#include "counters.h"
+
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static const char *names[CTR_NSOURCES] = {
+  "FEP_VALID_PRIMS_NO_PIXELS",
+  "FEP_VALID_PRIMS",
+  "FEP_EZ_NFCLIP_QUADS",
+  "FEP_VALID_QUADS",
+  "TLB_QUADS_NO_STENCIL_PASS",
+  "TLB_QUADS_NO_Z_STENCIL_PASS",
+  "TLB_QUADS_Z_STENCIL_PASS",
+  "TLB_QUADS_ZERO_COVERAGE",
+  "TLB_QUADS_NONZERO_COVERAGE",
+  "TLB_QUADS_WRITTEN",
+  "PTB_PRIMS_OUTSIDE_VIEWPORT",
+  "PTB_PRIMS_NEED_CLIPPING",
+  "PSE_PRIMS_REVERSED",
+  "QPU_TOTAL_IDLE",
+  "QPU_TOTAL_VERTEX",
+  "QPU_TOTAL_FRAGMENT",
+  "QPU_TOTAL_VALID",
+  "QPU_TOTAL_TMU_STALL",
+  "QPU_TOTAL_SCOREBOARD_STALL",
+  "QPU_TOTAL_VARYINGS_STALL",
+  "QPU_TOTAL_ICACHE_HITS",
+  "QPU_TOTAL_ICACHE_MISSES",
+  "QPU_TOTAL_UCACHE_HITS",
+  "QPU_TOTAL_UCACHE_MISSES",
+  "QPU_TOTAL_TMU_PROCESSED",
+  "QPU_TOTAL_TMU_MISSES",
+  "QPU_TOTAL_VDW_STALL",
+  "QPU_TOTAL_VCD_STALL",
+  "QPU_TOTAL_L2_HITS",
+  "QPU_TOTAL_L2_MISSES",
+};
+
+// Both have everything the stats need, so those are sampled every
+// frame, and half the other QPU sources each. The 3D pipeline's (0 to
+// 12), which a compute kernel never moves, are left out.
+static const int group0[] = {
+  13, 16, 20, 21, 22, 23, 26, 28, 29, 14, 15, 17, 18
+};
+static const int group1[] = {
+  13, 16, 20, 21, 22, 23, 26, 28, 29, 19, 24, 25, 27
+};
+static const struct { const int *sources; int n; } groups[] = {
+  { group0, ARRAYSIZE(group0) },
+  { group1, ARRAYSIZE(group1) },
+};
+static const int NGROUPS = ARRAYSIZE(groups);
+
+struct CounterFrame {
+  unsigned frame;
+  int group;           // -1 for all sources
+  unsigned usecs;
+  uint64_t iterations;
+  uint32_t values[CTR_NSOURCES];
+  uint32_t sampled;    // Bit per source
+};
+
+static volatile uint32_t *regs = NULL;
+static int group = 0;
+
+// Totals over all the frames, for the averages. cycles is the QPU
+// cycles (VALID + IDLE) of the frames each source was sampled in.
+static struct {
+  unsigned frames;
+  double sum[CTR_NSOURCES];
+  double cycles[CTR_NSOURCES];
+  unsigned n[CTR_NSOURCES];
+  double allcycles;
+  double iterations;
+  unsigned iterframes;
+} totals;
+
+// The last HISTORY frames, for the CSV, as the interactive loop can
+// run for ever
+#define HISTORY 10000
+static std::deque<CounterFrame> frames;
+
+// counters_extra's columns, and their values for each frame kept
+static std::vector<const char *> extranames;
+static std::vector<double> extras;  // For the frame under way
+static std::deque<std::vector<double> > frameextras;
+
+void counters_extra(const char *name, double value) {
+  size_t i = 0;
+  while (i < extranames.size() && strcmp(extranames[i], name) != 0) i++;
+  if (i == extranames.size()) extranames.push_back(name);
+  if (extras.size() <= i) extras.resize(i+1, NAN);
+  extras[i] = value;
+}
+
+static void keep_frame(const CounterFrame &f) {
+  double c = (double)f.values[CTR_QPU_TOTAL_VALID] +
+    f.values[CTR_QPU_TOTAL_IDLE];
+  totals.frames++;
+  totals.allcycles += c;
+  for (int i = 0; i < CTR_NSOURCES; i++) {
+    if ((f.sampled >> i) & 1) {
+      totals.sum[i] += f.values[i];
+      totals.cycles[i] += c;
+      totals.n[i]++;
+    }
+  }
+  if (f.iterations > 0) {
+    totals.iterations += f.iterations;
+    totals.iterframes++;
+  }
+  frames.push_back(f);
+  frameextras.push_back(extras);
+  extras.clear();
+  if (frames.size() > HISTORY) {
+    frames.pop_front();
+    frameextras.pop_front();
+  }
+}
+
+static void select_group(int g) {
+  group = g;
+  for (int i = 0; i < groups[g].n; i++) {
+    reg_write(regs, V3D_PCTRS(i), groups[g].sources[i]);
+  }
+}
+
+void counters_setup(volatile uint32_t *r) {
+  regs = r;
+  for (int g = 0; g < NGROUPS; g++) assert(groups[g].n <= 16);
+  select_group(0);
+  // Counters only seem to work if top bit in PCTRE is set
+  reg_write(regs, V3D_PCTRE, 0x8000ffff);
+}
+
+void counters_clear() {
+  reg_write(regs, V3D_PCTRC, 0x0000ffff);
+}
+
+void counters_read(unsigned frame, unsigned usecs, uint64_t iterations) {
+  CounterFrame f;
+  memset(&f, 0, sizeof(f));
+  f.frame = frame;
+  f.group = group;
+  f.usecs = usecs;
+  f.iterations = iterations;
+  for (int i = 0; i < groups[group].n; i++) {
+    int source = groups[group].sources[i];
+    f.values[source] = reg_read(regs, V3D_PCTR(i));
+    f.sampled |= 1u << source;
+  }
+  keep_frame(f);
+  if (NGROUPS > 1) select_group((group + 1) % NGROUPS);
+}
+
+void counters_record(uint32_t (*read)(int source), unsigned frame,
+                     unsigned usecs, uint64_t iterations) {
+  CounterFrame f;
+  memset(&f, 0, sizeof(f));
+  f.frame = frame;
+  f.group = -1;
+  f.usecs = usecs;
+  f.iterations = iterations;
+  for (int source = 0; source < CTR_NSOURCES; source++) {
+    f.values[source] = read(source);
+  }
+  f.sampled = (1u << CTR_NSOURCES) - 1;
+  keep_frame(f);
+}
+
+static double ratio(double a, double b) {
+  return b > 0 ? a / b : NAN;
+}
+
+// Stats from the per-frame averages of each source (NAN for not
+// sampled) and of the iterations
+static void work_out(CounterStats &s, const double *avg, double iterations) {
+  double valid = avg[CTR_QPU_TOTAL_VALID];
+  double idle = avg[CTR_QPU_TOTAL_IDLE];
+  s.utilisation = ratio(valid, valid + idle);
+  s.vdwshare = ratio(avg[CTR_QPU_TOTAL_VDW_STALL],
+                     valid + avg[CTR_QPU_TOTAL_VDW_STALL]);
+  s.icachehits = ratio(avg[CTR_QPU_TOTAL_ICACHE_HITS],
+                       avg[CTR_QPU_TOTAL_ICACHE_HITS] +
+                       avg[CTR_QPU_TOTAL_ICACHE_MISSES]);
+  s.ucachehits = ratio(avg[CTR_QPU_TOTAL_UCACHE_HITS],
+                       avg[CTR_QPU_TOTAL_UCACHE_HITS] +
+                       avg[CTR_QPU_TOTAL_UCACHE_MISSES]);
+  s.l2hits = ratio(avg[CTR_QPU_TOTAL_L2_HITS],
+                   avg[CTR_QPU_TOTAL_L2_HITS] +
+                   avg[CTR_QPU_TOTAL_L2_MISSES]);
+  s.itersperqpucycle = iterations > 0 ? ratio(iterations, valid + idle) : NAN;
+}
+
+static void frame_stats(const CounterFrame &f, CounterStats &s) {
+  double avg[CTR_NSOURCES];
+  for (int i = 0; i < CTR_NSOURCES; i++) {
+    avg[i] = (f.sampled >> i) & 1 ? f.values[i] : NAN;
+  }
+  s.frames = 1;
+  work_out(s, avg, f.iterations);
+}
+
+// Average per frame of each source over all the frames. A source only
+// sampled in some frames is scaled up by the QPU cycles of all the
+// frames over those of the frames it was sampled in, as they may not
+// have been typical. n[] gets the frames sampled, and iterations the
+// average over the frames that have them.
+static void averages(double *avg, unsigned *n, double &iterations) {
+  for (int i = 0; i < CTR_NSOURCES; i++) {
+    n[i] = totals.n[i];
+    if (n[i] == 0) {
+      avg[i] = NAN;
+    } else if (totals.cycles[i] > 0) {
+      avg[i] = totals.sum[i] * totals.allcycles / totals.cycles[i] /
+        totals.frames;
+    } else {
+      avg[i] = totals.sum[i] / n[i];
+    }
+  }
+  iterations = totals.iterframes ?
+    totals.iterations / totals.iterframes : 0;
+}
+
+void counters_stats(CounterStats &s) {
+  double avg[CTR_NSOURCES];
+  unsigned n[CTR_NSOURCES];
+  double iterations;
+  averages(avg, n, iterations);
+  s.frames = totals.frames;
+  work_out(s, avg, iterations);
+}
+
+// As a percentage, or n/a if there was nothing to work it out from
+// (no QPU cycles with -b cpu, or the counters not sampled yet)
+static void print_percent(FILE *f, double v, int decimals) {
+  if (isnan(v)) fprintf(f, "n/a");
+  else fprintf(f, "%.*f%%", decimals, 100*v);
+}
+
+void counters_print(FILE *f) {
+  if (totals.frames == 0) return;
+  double avg[CTR_NSOURCES];
+  unsigned n[CTR_NSOURCES];
+  double iterations;
+  averages(avg, n, iterations);
+  fprintf(f, "Performance counters, average per frame (frames sampled):\n");
+  for (int i = 0; i < CTR_NSOURCES; i++) {
+    // Leave out the ones only a 3D pipeline would bother
+    if (n[i] == 0 || (i < CTR_QPU_TOTAL_IDLE && avg[i] == 0)) continue;
+    fprintf(f, "%-28s %14.0f (%u)\n", names[i], avg[i], n[i]);
+  }
+  CounterStats s;
+  counters_stats(s);
+  if (isnan(s.utilisation) && isnan(s.vdwshare) && isnan(s.icachehits) &&
+      isnan(s.ucachehits) && isnan(s.l2hits)) {
+    return;
+  }
+  fprintf(f, "QPU utilisation ");
+  print_percent(f, s.utilisation, 1);
+  fprintf(f, ", VDW stalls ");
+  print_percent(f, s.vdwshare, 1);
+  fprintf(f, " of busy cycles\n");
+  fprintf(f, "Hit rates: icache ");
+  print_percent(f, s.icachehits, 2);
+  fprintf(f, ", ucache ");
+  print_percent(f, s.ucachehits, 2);
+  fprintf(f, ", L2 ");
+  print_percent(f, s.l2hits, 2);
+  fprintf(f, "\n");
+  if (!isnan(s.itersperqpucycle)) {
+    fprintf(f, "Iterations per QPU cycle %.3f\n", s.itersperqpucycle);
+  }
+}
+
+static void print_value(FILE *f, double v) {
+  if (isnan(v)) fprintf(f, ",");
+  else fprintf(f, ",%.6g", v);
+}
+
+bool counters_write_csv(const char *filename) {
+  FILE *f = fopen(filename, "w");
+  if (!f) {
+    perror(filename);
+    return false;
+  }
+  fprintf(f, "frame,group,usecs,iterations");
+  for (int i = 0; i < CTR_NSOURCES; i++) fprintf(f, ",%s", names[i]);
+  fprintf(f, ",utilisation,vdwshare,icachehits,ucachehits,l2hits,"
+          "itersperqpucycle");
+  for (size_t i = 0; i < extranames.size(); i++) {
+    fprintf(f, ",%s", extranames[i]);
+  }
+  fprintf(f, "\n");
+  for (size_t j = 0; j < frames.size(); j++) {
+    const CounterFrame &fr = frames[j];
+    fprintf(f, "%u,%d,%u,%llu", fr.frame, fr.group, fr.usecs,
+            (unsigned long long)fr.iterations);
+    for (int i = 0; i < CTR_NSOURCES; i++) {
+      if ((fr.sampled >> i) & 1) fprintf(f, ",%u", fr.values[i]);
+      else fprintf(f, ",");
+    }
+    CounterStats s;
+    frame_stats(fr, s);
+    print_value(f, s.utilisation);
+    print_value(f, s.vdwshare);
+    print_value(f, s.icachehits);
+    print_value(f, s.ucachehits);
+    print_value(f, s.l2hits);
+    print_value(f, s.itersperqpucycle);
+    for (size_t i = 0; i < extranames.size(); i++) {
+      print_value(f, i < frameextras[j].size() ? frameextras[j][i] : NAN);
+    }
+    fprintf(f, "\n");
+  }
+  if (fclose(f) != 0) {
+    perror(filename);
+    return false;
+  }
+  return true;
+}
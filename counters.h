@@ -0,0 +1,68 @@
+// V3D performance counters.
+//
+// There are 30 counter sources but only 16 counters, so the sources
+// are split into groups which take turns, a frame each. Every group
+// has the sources the figures below need, QPU_TOTAL_IDLE and
+// QPU_TOTAL_VALID among them so frames sampled with different groups
+// can be put on the same footing, and some of the other QPU ones. The
+// 3D pipeline's are left out. The values are
+// added up for the averages and some figures worked out from them, and
+// the last 10000 frames' are kept, along with their times and (if
+// known) the iterations they did, for a CSV file.
+
+// Counter sources (as set in V3D_PCTRS) the figures need
+enum {
+  CTR_QPU_TOTAL_IDLE = 13,
+  CTR_QPU_TOTAL_VALID = 16,
+  CTR_QPU_TOTAL_ICACHE_HITS = 20,
+  CTR_QPU_TOTAL_ICACHE_MISSES = 21,
+  CTR_QPU_TOTAL_UCACHE_HITS = 22,
+  CTR_QPU_TOTAL_UCACHE_MISSES = 23,
+  CTR_QPU_TOTAL_VDW_STALL = 26,
+  CTR_QPU_TOTAL_L2_HITS = 28,
+  CTR_QPU_TOTAL_L2_MISSES = 29,
+  CTR_NSOURCES = 30
+};
+
+// Program the first group and enable the counters. regs is the
+// mapping of the V3D registers (the real ones or -D fake's).
+void counters_setup(volatile uint32_t *regs);
+
+// Before a frame
+void counters_clear();
+
+// After a frame: keep the current group's values, with the frame time
+// and number of iterations (0 if not known), and move on to the next
+// group.
+void counters_read(unsigned frame, unsigned usecs, uint64_t iterations);
+
+// Keep a frame with every source, from read(source), for counters that
+// don't need multiplexing (the simulator's).
+void counters_record(uint32_t (*read)(int source), unsigned frame,
+                     unsigned usecs, uint64_t iterations);
+
+// Figures from the host side (eg. the tile cache's) for the current
+// frame, kept with it by the next counters_read or counters_record and
+// written as extra columns of the CSV. name must stay valid.
+void counters_extra(const char *name, double value);
+
+// Worked out from the averages over all the frames, or NAN if the
+// counters they need were never sampled.
+struct CounterStats {
+  unsigned frames;
+  double utilisation;      // QPU_TOTAL_VALID / (VALID + IDLE)
+  double vdwshare;         // VDW_STALL / (VALID + VDW_STALL)
+  double icachehits;       // Hit rates
+  double ucachehits;
+  double l2hits;
+  double itersperqpucycle; // Iterations / (VALID + IDLE)
+};
+void counters_stats(CounterStats &stats);
+
+// Average of each source per frame, and the stats
+void counters_print(FILE *f);
+
+// One line per frame kept: its number, group, time and iterations, every
+// source (empty if not in that frame's group) and the stats for the
+// frame alone. Returns false on error.
+bool counters_write_csv(const char *filename);
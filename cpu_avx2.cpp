@@ -0,0 +1,63 @@
+// AVX2 kernel: 8 lanes, so 2 vectors for 16 points.
+// Compiled with -mavx2, only called if the CPU supports it.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "cpukernel.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+struct AVX2 {
+  enum { W = 8 };
+  typedef __m256 F;
+  typedef __m256i M;
+  typedef __m256i I;
+  static F load(const float *p) { return _mm256_loadu_ps(p); }
+  static F set1(float a) { return _mm256_set1_ps(a); }
+  static F add(F a, F b) { return _mm256_add_ps(a, b); }
+  static F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+  static F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+  static M le(F a, F b) {
+    return _mm256_castps_si256(_mm256_cmp_ps(a, b, _CMP_LE_OQ));
+  }
+  static M lt(F a, F b) {
+    return _mm256_castps_si256(_mm256_cmp_ps(a, b, _CMP_LT_OQ));
+  }
+  static M all() { return _mm256_set1_epi32(-1); }
+  static M none() { return _mm256_setzero_si256(); }
+  static M mand(M a, M b) { return _mm256_and_si256(a, b); }
+  static M mor(M a, M b) { return _mm256_or_si256(a, b); }
+  static bool empty(M a) { return _mm256_testz_si256(a, a); }
+  static I zero() { return _mm256_setzero_si256(); }
+  static I inc(I a, M m) { return _mm256_sub_epi32(a, m); }
+  static I set(I a, M m, uint32_t n) {
+    return _mm256_blendv_epi8(a, _mm256_set1_epi32(n), m);
+  }
+  static void store(uint32_t *p, I a) {
+    _mm256_storeu_si256((__m256i*)p, a);
+  }
+  static void storef(float *p, F a) { _mm256_storeu_ps(p, a); }
+};
+
+void cpu_kernel_avx2(const float *cx, const float *cy,
+                     int maxiterations, uint32_t *res)
+{
+  mandel16<AVX2>(cx, cy, maxiterations, res);
+}
+
+void cpu_kernel_avx2_run(const float *cx, const float *cy,
+                         float *zx, float *zy, uint32_t start,
+                         int maxiterations, uint32_t *res)
+{
+  mandel16_run<AVX2>(cx, cy, zx, zy, start, maxiterations, res);
+}
+
+void cpu_kernel_avx2_df(const float *cx, const float *cxlo,
+                        const float *cy, const float *cylo,
+                        int maxiterations, uint32_t *res)
+{
+  mandel16_df<AVX2>(cx, cxlo, cy, cylo, maxiterations, res);
+}
+#endif
@@ -0,0 +1,59 @@
+// AVX-512 kernel: 16 lanes, so one vector does the lot, just like a QPU.
+// Compiled with -mavx512f, only called if the CPU supports it.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "cpukernel.h"
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+
+struct AVX512 {
+  enum { W = 16 };
+  typedef __m512 F;
+  typedef __mmask16 M;
+  typedef __m512i I;
+  static F load(const float *p) { return _mm512_loadu_ps(p); }
+  static F set1(float a) { return _mm512_set1_ps(a); }
+  static F add(F a, F b) { return _mm512_add_ps(a, b); }
+  static F sub(F a, F b) { return _mm512_sub_ps(a, b); }
+  static F mul(F a, F b) { return _mm512_mul_ps(a, b); }
+  static M le(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+  static M lt(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+  static M all() { return 0xffff; }
+  static M none() { return 0; }
+  static M mand(M a, M b) { return a & b; }
+  static M mor(M a, M b) { return a | b; }
+  static bool empty(M a) { return a == 0; }
+  static I zero() { return _mm512_setzero_si512(); }
+  static I inc(I a, M m) {
+    return _mm512_mask_add_epi32(a, m, a, _mm512_set1_epi32(1));
+  }
+  static I set(I a, M m, uint32_t n) {
+    return _mm512_mask_mov_epi32(a, m, _mm512_set1_epi32(n));
+  }
+  static void store(uint32_t *p, I a) { _mm512_storeu_si512(p, a); }
+  static void storef(float *p, F a) { _mm512_storeu_ps(p, a); }
+};
+
+void cpu_kernel_avx512(const float *cx, const float *cy,
+                       int maxiterations, uint32_t *res)
+{
+  mandel16<AVX512>(cx, cy, maxiterations, res);
+}
+
+void cpu_kernel_avx512_run(const float *cx, const float *cy,
+                           float *zx, float *zy, uint32_t start,
+                           int maxiterations, uint32_t *res)
+{
+  mandel16_run<AVX512>(cx, cy, zx, zy, start, maxiterations, res);
+}
+
+void cpu_kernel_avx512_df(const float *cx, const float *cxlo,
+                          const float *cy, const float *cylo,
+                          int maxiterations, uint32_t *res)
+{
+  mandel16_df<AVX512>(cx, cxlo, cy, cylo, maxiterations, res);
+}
+#endif
@@ -0,0 +1,62 @@
+// NEON kernel: 4 lanes, so 4 vectors for 16 points.
+// On the Pi 2 this is compiled with -mfpu=neon-vfpv4. Built without
+// NEON (the ARMv6 Pis) it's empty, and cpurender.cpp doesn't list it.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "cpukernel.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+struct NEON {
+  enum { W = 4 };
+  typedef float32x4_t F;
+  typedef uint32x4_t M;
+  typedef uint32x4_t I;
+  static F load(const float *p) { return vld1q_f32(p); }
+  static F set1(float a) { return vdupq_n_f32(a); }
+  static F add(F a, F b) { return vaddq_f32(a, b); }
+  static F sub(F a, F b) { return vsubq_f32(a, b); }
+  static F mul(F a, F b) { return vmulq_f32(a, b); }
+  static M le(F a, F b) { return vcleq_f32(a, b); }
+  static M lt(F a, F b) { return vcltq_f32(a, b); }
+  static M all() { return vdupq_n_u32(0xffffffff); }
+  static M none() { return vdupq_n_u32(0); }
+  static M mand(M a, M b) { return vandq_u32(a, b); }
+  static M mor(M a, M b) { return vorrq_u32(a, b); }
+  static bool empty(M a) {
+    // No horizontal max on ARMv7
+    uint32x2_t t = vorr_u32(vget_low_u32(a), vget_high_u32(a));
+    return vget_lane_u32(vpmax_u32(t, t), 0) == 0;
+  }
+  static I zero() { return vdupq_n_u32(0); }
+  static I inc(I a, M m) { return vsubq_u32(a, m); }
+  static I set(I a, M m, uint32_t n) {
+    return vbslq_u32(m, vdupq_n_u32(n), a);
+  }
+  static void store(uint32_t *p, I a) { vst1q_u32(p, a); }
+  static void storef(float *p, F a) { vst1q_f32(p, a); }
+};
+
+void cpu_kernel_neon(const float *cx, const float *cy,
+                     int maxiterations, uint32_t *res)
+{
+  mandel16<NEON>(cx, cy, maxiterations, res);
+}
+
+void cpu_kernel_neon_run(const float *cx, const float *cy,
+                         float *zx, float *zy, uint32_t start,
+                         int maxiterations, uint32_t *res)
+{
+  mandel16_run<NEON>(cx, cy, zx, zy, start, maxiterations, res);
+}
+
+void cpu_kernel_neon_df(const float *cx, const float *cxlo,
+                        const float *cy, const float *cylo,
+                        int maxiterations, uint32_t *res)
+{
+  mandel16_df<NEON>(cx, cxlo, cy, cylo, maxiterations, res);
+}
+#endif
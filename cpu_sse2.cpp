@@ -0,0 +1,58 @@
+// SSE2 kernel: 4 lanes, so 4 vectors for 16 points.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "cpukernel.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+struct SSE2 {
+  enum { W = 4 };
+  typedef __m128 F;
+  typedef __m128i M;
+  typedef __m128i I;
+  static F load(const float *p) { return _mm_loadu_ps(p); }
+  static F set1(float a) { return _mm_set1_ps(a); }
+  static F add(F a, F b) { return _mm_add_ps(a, b); }
+  static F sub(F a, F b) { return _mm_sub_ps(a, b); }
+  static F mul(F a, F b) { return _mm_mul_ps(a, b); }
+  static M le(F a, F b) { return _mm_castps_si128(_mm_cmple_ps(a, b)); }
+  static M lt(F a, F b) { return _mm_castps_si128(_mm_cmplt_ps(a, b)); }
+  static M all() { return _mm_set1_epi32(-1); }
+  static M none() { return _mm_setzero_si128(); }
+  static M mand(M a, M b) { return _mm_and_si128(a, b); }
+  static M mor(M a, M b) { return _mm_or_si128(a, b); }
+  static bool empty(M a) { return _mm_movemask_epi8(a) == 0; }
+  static I zero() { return _mm_setzero_si128(); }
+  // Mask lanes are all ones, ie. -1
+  static I inc(I a, M m) { return _mm_sub_epi32(a, m); }
+  static I set(I a, M m, uint32_t n) {
+    return _mm_or_si128(_mm_andnot_si128(m, a),
+                        _mm_and_si128(m, _mm_set1_epi32(n)));
+  }
+  static void store(uint32_t *p, I a) { _mm_storeu_si128((__m128i*)p, a); }
+  static void storef(float *p, F a) { _mm_storeu_ps(p, a); }
+};
+
+void cpu_kernel_sse2(const float *cx, const float *cy,
+                     int maxiterations, uint32_t *res)
+{
+  mandel16<SSE2>(cx, cy, maxiterations, res);
+}
+
+void cpu_kernel_sse2_run(const float *cx, const float *cy,
+                         float *zx, float *zy, uint32_t start,
+                         int maxiterations, uint32_t *res)
+{
+  mandel16_run<SSE2>(cx, cy, zx, zy, start, maxiterations, res);
+}
+
+void cpu_kernel_sse2_df(const float *cx, const float *cxlo,
+                        const float *cy, const float *cylo,
+                        int maxiterations, uint32_t *res)
+{
+  mandel16_df<SSE2>(cx, cxlo, cy, cylo, maxiterations, res);
+}
+#endif
@@ -0,0 +1,316 @@
+// The escape time loop, written once for any vector unit.
+//
+// A vector class V provides W lanes of float (F), a lane mask (M) and
+// a vector of counters (I), plus a few static operations on them. The
+// 16 points are held in 16/W vectors, which are stepped together.
+//
+// As in mandel.qasm, each point is given an increment that is cleared
+// once the point has escaped, and we only leave the loop when every
+// point has escaped (or we reach maxiterations). The loop is unrolled
+// in the same way, so maxiterations is rounded up to a multiple of
+// UNROLL.
+//
+// Points that will never escape are retired early and given the full
+// count: those in the main cardioid or the period 2 bulb before we
+// start, and those whose orbit comes back to where it was (Brent's
+// method: z is saved after 1, 2, 4, 8... groups of UNROLL iterations
+// and compared with z at the end of each group). The tests are the
+// ones mandel.qasm does, in the same order, so the counts match.
+//
+// mandel16_run can also carry on from where an earlier call (with a
+// lower maxiterations) left off, see cpu_render_state.
+
+#define UNROLL 4
+
+// Square of the distance that counts as coming back
+#define PERIOD_EPS 1e-12f
+
+// Count given by mandel16_run to points known to be inside the set
+#define COUNT_INSIDE 0x80000000u
+
+// If zx is NULL, start from z = c, as mandel16. Otherwise carry on from
+// z = (zx,zy), every point having done start iterations without
+// escaping, and leave z there for next time. Points found to be inside
+// the set then get COUNT_INSIDE, rather than the full count.
+template <class V>
+static inline void mandel16_run(const float *cx, const float *cy,
+                                float *zx, float *zy, uint32_t start,
+                                int maxiterations, uint32_t *res)
+{
+  enum { N = 16/V::W };
+  typename V::F x0[N], y0[N], x[N], y[N], x2[N], xs[N], ys[N];
+  typename V::M active[N];
+  typename V::I count[N];
+  const typename V::F four = V::set1(4.0f);
+  const typename V::F quarter = V::set1(0.25f);
+  const typename V::F sixteenth = V::set1(0.0625f);
+  const typename V::F eps = V::set1(PERIOD_EPS);
+  const uint32_t total = (maxiterations + UNROLL-1) / UNROLL * UNROLL;
+  const uint32_t inside = zx ? COUNT_INSIDE : total;
+  typename V::M any = V::none();
+  for (int k = 0; k < N; k++) {
+    x0[k] = V::load(cx + k*V::W);
+    y0[k] = V::load(cy + k*V::W);
+    if (start > 0) {
+      x[k] = xs[k] = V::load(zx + k*V::W);
+      y[k] = ys[k] = V::load(zy + k*V::W);
+      x2[k] = V::mul(x[k], x[k]);
+      active[k] = any = V::all();
+      count[k] = V::set(V::zero(), V::all(), start);
+      continue;
+    }
+    x[k] = xs[k] = x0[k];
+    y[k] = ys[k] = y0[k];
+    x2[k] = V::mul(x[k], x[k]);
+    // In the cardioid if q(q + x - 1/4) < y^2/4, where
+    // q = (x - 1/4)^2 + y^2, in the bulb if (x + 1)^2 + y^2 < 1/16.
+    typename V::F y2 = V::mul(y[k], y[k]);
+    typename V::F xq = V::sub(x[k], quarter);
+    typename V::F xb = V::add(x[k], V::set1(1.0f));
+    typename V::F q = V::add(V::mul(xq, xq), y2);
+    typename V::F b = V::add(V::mul(xb, xb), y2);
+    typename V::F lhs = V::mul(q, V::add(q, xq));
+    typename V::F rhs = V::mul(y2, quarter);
+    active[k] = V::mand(V::le(rhs, lhs), V::le(sixteenth, b));
+    any = V::mor(any, active[k]);
+    count[k] = V::set(V::zero(),
+                      V::mor(V::lt(lhs, rhs), V::lt(b, sixteenth)), inside);
+  }
+  if (V::empty(any)) goto done;
+  for (int i = maxiterations - (int)start, group = 1, countdown = 1; i > 0;
+       i -= UNROLL, group++) {
+    for (int u = 0; u < UNROLL; u++) {
+      // Last of the group (before its step, like mandel.qasm)?
+      bool check = u == UNROLL-1;
+      bool save = check && --countdown == 0;
+      if (save) countdown = group;
+      any = V::none();
+      for (int k = 0; k < N; k++) {
+        typename V::F y2 = V::mul(y[k], y[k]);
+        typename V::F xy = V::mul(x[k], y[k]);
+        active[k] = V::mand(active[k], V::le(V::add(x2[k], y2), four));
+        if (check) {
+          typename V::F dx = V::sub(x[k], xs[k]);
+          typename V::F dy = V::sub(y[k], ys[k]);
+          typename V::F d = V::add(V::mul(dx, dx), V::mul(dy, dy));
+          count[k] = V::set(count[k], V::lt(d, eps), inside);
+          active[k] = V::mand(active[k], V::le(eps, d));
+          if (save) {
+            xs[k] = x[k];
+            ys[k] = y[k];
+          }
+        }
+        any = V::mor(any, active[k]);
+        x[k] = V::add(x0[k], V::sub(x2[k], y2));
+        y[k] = V::add(y0[k], V::add(xy, xy));
+        count[k] = V::inc(count[k], active[k]);
+        x2[k] = V::mul(x[k], x[k]);
+      }
+      if (V::empty(any)) goto done;
+    }
+  }
+ done:
+  for (int k = 0; k < N; k++) {
+    V::store(res + k*V::W, count[k]);
+    if (zx) {
+      V::storef(zx + k*V::W, x[k]);
+      V::storef(zy + k*V::W, y[k]);
+    }
+  }
+}
+
+template <class V>
+static inline void mandel16(const float *cx, const float *cy,
+                            int maxiterations, uint32_t *res)
+{
+  mandel16_run<V>(cx, cy, NULL, NULL, 0, maxiterations, res);
+}
+
+// Double-float version of the same loop, for views too deep for floats.
+//
+// Each number is an unevaluated sum hi + lo of two floats, giving about
+// 48 bits of mantissa. Products and sums are made exact with Dekker's
+// split and Knuth's two-sum, which need round-to-nearest and no fused
+// multiply-adds (hence -ffp-contract=off). Everything is done in the
+// same order as mandel_df.qasm, so the counts match it. The squares
+// (whose high words also do for the escape test) and xy share the
+// splits of x and y.
+//
+// There's no unrolling here, the loop body being long enough already.
+
+#define DF_SPLIT 4097.0f // 2^12 + 1, splits a float into two 12 bit halves
+
+template <class V>
+struct DF {
+  typename V::F hi, lo;
+};
+
+// hi + lo = a, each with at most 12 bits
+template <class V>
+static inline void split(typename V::F a, typename V::F &hi, typename V::F &lo)
+{
+  typename V::F t = V::mul(a, V::set1(DF_SPLIT));
+  hi = V::sub(t, V::sub(t, a));
+  lo = V::sub(a, hi);
+}
+
+// p + e = a * b exactly
+template <class V>
+static inline void two_prod(typename V::F a, typename V::F b,
+                            typename V::F &p, typename V::F &e)
+{
+  typename V::F ah, al, bh, bl;
+  p = V::mul(a, b);
+  split<V>(a, ah, al);
+  split<V>(b, bh, bl);
+  e = V::sub(V::mul(ah, bh), p);
+  e = V::add(e, V::mul(ah, bl));
+  e = V::add(e, V::mul(al, bh));
+  e = V::add(e, V::mul(al, bl));
+}
+
+// s + e = a + b exactly
+template <class V>
+static inline void two_sum(typename V::F a, typename V::F b,
+                           typename V::F &s, typename V::F &e)
+{
+  s = V::add(a, b);
+  typename V::F bb = V::sub(s, a);
+  e = V::add(V::sub(a, V::sub(s, bb)), V::sub(b, bb));
+}
+
+// s + e = a - b exactly
+template <class V>
+static inline void two_diff(typename V::F a, typename V::F b,
+                            typename V::F &s, typename V::F &e)
+{
+  s = V::sub(a, b);
+  typename V::F bb = V::sub(s, a);
+  e = V::sub(V::sub(a, V::sub(s, bb)), V::add(b, bb));
+}
+
+// a + b, which needn't be normalised
+template <class V>
+static inline DF<V> df_add(const DF<V> &a, const DF<V> &b)
+{
+  typename V::F s, e;
+  two_sum<V>(a.hi, b.hi, s, e);
+  e = V::add(e, V::add(a.lo, b.lo));
+  // Renormalise, now |s| >= |e|
+  DF<V> r;
+  r.hi = V::add(s, e);
+  r.lo = V::sub(e, V::sub(r.hi, s));
+  return r;
+}
+
+// One step of z^2 + c, returning |z|^2 (well, of the high words) from
+// before the step.
+template <class V>
+static inline typename V::F df_step(DF<V> &x, DF<V> &y,
+                                    const DF<V> &x0, const DF<V> &y0)
+{
+  const typename V::F two = V::set1(2.0f);
+  typename V::F xh, xl, yh, yl;
+  split<V>(x.hi, xh, xl);
+  split<V>(y.hi, yh, yl);
+  // x^2, with 2 xh xl counted once
+  typename V::F x2 = V::mul(x.hi, x.hi);
+  typename V::F x2e = V::sub(V::mul(xh, xh), x2);
+  x2e = V::add(x2e, V::mul(V::mul(xh, xl), two));
+  x2e = V::add(x2e, V::mul(xl, xl));
+  x2e = V::add(x2e, V::mul(V::mul(x.hi, x.lo), two));
+  // y^2
+  typename V::F y2 = V::mul(y.hi, y.hi);
+  typename V::F y2e = V::sub(V::mul(yh, yh), y2);
+  y2e = V::add(y2e, V::mul(V::mul(yh, yl), two));
+  y2e = V::add(y2e, V::mul(yl, yl));
+  y2e = V::add(y2e, V::mul(V::mul(y.hi, y.lo), two));
+  // xy
+  DF<V> xy;
+  xy.hi = V::mul(x.hi, y.hi);
+  xy.lo = V::sub(V::mul(xh, yh), xy.hi);
+  xy.lo = V::add(xy.lo, V::mul(xh, yl));
+  xy.lo = V::add(xy.lo, V::mul(xl, yh));
+  xy.lo = V::add(xy.lo, V::mul(xl, yl));
+  xy.lo = V::add(xy.lo, V::add(V::mul(x.hi, y.lo), V::mul(x.lo, y.hi)));
+  // x^2 - y^2 + x0
+  DF<V> re;
+  two_diff<V>(x2, y2, re.hi, re.lo);
+  re.lo = V::add(re.lo, V::sub(x2e, y2e));
+  x = df_add<V>(re, x0);
+  // 2xy + y0
+  xy.hi = V::mul(xy.hi, two);
+  xy.lo = V::mul(xy.lo, two);
+  y = df_add<V>(xy, y0);
+  return V::add(x2, y2);
+}
+
+template <class V>
+static inline void mandel16_df(const float *cx, const float *cxlo,
+                               const float *cy, const float *cylo,
+                               int maxiterations, uint32_t *res)
+{
+  enum { N = 16/V::W };
+  DF<V> x0[N], y0[N], x[N], y[N];
+  typename V::M active[N];
+  typename V::I count[N];
+  const typename V::F four = V::set1(4.0f);
+  for (int k = 0; k < N; k++) {
+    x0[k].hi = V::load(cx + k*V::W);
+    x0[k].lo = V::load(cxlo + k*V::W);
+    y0[k].hi = V::load(cy + k*V::W);
+    y0[k].lo = V::load(cylo + k*V::W);
+    x[k] = x0[k];
+    y[k] = y0[k];
+    active[k] = V::all();
+    count[k] = V::zero();
+  }
+  for (int i = maxiterations; i > 0; i--) {
+    typename V::M any = V::none();
+    for (int k = 0; k < N; k++) {
+      typename V::F r2 = df_step<V>(x[k], y[k], x0[k], y0[k]);
+      active[k] = V::mand(active[k], V::le(r2, four));
+      any = V::mor(any, active[k]);
+      count[k] = V::inc(count[k], active[k]);
+    }
+    if (V::empty(any)) break;
+  }
+  for (int k = 0; k < N; k++) {
+    V::store(res + k*V::W, count[k]);
+  }
+}
+
+void cpu_kernel_sse2(const float *cx, const float *cy,
+                     int maxiterations, uint32_t *res);
+void cpu_kernel_avx2(const float *cx, const float *cy,
+                     int maxiterations, uint32_t *res);
+void cpu_kernel_avx512(const float *cx, const float *cy,
+                       int maxiterations, uint32_t *res);
+void cpu_kernel_neon(const float *cx, const float *cy,
+                     int maxiterations, uint32_t *res);
+
+void cpu_kernel_sse2_df(const float *cx, const float *cxlo,
+                        const float *cy, const float *cylo,
+                        int maxiterations, uint32_t *res);
+void cpu_kernel_avx2_df(const float *cx, const float *cxlo,
+                        const float *cy, const float *cylo,
+                        int maxiterations, uint32_t *res);
+void cpu_kernel_avx512_df(const float *cx, const float *cxlo,
+                          const float *cy, const float *cylo,
+                          int maxiterations, uint32_t *res);
+void cpu_kernel_neon_df(const float *cx, const float *cxlo,
+                        const float *cy, const float *cylo,
+                        int maxiterations, uint32_t *res);
+
+void cpu_kernel_sse2_run(const float *cx, const float *cy,
+                         float *zx, float *zy, uint32_t start,
+                         int maxiterations, uint32_t *res);
+void cpu_kernel_avx2_run(const float *cx, const float *cy,
+                         float *zx, float *zy, uint32_t start,
+                         int maxiterations, uint32_t *res);
+void cpu_kernel_avx512_run(const float *cx, const float *cy,
+                           float *zx, float *zy, uint32_t start,
+                           int maxiterations, uint32_t *res);
+void cpu_kernel_neon_run(const float *cx, const float *cy,
+                         float *zx, float *zy, uint32_t start,
+                         int maxiterations, uint32_t *res);
@@ -0,0 +1,465 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <float.h>
+#include <algorithm>
+#if defined(__arm__) || defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "cpurender.h"
+#include "cpukernel.h"
+
+// Plain C version, for reference and for CPUs we don't know about.
+// One lane per "vector", so the template does all the work.
+struct Scalar {
+  enum { W = 1 };
+  typedef float F;
+  typedef uint32_t M;
+  typedef uint32_t I;
+  static F load(const float *p) { return *p; }
+  static F set1(float a) { return a; }
+  static F add(F a, F b) { return a + b; }
+  static F sub(F a, F b) { return a - b; }
+  static F mul(F a, F b) { return a * b; }
+  static M le(F a, F b) { return a <= b ? ~0U : 0; }
+  static M lt(F a, F b) { return a < b ? ~0U : 0; }
+  static M all() { return ~0U; }
+  static M none() { return 0; }
+  static M mand(M a, M b) { return a & b; }
+  static M mor(M a, M b) { return a | b; }
+  static bool empty(M a) { return a == 0; }
+  static I zero() { return 0; }
+  static I inc(I a, M m) { return a - m; }
+  static I set(I a, M m, uint32_t n) { return m ? n : a; }
+  static void store(uint32_t *p, I a) { *p = a; }
+  static void storef(float *p, F a) { *p = a; }
+};
+
+static void cpu_kernel_scalar(const float *cx, const float *cy,
+                              int maxiterations, uint32_t *res)
+{
+  mandel16<Scalar>(cx, cy, maxiterations, res);
+}
+
+static void cpu_kernel_scalar_run(const float *cx, const float *cy,
+                                  float *zx, float *zy, uint32_t start,
+                                  int maxiterations, uint32_t *res)
+{
+  mandel16_run<Scalar>(cx, cy, zx, zy, start, maxiterations, res);
+}
+
+static void cpu_kernel_scalar_df(const float *cx, const float *cxlo,
+                                 const float *cy, const float *cylo,
+                                 int maxiterations, uint32_t *res)
+{
+  mandel16_df<Scalar>(cx, cxlo, cy, cylo, maxiterations, res);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static bool have_sse2() { return __builtin_cpu_supports("sse2"); }
+static bool have_avx2() { return __builtin_cpu_supports("avx2"); }
+static bool have_avx512() { return __builtin_cpu_supports("avx512f"); }
+#endif
+// CPU_NEON comes from the Makefile, when cpu_neon.cpp is built for NEON
+#if defined(CPU_NEON) && defined(__aarch64__)
+static bool have_neon() { return true; }
+#elif defined(CPU_NEON)
+static bool have_neon() { return getauxval(AT_HWCAP) & HWCAP_NEON; }
+#endif
+static bool have_scalar() { return true; }
+
+struct CpuKernelDesc {
+  const char *name;
+  CpuKernel kernel;
+  CpuKernelDF dfkernel;
+  CpuKernelRun runkernel;
+  bool (*supported)();
+};
+
+// Widest first.
+static const CpuKernelDesc kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+  { "avx512", cpu_kernel_avx512, cpu_kernel_avx512_df,
+    cpu_kernel_avx512_run, have_avx512 },
+  { "avx2", cpu_kernel_avx2, cpu_kernel_avx2_df,
+    cpu_kernel_avx2_run, have_avx2 },
+  { "sse2", cpu_kernel_sse2, cpu_kernel_sse2_df,
+    cpu_kernel_sse2_run, have_sse2 },
+#endif
+#ifdef CPU_NEON
+  { "neon", cpu_kernel_neon, cpu_kernel_neon_df,
+    cpu_kernel_neon_run, have_neon },
+#endif
+  { "scalar", cpu_kernel_scalar, cpu_kernel_scalar_df,
+    cpu_kernel_scalar_run, have_scalar },
+};
+
+#define NKERNELS (sizeof(kernels)/sizeof(kernels[0]))
+
+static const CpuKernelDesc *kernel = NULL;
+
+bool cpu_select(const char *name)
+{
+  bool any = name == NULL || strcmp(name, "auto") == 0;
+  for (unsigned i = 0; i < NKERNELS; i++) {
+    if (!any && strcmp(name, kernels[i].name) != 0) continue;
+    if (!kernels[i].supported()) {
+      if (any) continue;
+      fprintf(stderr, "CPU doesn't support %s kernel\n", name);
+      return false;
+    }
+    kernel = &kernels[i];
+    return true;
+  }
+  fprintf(stderr, "No such CPU kernel: %s\n", name);
+  return false;
+}
+
+const char *cpu_kernel_name()
+{
+  if (!kernel) cpu_select(NULL);
+  return kernel->name;
+}
+
+void cpu_list_kernels(FILE *fp)
+{
+  for (unsigned i = 0; i < NKERNELS; i++) {
+    fprintf(fp, "%s%s\n", kernels[i].name,
+            kernels[i].supported() ? "" : " (unsupported)");
+  }
+}
+
+// Beyond this the pixels are only a few floats apart (near |z| = 2, where
+// the orbits mostly are) and the picture goes blocky.
+#define DF_THRESHOLD (64*FLT_EPSILON)
+
+// Out of line because GCC 12's vectoriser, combining the three calls in
+// view_params, loses the rounding to float and makes lo zero.
+__attribute__((noinline))
+static void split_double(double d, float &hi, float &lo)
+{
+  hi = d;
+  lo = d - hi;
+}
+
+void view_params(RenderParams &params, double xcentre, double ycentre,
+                 double xscale, int width, int height, int maxiterations)
+{
+  params.maxiterations = maxiterations;
+  double scale = 1/(xscale * height/2);
+  params.precise = scale < DF_THRESHOLD;
+  if (params.precise) {
+    split_double(scale, params.scale, params.scalelo);
+    split_double(xcentre-scale*width/2, params.xorigin, params.xoriginlo);
+    split_double(ycentre-scale*height/2, params.yorigin, params.yoriginlo);
+  } else {
+    // All in float, as it always was
+    params.scale = 1/((float)xscale * height/2);
+    params.xorigin = (float)xcentre-params.scale*width/2;
+    params.yorigin = (float)ycentre-params.scale*height/2;
+    params.scalelo = params.xoriginlo = params.yoriginlo = 0;
+  }
+  params.col0 = params.row0 = 0;
+}
+
+void origin_params(RenderParams &params, double xorigin, double yorigin,
+                   double scale, int maxiterations)
+{
+  params.maxiterations = maxiterations;
+  params.precise = scale < DF_THRESHOLD;
+  if (params.precise) {
+    split_double(scale, params.scale, params.scalelo);
+    split_double(xorigin, params.xorigin, params.xoriginlo);
+    split_double(yorigin, params.yorigin, params.yoriginlo);
+  } else {
+    params.scale = scale;
+    params.xorigin = xorigin;
+    params.yorigin = yorigin;
+    params.scalelo = params.xoriginlo = params.yoriginlo = 0;
+  }
+  params.col0 = params.row0 = 0;
+}
+
+// origin + i*scale, in double-float, as mandel_df.qasm does it. i is
+// a pixel number, or a fraction of one for cpu_render_samples.
+static inline void df_coord(float origin, float originlo,
+                            float scale, float scalelo, float i,
+                            float &hi, float &lo)
+{
+  DF<Scalar> o = { origin, originlo };
+  DF<Scalar> d;
+  two_prod<Scalar>(scale, i, d.hi, d.lo);
+  d.lo = d.lo + scalelo * i;
+  DF<Scalar> c = df_add<Scalar>(o, d);
+  hi = c.hi;
+  lo = c.lo;
+}
+
+void view_offset(RenderParams &params, int col, int row)
+{
+  params.col0 += col;
+  params.row0 += row;
+}
+
+// render_span for precise views.
+static inline void render_span_df(CpuKernelDF k, const RenderParams &params,
+                                  int col, int row, int n, uint32_t *res)
+{
+  float cx[16], cxlo[16], cy[16], cylo[16];
+  float y0, y0lo;
+  df_coord(params.yorigin, params.yoriginlo, params.scale, params.scalelo,
+           params.row0 + row, y0, y0lo);
+  for (int i = 0; i < 16; i++) {
+    cy[i] = y0;
+    cylo[i] = y0lo;
+  }
+  for (int i = 0; i < n; i++) {
+    df_coord(params.xorigin, params.xoriginlo, params.scale, params.scalelo,
+             params.col0 + col+i, cx[i], cxlo[i]);
+  }
+  for (int i = n; i < 16; i++) {
+    cx[i] = cx[n-1];
+    cxlo[i] = cxlo[n-1];
+  }
+  k(cx, cxlo, cy, cylo, params.maxiterations, res);
+}
+
+// Compute n <= 16 points along a row, starting at (col,row).
+static inline void render_span(CpuKernel k, const RenderParams &params,
+                               int col, int row, int n, uint32_t *res)
+{
+  if (params.precise) {
+    render_span_df(kernel->dfkernel, params, col, row, n, res);
+    return;
+  }
+  float cx[16], cy[16];
+  // Same float operations as the QPU, so same coordinates.
+  float y0 = params.yorigin + (float)(params.row0 + row) * params.scale;
+  for (int i = 0; i < 16; i++) cy[i] = y0;
+  for (int i = 0; i < n; i++) {
+    cx[i] = params.xorigin + (float)(params.col0 + col+i) * params.scale;
+  }
+  // Pad a partial vector with copies of the last point, which
+  // can't make the vector take any longer.
+  for (int i = n; i < 16; i++) cx[i] = cx[n-1];
+  k(cx, cy, params.maxiterations, res);
+}
+
+void cpu_render(const RenderParams &params,
+                int x, int y, int w, int h,
+                uint8_t *fb, int pitch)
+{
+  if (!kernel) cpu_select(NULL);
+  CpuKernel k = kernel->kernel;
+  uint32_t mask = params.maxiterations-1;
+  uint32_t res[16];
+  for (int row = y; row < y+h; row++) {
+    uint8_t *out = fb + row*pitch;
+    for (int col = x; col < x+w; col += 16) {
+      int n = std::min(16, x+w-col);
+      render_span(k, params, col, row, n, res);
+      for (int i = 0; i < n; i++) {
+        out[col+i] = res[i] & mask;
+      }
+    }
+  }
+}
+
+void cpu_render_counts(const RenderParams &params,
+                       int x, int y, int w, int h,
+                       uint32_t *counts, int stride)
+{
+  if (!kernel) cpu_select(NULL);
+  CpuKernel k = kernel->kernel;
+  uint32_t res[16];
+  for (int row = y; row < y+h; row++) {
+    uint32_t *out = counts + row*stride;
+    for (int col = x; col < x+w; col += 16) {
+      int n = std::min(16, x+w-col);
+      render_span(k, params, col, row, n, res);
+      memcpy(out+col, res, n*sizeof(uint32_t));
+    }
+  }
+}
+
+// cpu_render_points and cpu_render_samples, T being int or float.
+template <typename T>
+static void render_points(const RenderParams &params,
+                          const T *cols, const T *rows, int n,
+                          uint32_t *res)
+{
+  if (!kernel) cpu_select(NULL);
+  float cx[16], cxlo[16], cy[16], cylo[16];
+  uint32_t out[16];
+  for (int j = 0; j < n; j += 16) {
+    int m = std::min(16, n-j);
+    // Coordinates worked out exactly as render_span does
+    for (int i = 0; i < m; i++) {
+      float col = params.col0 + cols[j+i], row = params.row0 + rows[j+i];
+      if (params.precise) {
+        df_coord(params.xorigin, params.xoriginlo, params.scale,
+                 params.scalelo, col, cx[i], cxlo[i]);
+        df_coord(params.yorigin, params.yoriginlo, params.scale,
+                 params.scalelo, row, cy[i], cylo[i]);
+      } else {
+        cx[i] = params.xorigin + col * params.scale;
+        cy[i] = params.yorigin + row * params.scale;
+        cxlo[i] = cylo[i] = 0;
+      }
+    }
+    for (int i = m; i < 16; i++) {
+      cx[i] = cx[m-1];
+      cxlo[i] = cxlo[m-1];
+      cy[i] = cy[m-1];
+      cylo[i] = cylo[m-1];
+    }
+    if (params.precise) {
+      kernel->dfkernel(cx, cxlo, cy, cylo, params.maxiterations, out);
+    } else {
+      kernel->kernel(cx, cy, params.maxiterations, out);
+    }
+    memcpy(res+j, out, m*sizeof(uint32_t));
+  }
+}
+
+void cpu_render_points(const RenderParams &params,
+                       const int *cols, const int *rows, int n,
+                       uint32_t *res)
+{
+  render_points(params, cols, rows, n, res);
+}
+
+void cpu_render_samples(const RenderParams &params,
+                        const float *xs, const float *ys, int n,
+                        uint32_t *res)
+{
+  render_points(params, xs, ys, n, res);
+}
+
+// Pixels of one pass, gathered so the kernel gets whole vectors.
+static void render_pass_points(const RenderParams &params,
+                               const int *cols, const int *rows, int n,
+                               int step, int xend, int yend,
+                               uint8_t *fb, int pitch)
+{
+  uint32_t res[256];
+  uint32_t mask = params.maxiterations-1;
+  cpu_render_points(params, cols, rows, n, res);
+  for (int i = 0; i < n; i++) {
+    int w = std::min(step, xend - cols[i]);
+    int h = std::min(step, yend - rows[i]);
+    for (int y = rows[i]; y < rows[i] + h; y++) {
+      for (int x = cols[i]; x < cols[i] + w; x++) {
+        fb[y*pitch + x] = res[i] & mask;
+      }
+    }
+  }
+}
+
+void cpu_render_pass(const RenderParams &params,
+                     int x, int y, int w, int h, int step,
+                     uint8_t *fb, int pitch)
+{
+  int cols[256], rows[256];
+  int n = 0;
+  for (int row = y; row < y+h; row += step) {
+    for (int col = x; col < x+w; col += step) {
+      // Done by the pass before?
+      if (step < 4 && col % (2*step) == 0 && row % (2*step) == 0) continue;
+      cols[n] = col;
+      rows[n] = row;
+      if (++n == 256) {
+        render_pass_points(params, cols, rows, n, step, x+w, y+h, fb, pitch);
+        n = 0;
+      }
+    }
+  }
+  if (n > 0) {
+    render_pass_points(params, cols, rows, n, step, x+w, y+h, fb, pitch);
+  }
+}
+
+// Carry on the n pixels in batch, which have all done start iterations.
+static int run_batch(const RenderParams &params, PixelState **batch, int n,
+                     float *cx, float *cy, float *zx, float *zy,
+                     uint32_t start)
+{
+  const uint32_t total = (params.maxiterations + UNROLL-1) / UNROLL * UNROLL;
+  uint32_t res[16];
+  for (int i = n; i < 16; i++) {
+    cx[i] = cx[n-1];
+    cy[i] = cy[n-1];
+    zx[i] = zx[n-1];
+    zy[i] = zy[n-1];
+  }
+  kernel->runkernel(cx, cy, zx, zy, start, params.maxiterations, res);
+  for (int i = 0; i < n; i++) {
+    PixelState *s = batch[i];
+    if (res[i] == COUNT_INSIDE) {
+      s->flags = PIXEL_INSIDE;
+      continue;
+    }
+    s->count = res[i];
+    // Either it stopped early, or it has just gone over the limit and
+    // would stop at the next step anyway.
+    if (res[i] < total || !(zx[i]*zx[i] + zy[i]*zy[i] <= 4)) {
+      s->flags = PIXEL_ESCAPED;
+    } else {
+      s->x = zx[i];
+      s->y = zy[i];
+    }
+  }
+  return n;
+}
+
+int cpu_render_state(const RenderParams &params,
+                     int x, int y, int w, int h,
+                     PixelState *state, int stride,
+                     uint8_t *fb, int pitch)
+{
+  if (!kernel) cpu_select(NULL);
+  const uint32_t total = (params.maxiterations + UNROLL-1) / UNROLL * UNROLL;
+  PixelState *batch[16];
+  float cx[16], cy[16], zx[16], zy[16];
+  uint32_t start = 0;
+  int n = 0, iterated = 0;
+  for (int row = y; row < y+h; row++) {
+    for (int col = x; col < x+w; col++) {
+      PixelState *s = state + row*stride + col;
+      if (s->flags != PIXEL_RUNNING || s->count >= total) continue;
+      if (n > 0 && s->count != start) {
+        iterated += run_batch(params, batch, n, cx, cy, zx, zy, start);
+        n = 0;
+      }
+      // As render_span works them out
+      cx[n] = params.xorigin + (float)(params.col0 + col) * params.scale;
+      cy[n] = params.yorigin + (float)(params.row0 + row) * params.scale;
+      zx[n] = s->count > 0 ? s->x : cx[n];
+      zy[n] = s->count > 0 ? s->y : cy[n];
+      start = s->count;
+      batch[n] = s;
+      if (++n == 16) {
+        iterated += run_batch(params, batch, n, cx, cy, zx, zy, start);
+        n = 0;
+      }
+    }
+  }
+  if (n > 0) iterated += run_batch(params, batch, n, cx, cy, zx, zy, start);
+
+  // Anything that didn't escape by the limit, now or before, gets the
+  // full count, as the kernels would give it.
+  uint32_t mask = params.maxiterations-1;
+  for (int row = y; row < y+h; row++) {
+    const PixelState *s = state + row*stride;
+    uint8_t *out = fb + row*pitch;
+    for (int col = x; col < x+w; col++) {
+      uint32_t count = s[col].flags == PIXEL_INSIDE ? total
+        : std::min(s[col].count, total);
+      out[col] = count & mask;
+    }
+  }
+  return iterated;
+}
+
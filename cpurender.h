@@ -0,0 +1,112 @@
+// CPU implementation of the escape time loop in mandel.qasm.
+//
+// The kernels work on 16 points at a time, like a QPU, using whatever
+// vector unit the CPU has (SSE2, AVX2, AVX-512 or NEON), and produce
+// exactly the same iteration counts as the QPU code.
+
+struct RenderParams {
+  int maxiterations; // As passed in the uniforms, see setscale
+  float xorigin;
+  float yorigin;
+  float scale;
+  // Low words, for double-float. Zero unless precise.
+  float xoriginlo;
+  float yoriginlo;
+  float scalelo;
+  // Pixel (0,0) is pixel (col0,row0) from the origin, so that part of a
+  // frame, or a frame panned by whole pixels, has exactly the same
+  // coordinates as the whole one.
+  int col0;
+  int row0;
+  bool precise;      // Use the double-float kernels
+};
+
+// The view centred on (xcentre,ycentre), xscale being the zoom factor,
+// as setscale works it out for the QPUs. Once the pixel spacing gets
+// down to a few float epsilons this switches to double-float.
+void view_params(RenderParams &params, double xcentre, double ycentre,
+                 double xscale, int width, int height, int maxiterations);
+
+// The same, given the point at pixel (0,0) and the distance between
+// pixels instead.
+void origin_params(RenderParams &params, double xorigin, double yorigin,
+                   double scale, int maxiterations);
+
+// Move the origin to pixel (col,row), for rendering part of a frame as
+// a frame of its own, or panning. Pixels come out exactly as they would
+// in the whole frame.
+void view_offset(RenderParams &params, int col, int row);
+
+// Compute the (unmasked) iteration counts for 16 points.
+typedef void (*CpuKernel)(const float *cx, const float *cy,
+                          int maxiterations, uint32_t *res);
+
+// Same, with double-float coordinates.
+typedef void (*CpuKernelDF)(const float *cx, const float *cxlo,
+                            const float *cy, const float *cylo,
+                            int maxiterations, uint32_t *res);
+
+// Same, carrying on from z = (zx,zy) after start iterations, see
+// mandel16_run in cpukernel.h.
+typedef void (*CpuKernelRun)(const float *cx, const float *cy,
+                             float *zx, float *zy, uint32_t start,
+                             int maxiterations, uint32_t *res);
+
+// Choose a kernel by name ("scalar", "sse2", "avx2", "avx512", "neon").
+// NULL or "auto" selects the widest kernel the CPU supports.
+bool cpu_select(const char *name);
+const char *cpu_kernel_name();
+void cpu_list_kernels(FILE *fp);
+
+// Render the rectangle (x,y,w,h) of a frame into an 8-bit buffer, with
+// the same pixel values the QPU writes (count & (maxiterations-1)).
+// fb points at pixel (0,0) of the frame.
+void cpu_render(const RenderParams &params,
+                int x, int y, int w, int h,
+                uint8_t *fb, int pitch);
+
+// Same, but store the raw iteration counts (stride is in elements).
+void cpu_render_counts(const RenderParams &params,
+                       int x, int y, int w, int h,
+                       uint32_t *counts, int stride);
+
+// Raw iteration counts for n arbitrary pixels (cols[i],rows[i]), the
+// same as the rectangle functions would give for them.
+void cpu_render_points(const RenderParams &params,
+                       const int *cols, const int *rows, int n,
+                       uint32_t *res);
+
+// Same for points between the pixels: (xs[i],ys[i]) in pixels, so
+// (1.5,2) is half way between pixels (1,2) and (2,2).
+void cpu_render_samples(const RenderParams &params,
+                        const float *xs, const float *ys, int n,
+                        uint32_t *res);
+
+// One pass of progressive rendering of the rectangle (x,y,w,h), which
+// should start at a multiple of 4: every step'th pixel each way (step
+// being 4, 2 or 1) except those the pass before did, each filling a
+// step x step block (within the rectangle) in the 8-bit buffer.
+void cpu_render_pass(const RenderParams &params,
+                     int x, int y, int w, int h, int step,
+                     uint8_t *fb, int pitch);
+
+// How far a pixel has got, so that raising maxiterations only needs to
+// carry on the pixels still running. All zero to start from scratch.
+struct PixelState {
+  float x, y;      // z, while still running
+  uint32_t count;  // Iterations done, or taken to escape
+  uint32_t flags;  // PIXEL_RUNNING etc.
+};
+
+enum { PIXEL_RUNNING, PIXEL_ESCAPED, PIXEL_INSIDE };
+
+// Bring the pixels of the rectangle (x,y,w,h) up to params.maxiterations
+// (float views only), and store their 8-bit values as cpu_render would.
+// Pixels that escaped, or were found to be inside the set, are never
+// iterated again, so lowering maxiterations costs nothing. Returns the
+// number of pixels iterated.
+int cpu_render_state(const RenderParams &params,
+                     int x, int y, int w, int h,
+                     PixelState *state, int stride,
+                     uint8_t *fb, int pitch);
+
@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+
+#include "scheduler.h"
+#include "deepzoom.h"
+
+// Fixed point numbers for the reference orbit. d[0] is the integer
+// part and the rest are the fraction, most significant first; negative
+// numbers are two's complement. nlimbs is set for each frame from the
+// zoom, so everything only works on the first nlimbs.
+#define MAXLIMBS 40
+static int nlimbs = 4;
+
+struct Fixed {
+  uint32_t d[MAXLIMBS];
+};
+
+static void fx_zero(Fixed &r) {
+  memset(r.d, 0, sizeof(r.d));
+}
+
+static bool fx_negative(const Fixed &a) {
+  return (int32_t)a.d[0] < 0;
+}
+
+static void fx_add(Fixed &r, const Fixed &a, const Fixed &b) {
+  uint64_t carry = 0;
+  for (int i = nlimbs-1; i >= 0; i--) {
+    uint64_t t = (uint64_t)a.d[i] + b.d[i] + carry;
+    r.d[i] = t;
+    carry = t >> 32;
+  }
+}
+
+static void fx_neg(Fixed &r, const Fixed &a) {
+  uint64_t carry = 1;
+  for (int i = nlimbs-1; i >= 0; i--) {
+    uint64_t t = (uint64_t)(uint32_t)~a.d[i] + carry;
+    r.d[i] = t;
+    carry = t >> 32;
+  }
+}
+
+static void fx_sub(Fixed &r, const Fixed &a, const Fixed &b) {
+  Fixed t;
+  fx_neg(t, b);
+  fx_add(r, a, t);
+}
+
+// Truncates (the magnitude), which is fine for a few hundred bits
+// more than we need.
+static void fx_mul(Fixed &r, const Fixed &a, const Fixed &b) {
+  bool neg = fx_negative(a) != fx_negative(b);
+  Fixed x, y;
+  if (fx_negative(a)) fx_neg(x, a); else x = a;
+  if (fx_negative(b)) fx_neg(y, b); else y = b;
+  // Schoolbook multiplication, least significant limb first.
+  uint32_t p[2*MAXLIMBS];
+  memset(p, 0, sizeof(p));
+  int n = nlimbs;
+  for (int i = 0; i < n; i++) {
+    uint64_t xi = x.d[n-1-i];
+    if (xi == 0) continue;
+    uint64_t carry = 0;
+    for (int j = 0; j < n; j++) {
+      uint64_t t = p[i+j] + xi * y.d[n-1-j] + carry;
+      p[i+j] = t;
+      carry = t >> 32;
+    }
+    p[i+n] = carry;
+  }
+  for (int k = 0; k < n; k++) r.d[n-1-k] = p[k+n-1];
+  if (neg) fx_neg(r, r);
+}
+
+// Multiply or divide a non-negative number by a small integer.
+// r >= 0; false if it no longer fits
+static bool fx_mulsmall(Fixed &r, uint32_t m) {
+  uint64_t carry = 0;
+  for (int i = nlimbs-1; i >= 0; i--) {
+    uint64_t t = (uint64_t)r.d[i] * m + carry;
+    r.d[i] = t;
+    carry = t >> 32;
+  }
+  return carry == 0 && !fx_negative(r);
+}
+
+static void fx_divsmall(Fixed &r, uint32_t m) {
+  uint64_t rem = 0;
+  for (int i = 0; i < nlimbs; i++) {
+    uint64_t cur = rem << 32 | r.d[i];
+    r.d[i] = cur / m;
+    rem = cur % m;
+  }
+}
+
+// Exact, as long as |v| < 2^31 and the precision is there.
+static void fx_from_double(Fixed &r, double v) {
+  bool neg = v < 0;
+  v = fabs(v);
+  for (int i = 0; i < nlimbs; i++) {
+    double limb = floor(v);
+    r.d[i] = (uint32_t)limb;
+    v = (v - limb) * 4294967296.0;
+  }
+  if (neg) fx_neg(r, r);
+}
+
+static double fx_to_double(const Fixed &a) {
+  Fixed t = a;
+  bool neg = fx_negative(a);
+  if (neg) fx_neg(t, a);
+  double v = 0;
+  for (int i = nlimbs-1; i > 0; i--) v = (v + t.d[i]) / 4294967296.0;
+  v += (int32_t)t.d[0];
+  return neg ? -v : v;
+}
+
+// Decimal, with an optional exponent, eg. "-1.7685669e-3".
+static bool fx_from_string(Fixed &r, const char *s) {
+  const char *p = s;
+  bool neg = *p == '-';
+  if (*p == '-' || *p == '+') p++;
+  uint32_t ipart = 0;
+  const char *start = p;
+  for (; isdigit(*p); p++) {
+    ipart = ipart*10 + (*p - '0');
+    if (ipart > 100000000) return false;
+  }
+  const char *frac = NULL, *fracend = NULL;
+  if (*p == '.') {
+    frac = ++p;
+    while (isdigit(*p)) p++;
+    fracend = p;
+  }
+  if (p == start || (frac && p == frac && frac - 1 == start)) return false;
+  int exponent = 0;
+  if (*p == 'e' || *p == 'E') {
+    char *end;
+    exponent = strtol(p+1, &end, 10);
+    if (end == p+1) return false;
+    p = end;
+  }
+  if (*p != 0 || abs(exponent) > 400) return false;
+  fx_zero(r);
+  // Work back from the last digit, dividing by 10 each time.
+  for (const char *q = fracend; frac && q > frac; q--) {
+    r.d[0] = q[-1] - '0';
+    fx_divsmall(r, 10);
+  }
+  r.d[0] = ipart;
+  for (int i = 0; i < exponent; i++) {
+    if (!fx_mulsmall(r, 10)) return false;
+  }
+  for (int i = 0; i > exponent; i--) fx_divsmall(r, 10);
+  // Far outside the set anyway
+  if (r.d[0] > 1000000) return false;
+  if (neg) fx_neg(r, r);
+  return true;
+}
+
+// A reference orbit, Z[0] = 0 up to Z[length] (where it escaped, or
+// maxiterations+1 if it didn't), rounded to double.
+struct Reference {
+  double col, row;      // Where it is, in pixels
+  std::vector<double> zx, zy;
+  std::vector<double> glitch; // Below this |z|^2 a pixel is glitched
+  int length;
+};
+
+// Pauldelbrot's criterion: once a pixel's |z| gets much smaller than
+// the reference's, it has lost all its precision.
+#define GLITCH_TOLERANCE 1e-6
+
+static void reference_orbit(Reference &ref, const Fixed &cx, const Fixed &cy,
+                            int maxiterations) {
+  Fixed x, y, x2, y2, xy;
+  fx_zero(x);
+  fx_zero(y);
+  ref.zx.assign(1, 0.0);
+  ref.zy.assign(1, 0.0);
+  ref.glitch.assign(1, 0.0);
+  int n;
+  for (n = 1; n <= maxiterations+1; n++) {
+    fx_mul(x2, x, x);
+    fx_mul(y2, y, y);
+    fx_mul(xy, x, y);
+    fx_sub(x, x2, y2);
+    fx_add(x, x, cx);
+    fx_add(y, xy, xy);
+    fx_add(y, y, cy);
+    double zx = fx_to_double(x), zy = fx_to_double(y);
+    double r2 = zx*zx + zy*zy;
+    ref.zx.push_back(zx);
+    ref.zy.push_back(zy);
+    ref.glitch.push_back(GLITCH_TOLERANCE * r2);
+    if (r2 > 4) break;
+  }
+  ref.length = std::min(n, maxiterations+1);
+}
+
+// Series approximation: delta[n] ~= a[n] u + b[n] u^2 + c[n] u^3, for
+// u = dc/radius (so |u| <= 1 over the frame). The coefficients include
+// the powers of radius, which keeps them in range at any zoom.
+struct Series {
+  double radius;
+  std::vector<double> ax, ay, bx, by, cx, cy;
+};
+
+static void series_eval(const Series &s, int n, double ux, double uy,
+                        double &dx, double &dy) {
+  double u2x = ux*ux - uy*uy, u2y = 2*ux*uy;
+  double u3x = u2x*ux - u2y*uy, u3y = u2x*uy + u2y*ux;
+  dx = s.ax[n]*ux - s.ay[n]*uy + s.bx[n]*u2x - s.by[n]*u2y
+     + s.cx[n]*u3x - s.cy[n]*u3y;
+  dy = s.ax[n]*uy + s.ay[n]*ux + s.bx[n]*u2y + s.by[n]*u2x
+     + s.cx[n]*u3y + s.cy[n]*u3x;
+}
+
+// Coefficients up to the point where the cubic term starts to matter.
+static void series_build(Series &s, const Reference &ref, double radius) {
+  s.radius = radius;
+  s.ax.assign(2, 0.0); s.ay.assign(2, 0.0);
+  s.bx.assign(2, 0.0); s.by.assign(2, 0.0);
+  s.cx.assign(2, 0.0); s.cy.assign(2, 0.0);
+  s.ax[1] = radius; // delta[1] = dc
+  for (int n = 1; n+1 < ref.length; n++) {
+    double zx = ref.zx[n], zy = ref.zy[n];
+    double ax = s.ax[n], ay = s.ay[n], bx = s.bx[n], by = s.by[n];
+    double cx = s.cx[n], cy = s.cy[n];
+    double nax = 2*(zx*ax - zy*ay) + radius;
+    double nay = 2*(zx*ay + zy*ax);
+    double nbx = 2*(zx*bx - zy*by) + ax*ax - ay*ay;
+    double nby = 2*(zx*by + zy*bx) + 2*ax*ay;
+    double ncx = 2*(zx*cx - zy*cy) + 2*(ax*bx - ay*by);
+    double ncy = 2*(zx*cy + zy*cx) + 2*(ax*by + ay*bx);
+    if (hypot(ncx, ncy) > 1e-3 * hypot(nbx, nby)) break;
+    s.ax.push_back(nax); s.ay.push_back(nay);
+    s.bx.push_back(nbx); s.by.push_back(nby);
+    s.cx.push_back(ncx); s.cy.push_back(ncy);
+  }
+}
+
+// Iterate one pixel from delta[n], returning its count. Sets *badness
+// if it glitched: how close it came to 0 relative to the reference.
+static uint32_t perturb(const Reference &ref, double dcx, double dcy,
+                        int n, double dx, double dy, int maxiterations,
+                        float *badness) {
+  const double *zxs = &ref.zx[0], *zys = &ref.zy[0], *glitch = &ref.glitch[0];
+  for (; n <= maxiterations; n++) {
+    if (n > ref.length) {
+      // The reference escaped first, so we have nothing to go on.
+      *badness = 1;
+      return n-1;
+    }
+    double Zx = zxs[n], Zy = zys[n];
+    double zx = Zx + dx, zy = Zy + dy;
+    double r2 = zx*zx + zy*zy;
+    if (r2 > 4) return n-1;
+    if (r2 < glitch[n]) {
+      *badness = std::max(r2 / (Zx*Zx + Zy*Zy), 1e-30);
+      return n-1;
+    }
+    double ndx = 2*(Zx*dx - Zy*dy) + dx*dx - dy*dy + dcx;
+    double ndy = 2*(Zx*dy + Zy*dx) + 2*dx*dy + dcy;
+    dx = ndx;
+    dy = ndy;
+  }
+  return maxiterations;
+}
+
+// Skip as much of the series as probe points around the edge of the
+// frame agree with.
+static int series_skip(const Series &s, const Reference &ref,
+                       double halfw, double halfh, double step,
+                       int maxiterations) {
+  int skip = std::min((int)s.ax.size()-1, maxiterations);
+  static const double probes[][2] = {
+    { -1, -1 }, { 1, -1 }, { -1, 1 }, { 1, 1 },
+    { 0, -1 }, { 0, 1 }, { -1, 0 }, { 1, 0 }
+  };
+  for (unsigned i = 0; i < sizeof(probes)/sizeof(probes[0]); i++) {
+    double dcx = probes[i][0]*halfw*step, dcy = probes[i][1]*halfh*step;
+    double ux = dcx/s.radius, uy = dcy/s.radius;
+    while (skip > 1) {
+      // Iterate exactly as far as the skip and compare.
+      double dx = dcx, dy = dcy;
+      int n;
+      for (n = 1; n < skip; n++) {
+        double Zx = ref.zx[n], Zy = ref.zy[n];
+        double zx = Zx + dx, zy = Zy + dy;
+        if (zx*zx + zy*zy > 4) break;
+        double ndx = 2*(Zx*dx - Zy*dy) + dx*dx - dy*dy + dcx;
+        double ndy = 2*(Zx*dy + Zy*dx) + 2*dx*dy + dcy;
+        dx = ndx;
+        dy = ndy;
+      }
+      if (n == skip) {
+        double sx, sy;
+        series_eval(s, skip, ux, uy, sx, sy);
+        if (hypot(sx - dx, sy - dy) <= 1e-6 * hypot(dx, dy)) break;
+      }
+      skip = skip*3/4;
+    }
+  }
+  return std::max(skip, 1);
+}
+
+struct DeepFrame {
+  const Reference *ref;
+  const Series *series;
+  int skip;
+  int width;
+  double halfw, halfh;
+  double step;
+  int maxiterations;
+  uint32_t *counts;
+  float *badness;   // > 0 for glitched pixels
+  bool all;         // Or just the glitched ones
+};
+
+static void deep_tile(const Tile &tile, void *arg) {
+  DeepFrame *f = (DeepFrame*)arg;
+  const Reference &ref = *f->ref;
+  for (int row = tile.y; row < tile.y + tile.h; row++) {
+    for (int col = tile.x; col < tile.x + tile.w; col++) {
+      size_t p = (size_t)row*f->width + col;
+      if (!f->all && f->badness[p] == 0) continue;
+      f->badness[p] = 0;
+      double dcx = (col - ref.col) * f->step;
+      double dcy = (row - ref.row) * f->step;
+      double dx = dcx, dy = dcy;
+      if (f->series) {
+        series_eval(*f->series, f->skip, dcx/f->series->radius,
+                    dcy/f->series->radius, dx, dy);
+      }
+      f->counts[p] = perturb(ref, dcx, dcy, f->skip, dx, dy,
+                             f->maxiterations, &f->badness[p]);
+    }
+  }
+}
+
+#define MAXREFS 64
+
+static struct {
+  int limbs;
+  int refs;
+  int reflength;
+  int skip;
+  int glitched;   // After the first reference
+  int unresolved; // Still glitched at the end
+  double reftime, pixeltime;
+} stats;
+
+static double seconds() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+bool deep_render(const DeepView &view, int width, int height, int tilesize,
+                 uint32_t *counts)
+{
+  if (!(view.xscale > 0 && view.xscale < 1e290)) {
+    fprintf(stderr, "Deep zoom: zoom must be between 0 and 1e290\n");
+    return false;
+  }
+  memset(&stats, 0, sizeof(stats));
+  // Enough bits for the pixel spacing, and plenty more for the
+  // reference orbit to stay accurate over many iterations.
+  double bits = log2(view.xscale * height) + 64;
+  nlimbs = std::min(MAXLIMBS, 2 + (int)ceil(std::max(bits, 0.0) / 32));
+  stats.limbs = nlimbs;
+  Fixed xcentre, ycentre;
+  if (!fx_from_string(xcentre, view.xcentre) ||
+      !fx_from_string(ycentre, view.ycentre)) {
+    fprintf(stderr, "Deep zoom: bad centre %s %s\n",
+            view.xcentre, view.ycentre);
+    return false;
+  }
+  // Same view as view_params would give, in double.
+  double step = 1/(view.xscale * height/2);
+  size_t npixels = (size_t)width*height;
+  std::vector<float> badness(npixels, 0.0f);
+
+  DeepFrame frame;
+  frame.width = width;
+  frame.halfw = width/2.0;
+  frame.halfh = height/2.0;
+  frame.step = step;
+  frame.maxiterations = view.maxiterations;
+  frame.counts = counts;
+  frame.badness = &badness[0];
+
+  // The first reference is the centre of the frame, and gets the
+  // series approximation.
+  Reference ref;
+  Series series;
+  ref.col = frame.halfw;
+  ref.row = frame.halfh;
+  double t0 = seconds();
+  reference_orbit(ref, xcentre, ycentre, view.maxiterations);
+  series_build(series, ref, step * hypot(frame.halfw, frame.halfh));
+  frame.skip = series_skip(series, ref, frame.halfw, frame.halfh, step,
+                           view.maxiterations);
+  double t1 = seconds();
+  stats.reftime += t1 - t0;
+  stats.refs = 1;
+  stats.reflength = ref.length;
+  stats.skip = frame.skip - 1;
+  frame.ref = &ref;
+  frame.series = &series;
+  frame.all = true;
+  sched_frame(width, height, tilesize, deep_tile, &frame);
+  stats.pixeltime += seconds() - t1;
+
+  // Then keep picking the worst glitched pixel as a new reference and
+  // redoing the glitched pixels from scratch against it.
+  for (;;) {
+    size_t worst = 0;
+    int glitched = 0;
+    for (size_t p = 0; p < npixels; p++) {
+      if (badness[p] == 0) continue;
+      if (glitched++ == 0 || badness[p] < badness[worst]) worst = p;
+    }
+    if (stats.refs == 1) stats.glitched = glitched;
+    stats.unresolved = glitched;
+    if (glitched == 0 || stats.refs == MAXREFS) break;
+    t0 = seconds();
+    ref.col = worst % width;
+    ref.row = worst / width;
+    Fixed dx, dy, cx, cy;
+    fx_from_double(dx, (ref.col - frame.halfw) * step);
+    fx_from_double(dy, (ref.row - frame.halfh) * step);
+    fx_add(cx, xcentre, dx);
+    fx_add(cy, ycentre, dy);
+    reference_orbit(ref, cx, cy, view.maxiterations);
+    t1 = seconds();
+    stats.reftime += t1 - t0;
+    stats.refs++;
+    frame.series = NULL;
+    frame.skip = 1;
+    frame.all = false;
+    sched_frame(width, height, tilesize, deep_tile, &frame);
+    stats.pixeltime += seconds() - t1;
+  }
+  return true;
+}
+
+void deep_print_stats(FILE *fp)
+{
+  fprintf(fp, "Deep zoom: %d bit reference, orbit length %d, "
+          "%d iterations skipped by series approximation\n",
+          32*stats.limbs, stats.reflength, stats.skip);
+  fprintf(fp, "Deep zoom: %d glitched pixels, %d references, %d unresolved; "
+          "references %.3f ms, pixels %.3f ms\n",
+          stats.glitched, stats.refs, stats.unresolved,
+          stats.reftime*1e3, stats.pixeltime*1e3);
+}
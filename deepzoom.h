@@ -0,0 +1,27 @@
+// Deep zoom by perturbation.
+//
+// Floats run out of precision at a zoom of 10^4 or so. Here one point,
+// the reference, is iterated in high precision on the host and every
+// pixel is iterated as a (double) offset from that orbit, which only
+// needs enough precision for the differences between pixels. That is
+// good for zooms up to about 10^290, after which the offsets underflow.
+//
+// The first iterations, where the offsets are still small, are skipped
+// for the whole frame with a series approximation. Pixels whose orbit
+// strays too far from the reference (glitches) are detected and
+// redone against a new reference taken from among them.
+
+struct DeepView {
+  const char *xcentre; // Decimal, as many digits as it takes
+  const char *ycentre;
+  double xscale;       // As for the float view, so zoom factor
+  int maxiterations;
+};
+
+// Render a width x height frame of iteration counts (as the CPU kernels
+// would return them), on the scheduler. Returns false for a bad view.
+bool deep_render(const DeepView &view, int width, int height, int tilesize,
+                 uint32_t *counts);
+
+// Reference orbits, iterations skipped, glitches etc. for the last frame.
+void deep_print_stats(FILE *fp);
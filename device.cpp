@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "device.h"
+
+static const Device *device = &hw_device;
+
+bool device_select(const char *name)
+{
+  if (strcmp(name, hw_device.name) == 0) device = &hw_device;
+  else if (strcmp(name, fake_device.name) == 0) device = &fake_device;
+  else {
+    fprintf(stderr, "Unknown device %s (hw or fake)\n", name);
+    return false;
+  }
+  return true;
+}
+
+const char *device_name()
+{
+  return device->name;
+}
+
+// Statistics
+
+struct CallStats {
+  const char *name;
+  unsigned calls;
+  uint64_t ns;
+};
+
+enum { OPEN, CLOSE, PROPERTY, MAPMEM, UNMAPMEM, NCALLS };
+
+static CallStats calls[NCALLS] = {
+  { "open" }, { "close" }, { "property" }, { "mapmem" }, { "unmapmem" }
+};
+
+// Property calls by (first) tag
+#define MAXTAGS 32
+static struct {
+  uint32_t tag;
+  unsigned calls;
+  uint64_t ns;
+} tags[MAXTAGS];
+static int ntags = 0;
+
+static uint64_t regreads = 0;
+static uint64_t regwrites = 0;
+
+static uint64_t now() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void record(int call, uint64_t start) {
+  calls[call].calls++;
+  calls[call].ns += now() - start;
+}
+
+int device_open()
+{
+  uint64_t start = now();
+  int fd = device->open();
+  record(OPEN, start);
+  return fd;
+}
+
+void device_close(int fd)
+{
+  uint64_t start = now();
+  device->close(fd);
+  record(CLOSE, start);
+}
+
+int device_property(int fd, void *buf)
+{
+  uint32_t tag = ((uint32_t*)buf)[2];
+  uint64_t start = now();
+  int res = device->property(fd, buf);
+  uint64_t ns = now() - start;
+  calls[PROPERTY].calls++;
+  calls[PROPERTY].ns += ns;
+  int i;
+  for (i = 0; i < ntags && tags[i].tag != tag; i++);
+  if (i == ntags && ntags < MAXTAGS) {
+    tags[i].tag = tag;
+    tags[i].calls = 0;
+    tags[i].ns = 0;
+    ntags++;
+  }
+  if (i < ntags) {
+    tags[i].calls++;
+    tags[i].ns += ns;
+  }
+  return res;
+}
+
+void *device_mapmem(unsigned base, unsigned size)
+{
+  uint64_t start = now();
+  void *p = device->mapmem(base, size);
+  record(MAPMEM, start);
+  return p;
+}
+
+void device_unmapmem(void *addr, unsigned size)
+{
+  uint64_t start = now();
+  device->unmapmem(addr, size);
+  record(UNMAPMEM, start);
+}
+
+int device_openfb()
+{
+  return device->openfb();
+}
+
+void device_closefb(int fd)
+{
+  device->closefb(fd);
+}
+
+int device_waitvsync(int fd)
+{
+  return device->waitvsync(fd);
+}
+
+void device_console(bool graphics)
+{
+  device->console(graphics);
+}
+
+uint32_t reg_read(volatile uint32_t *regs, unsigned index)
+{
+  regreads++;
+  return device->read(regs, index);
+}
+
+void reg_write(volatile uint32_t *regs, unsigned index, uint32_t value)
+{
+  regwrites++;
+  device->write(regs, index, value);
+}
+
+void device_clear_stats()
+{
+  for (int i = 0; i < NCALLS; i++) {
+    calls[i].calls = 0;
+    calls[i].ns = 0;
+  }
+  ntags = 0;
+  regreads = regwrites = 0;
+}
+
+void device_print_stats(FILE *fp, int nframes)
+{
+  if (nframes < 1) nframes = 1;
+  fprintf(fp, "%s device, %d frames:\n", device->name, nframes);
+  for (int i = 0; i < NCALLS; i++) {
+    if (calls[i].calls == 0) continue;
+    fprintf(fp, "  %-10s %8u calls %10.3f ms %8.2f per frame %8.1f us/call\n",
+            calls[i].name, calls[i].calls, calls[i].ns/1e6,
+            (double)calls[i].calls/nframes, calls[i].ns/1e3/calls[i].calls);
+  }
+  for (int i = 0; i < ntags; i++) {
+    fprintf(fp, "  tag %08x %8u calls %10.3f ms %8.2f per frame\n",
+            tags[i].tag, tags[i].calls, tags[i].ns/1e6,
+            (double)tags[i].calls/nframes);
+  }
+  fprintf(fp, "  register reads %llu (%.1f per frame), writes %llu (%.1f per frame)\n",
+          (unsigned long long)regreads, (double)regreads/nframes,
+          (unsigned long long)regwrites, (double)regwrites/nframes);
+}
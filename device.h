@@ -0,0 +1,54 @@
+// Access to the VideoCore: mailbox property calls, physical memory and
+// the V3D registers, and the display: vsyncs and the console mode.
+//
+// mailbox.cpp and mandel.cpp go through the current device for all of
+// these, which is either the real hardware (/dev/vcio and /dev/mem,
+// needing root on a Pi) or a fake that does it all in process memory,
+// running QPU code on the simulator, so the host side can be run and
+// profiled anywhere.
+
+struct Device {
+  const char *name;
+  int (*open)();
+  void (*close)(int fd);
+  // Send a property message, as for IOCTL_MBOX_PROPERTY
+  int (*property)(int fd, void *buf);
+  // Map physical memory (ie. not a bus address)
+  void *(*mapmem)(unsigned base, unsigned size);
+  void (*unmapmem)(void *addr, unsigned size);
+  // Registers, regs being the mapping of IO_BASE
+  uint32_t (*read)(volatile uint32_t *regs, unsigned index);
+  void (*write)(volatile uint32_t *regs, unsigned index, uint32_t value);
+  // The framebuffer device, to wait for vsyncs on (-1 if there are none)
+  int (*openfb)();
+  void (*closefb)(int fd);
+  int (*waitvsync)(int fd);
+  // Console into graphics mode, so it doesn't draw over us, or back
+  void (*console)(bool graphics);
+};
+
+extern const Device hw_device;
+extern const Device fake_device;
+
+// Select "hw" (the default) or "fake". Do this before anything else.
+bool device_select(const char *name);
+const char *device_name();
+
+int device_open();
+void device_close(int fd);
+int device_property(int fd, void *buf);
+void *device_mapmem(unsigned base, unsigned size);
+void device_unmapmem(void *addr, unsigned size);
+
+int device_openfb();
+void device_closefb(int fd);
+int device_waitvsync(int fd);
+void device_console(bool graphics);
+
+uint32_t reg_read(volatile uint32_t *regs, unsigned index);
+void reg_write(volatile uint32_t *regs, unsigned index, uint32_t value);
+
+// Counts of calls through the device (with the time spent in the
+// mailbox and mapping calls, which are system calls on the hardware).
+void device_clear_stats();
+void device_print_stats(FILE *fp, int nframes);
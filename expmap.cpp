@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+
+#include "cpurender.h"
+#include "scheduler.h"
+#include "expmap.h"
+
+#define EXPMAP_TILE 32
+
+static void expmap_tile(const Tile &tile, void *arg) {
+  const ExpMap &map = *(const ExpMap*)arg;
+  // The pixel size of the innermost column, as the unit
+  double unit = map.rmax*exp(-(tile.x + tile.w-1)*map.step)*map.step;
+  RenderParams params;
+  origin_params(params, map.xcentre, map.ycentre, unit, map.maxiterations);
+  float xs[EXPMAP_TILE*EXPMAP_TILE], ys[EXPMAP_TILE*EXPMAP_TILE];
+  uint32_t res[EXPMAP_TILE*EXPMAP_TILE];
+  double r[EXPMAP_TILE];
+  for (int x = 0; x < tile.w; x++) {
+    r[x] = map.rmax*exp(-(tile.x + x)*map.step) / unit;
+  }
+  int n = 0;
+  for (int y = tile.y; y < tile.y + tile.h; y++) {
+    double c = cos(y*map.step), s = sin(y*map.step);
+    for (int x = 0; x < tile.w; x++) {
+      xs[n] = r[x]*c;
+      ys[n] = r[x]*s;
+      n++;
+    }
+  }
+  cpu_render_samples(params, xs, ys, n, res);
+  n = 0;
+  for (int y = tile.y; y < tile.y + tile.h; y++) {
+    for (int x = tile.x; x < tile.x + tile.w; x++) {
+      map.counts[(size_t)y*map.cols + x] = res[n++];
+    }
+  }
+}
+
+void expmap_render(ExpMap &map, double xcentre, double ycentre,
+                   double minscale, double maxscale, int width, int height,
+                   int maxiterations)
+{
+  double corner = sqrt((double)width*width + (double)height*height)/2;
+  map.xcentre = xcentre;
+  map.ycentre = ycentre;
+  map.maxiterations = maxiterations;
+  // A strip pixel at the corners as wide as a frame pixel
+  map.rows = (int)ceil(2*M_PI*corner / 16) * 16;
+  map.step = 2*M_PI / map.rows;
+  map.rmax = corner / (minscale*height/2);
+  double rmin = 0.5 / (maxscale*height/2);
+  map.cols = (int)ceil(log(map.rmax/rmin) / map.step) + 1;
+  map.counts = new uint32_t[(size_t)map.rows*map.cols];
+  sched_frame(map.cols, map.rows, EXPMAP_TILE, expmap_tile, &map);
+}
+
+void expmap_free(ExpMap &map) {
+  delete [] map.counts;
+  map.counts = NULL;
+}
+
+void expmap_prepare(const ExpMap &map, int width, int height,
+                    ExpMapLookup &lookup)
+{
+  lookup.width = width;
+  lookup.height = height;
+  lookup.col = new float[(size_t)width*height];
+  lookup.row = new int[(size_t)width*height];
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      size_t i = (size_t)y*width + x;
+      double dx = x - width/2.0, dy = y - height/2.0;
+      // The centre pixel is at the target, beyond the last column
+      double d = std::max(sqrt(dx*dx + dy*dy), 0.25);
+      double a = atan2(dy, dx);
+      if (a < 0) a += 2*M_PI;
+      lookup.col[i] = -log(d) / map.step;
+      lookup.row[i] = (int)floor(a / map.step + 0.5) % map.rows;
+    }
+  }
+}
+
+void expmap_free_lookup(ExpMapLookup &lookup) {
+  delete [] lookup.col;
+  delete [] lookup.row;
+  lookup.col = NULL;
+  lookup.row = NULL;
+}
+
+void expmap_frame(const ExpMap &map, const ExpMapLookup &lookup,
+                  double xscale, uint32_t *counts)
+{
+  // Column of a pixel a frame pixel out: log(rmax/pixel size)/step
+  double k = log(map.rmax * xscale*lookup.height/2) / map.step + 0.5;
+  size_t n = (size_t)lookup.width*lookup.height;
+  for (size_t i = 0; i < n; i++) {
+    int c = (int)floor(lookup.col[i] + k);
+    c = std::min(std::max(c, 0), map.cols-1);
+    counts[i] = map.counts[(size_t)lookup.row[i]*map.cols + c];
+  }
+}
@@ -0,0 +1,54 @@
+// Exponential map: the plane around a zoom target in log-polar form.
+//
+// Every frame of a zoom into one point has nearly all the detail of the
+// one before, at a slightly smaller scale. Mapped by log radius and
+// angle about the target, zooming in is just sliding along the log
+// radius, so the whole zoom can be rendered once as a strip: rows are
+// angles, 0 to 2 pi, columns go out from the target, each a constant
+// factor further in than the one before, the same factor as the angle
+// per row so the strip's pixels are square. Any frame of the zoom is
+// then looked up from it, each pixel taking the strip pixel nearest its
+// own log radius and angle; the log radius of a pixel only changes by a
+// constant from one zoom to the next, so the lookup is worked out once
+// for all the frames.
+//
+// The strip is made as wide around as the frame's corners need, so
+// its pixels are never larger than the frame's, and runs from the
+// corners of the widest frame in to half a pixel of the narrowest.
+// Each tile of it is rendered with the pixel size of its innermost
+// column, so the double-float kernels are only used where they're
+// needed.
+
+struct ExpMap {
+  double xcentre;
+  double ycentre;
+  double rmax;       // Radius of column 0
+  double step;       // Log radius per column, and angle per row
+  int rows;
+  int cols;
+  int maxiterations;
+  uint32_t *counts;  // rows x cols
+};
+
+// Render the map for width x height frames centred on (xcentre,ycentre)
+// from xscale minscale to maxscale. Needs the scheduler running.
+void expmap_render(ExpMap &map, double xcentre, double ycentre,
+                   double minscale, double maxscale, int width, int height,
+                   int maxiterations);
+void expmap_free(ExpMap &map);
+
+// Where each pixel of a width x height frame is in the map, but for
+// the zoom: -log(distance from the centre in pixels)/step and the row.
+struct ExpMapLookup {
+  int width;
+  int height;
+  float *col;
+  int *row;
+};
+void expmap_prepare(const ExpMap &map, int width, int height,
+                    ExpMapLookup &lookup);
+void expmap_free_lookup(ExpMapLookup &lookup);
+
+// Fill in the counts (stride width) of the frame of zoom xscale.
+void expmap_frame(const ExpMap &map, const ExpMapLookup &lookup,
+                  double xscale, uint32_t *counts);
@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <vector>
+
+#include "mailbox.h"
+#include "device.h"
+#include "v3d.h"
+#include "qpusim.h"
+
+// A stand-in for the VideoCore that needs no hardware or privileges.
+//
+// GPU memory is ordinary heap memory, given made up physical (and so
+// bus) addresses and mapped into the QPU simulator while locked. The
+// V3D registers are an array with a few of them (the user program
+// request queue and the performance counters) made to behave; anything
+// else just reads back what was written. QPU programs, from
+// EXECUTE_QPU or queued through SRQPC, run on the simulator.
+
+#define FAKE_FD 1000           // Doesn't matter, as long as it's not -1
+#define FIRST_PHYS 0x10000000  // Where allocations start
+#define CONTROL_PHYS 0x00001000 // For programs queued through SRQPC
+#define QUEUE_SIZE 16
+#define QPU_TIMEOUT 5000       // ms, as the mailbox call normally gets
+
+struct Block {
+  unsigned handle;
+  uint32_t phys;
+  uint32_t size;
+  uint8_t *host;
+  bool locked;
+};
+
+static std::vector<Block> blocks;
+static unsigned nexthandle = 1;
+static uint32_t nextphys = FIRST_PHYS;
+
+// The register window
+static uint32_t *regs = NULL;
+static uint32_t regsphys;
+static uint32_t regssize;
+
+// User program request queue
+static uint32_t control[2*QUEUE_SIZE];
+static int queued = 0;
+static uint32_t srqua;
+
+// Performance counters: V3D_PCTR(i) counts from when it was last cleared
+static uint32_t pctrbase[16];
+
+// Framebuffer
+static struct {
+  unsigned width, height, v_width, v_height, bpp, pitch;
+  unsigned xoffset, yoffset;
+  unsigned handle;
+  uint32_t palette[256];
+} fb;
+
+static Block *find_handle(unsigned handle) {
+  for (unsigned i = 0; i < blocks.size(); i++) {
+    if (blocks[i].handle == handle) return &blocks[i];
+  }
+  return NULL;
+}
+
+static unsigned allocate(unsigned size, unsigned align) {
+  if (align < 4096) align = 4096;
+  Block b;
+  void *host;
+  if (posix_memalign(&host, align, size) != 0) return 0;
+  memset(host, 0, size);
+  b.handle = nexthandle++;
+  b.phys = (nextphys + align - 1) & ~(align - 1);
+  b.size = size;
+  b.host = (uint8_t*)host;
+  b.locked = false;
+  nextphys = (b.phys + size + 4095) & ~4095;
+  blocks.push_back(b);
+  return b.handle;
+}
+
+static uint32_t lock(unsigned handle) {
+  Block *b = find_handle(handle);
+  if (!b) return 0;
+  b->locked = true;
+  qpusim_map(PHYS_TO_BUS(b->phys), b->host, b->size);
+  return PHYS_TO_BUS(b->phys);
+}
+
+static uint32_t unlock(unsigned handle) {
+  Block *b = find_handle(handle);
+  if (!b) return 1;
+  b->locked = false;
+  qpusim_unmap(PHYS_TO_BUS(b->phys));
+  return 0;
+}
+
+static uint32_t release(unsigned handle) {
+  for (unsigned i = 0; i < blocks.size(); i++) {
+    if (blocks[i].handle == handle) {
+      if (blocks[i].locked) unlock(handle);
+      free(blocks[i].host);
+      blocks.erase(blocks.begin() + i);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void fb_allocate(uint32_t *values) {
+  if (fb.handle) release(fb.handle);
+  fb.pitch = (fb.v_width * fb.bpp / 8 + 31) & ~31;
+  unsigned size = fb.pitch * fb.v_height;
+  fb.handle = allocate(size, 4096);
+  values[0] = fb.handle ? lock(fb.handle) : 0;
+  values[1] = fb.handle ? size : 0;
+}
+
+// Handle one tag, returns the length of the response or -1 if the tag
+// isn't known.
+static int fake_tag(uint32_t tag, uint32_t *v) {
+  switch (tag) {
+  case MB_GET_FIRMWARE_REVISION: v[0] = 0x5a1b1f7c; return 4;
+  case MB_GET_BOARD_MODEL: v[0] = 0; return 4;
+  case MB_GET_BOARD_REVISION: v[0] = 0xa21041; return 4; // Pi 2 B
+  case MB_GET_BOARD_SERIAL: v[0] = 0x12345678; v[1] = 0; return 8;
+  case MEM_ALLOCATE: v[0] = allocate(v[0], v[1]); return 4;
+  case MEM_LOCK: v[0] = lock(v[0]); return 4;
+  case MEM_UNLOCK: v[0] = unlock(v[0]); return 4;
+  case MEM_RELEASE: v[0] = release(v[0]); return 4;
+  case QPU_ENABLE: v[0] = 0; return 4;
+  case EXECUTE_QPU:
+    v[0] = qpusim_execute(v[0], v[1], v[3]);
+    return 4;
+  case FB_SET_PHYSICAL:
+    fb.width = v[0];
+    fb.height = v[1];
+    return 8;
+  case FB_SET_VIRTUAL:
+    fb.v_width = v[0];
+    fb.v_height = v[1];
+    return 8;
+  case FB_SET_BPP:
+    fb.bpp = v[0];
+    return 4;
+  case FB_ALLOCATE:
+    fb_allocate(v);
+    return 8;
+  case FB_GET_PITCH:
+    v[0] = fb.pitch;
+    return 4;
+  case FB_SET_VIRTUAL_OFFSET:
+    if (v[0] + fb.width <= fb.v_width && v[1] + fb.height <= fb.v_height) {
+      fb.xoffset = v[0];
+      fb.yoffset = v[1];
+    }
+    v[0] = fb.xoffset;
+    v[1] = fb.yoffset;
+    return 8;
+  case FB_SET_PALETTE:
+    if (v[0] + v[1] <= 256) {
+      memcpy(fb.palette + v[0], v + 2, 4*v[1]);
+      v[0] = 0;
+    } else {
+      v[0] = 1;
+    }
+    return 4;
+  default:
+    return -1;
+  }
+}
+
+static int fake_open() {
+  return FAKE_FD;
+}
+
+static void fake_close(int) {
+}
+
+static int fake_property(int fd, void *buf) {
+  assert(fd == FAKE_FD);
+  uint32_t *p = (uint32_t*)buf;
+  uint32_t size = p[0] / 4;
+  bool ok = true;
+  // Tags are (id, buffer size, request/response size, values...)
+  for (uint32_t i = 2; i < size && p[i] != 0; i += 3 + p[i+1]/4) {
+    int len = fake_tag(p[i], p + i + 3);
+    if (len < 0) {
+      fprintf(stderr, "fake device: unsupported tag %08x\n", p[i]);
+      ok = false;
+      break;
+    }
+    p[i+2] = 0x80000000 | len;
+  }
+  p[1] = ok ? 0x80000000 : 0x80000001;
+  return 0;
+}
+
+static void *fake_mapmem(unsigned base, unsigned size) {
+  for (unsigned i = 0; i < blocks.size(); i++) {
+    const Block &b = blocks[i];
+    if (base >= b.phys && base - b.phys + size <= b.size) {
+      return b.host + (base - b.phys);
+    }
+  }
+  // Anything else had better be the registers.
+  if (!regs) {
+    regs = (uint32_t*)calloc(size, 1);
+    regsphys = base;
+    regssize = size;
+    regs[V3D_IDENT0] = 0x02443356; // "V3D", revision 2
+    // 12K VPM, 16 semaphores, 2 TMUs and 4 QPUs per slice, 3 slices
+    regs[V3D_IDENT1] = 0xc1102432;
+    regs[V3D_IDENT2] = 0x00000111;
+  }
+  if (base == regsphys && size <= regssize) return regs;
+  fprintf(stderr, "fake device: can't map %08x\n", base);
+  return NULL;
+}
+
+static void fake_unmapmem(void *, unsigned) {
+  // Memory goes when it is released
+}
+
+// Run whatever has been queued, all at once, so the QPUs can
+// synchronize with each other.
+static void run_queue() {
+  uint32_t controlbus = PHYS_TO_BUS(CONTROL_PHYS);
+  qpusim_map(controlbus, control, sizeof(control));
+  unsigned res = qpusim_execute(queued, controlbus, QPU_TIMEOUT);
+  uint32_t srqcs = regs[V3D_SRQCS];
+  if (res == 0) {
+    // Completed count in bits 23:16
+    uint32_t done = ((srqcs >> 16) + queued) & 0xff;
+    srqcs = (srqcs & ~0xff0000) | done << 16;
+  } else {
+    srqcs |= 1 << 7; // Error
+  }
+  regs[V3D_SRQCS] = srqcs & ~0x3f;
+  queued = 0;
+}
+
+static uint32_t fake_read(volatile uint32_t *r, unsigned index) {
+  assert(r == regs);
+  if (index == V3D_SRQCS && queued > 0) {
+    run_queue();
+  } else if (index >= V3D_PCTR(0) && index < V3D_PCTR(16) &&
+             (index - V3D_PCTR(0)) % 2 == 0) {
+    int i = (index - V3D_PCTR(0)) / 2;
+    uint32_t enable = regs[V3D_PCTRE];
+    if ((enable & 0x80000000) && (enable & (1 << i))) {
+      return qpusim_counter(regs[V3D_PCTRS(i)]) - pctrbase[i];
+    }
+  }
+  return regs[index];
+}
+
+static void fake_write(volatile uint32_t *r, unsigned index, uint32_t value) {
+  assert(r == regs);
+  if (index == V3D_SRQPC) {
+    if (queued == QUEUE_SIZE) {
+      regs[V3D_SRQCS] |= 1 << 7; // Queue overflow
+      return;
+    }
+    control[2*queued] = srqua;
+    control[2*queued+1] = value;
+    queued++;
+    uint32_t srqcs = regs[V3D_SRQCS];
+    uint32_t requests = ((srqcs >> 8) + 1) & 0xff;
+    regs[V3D_SRQCS] = (srqcs & ~0xff3f) | requests << 8 | queued;
+  } else if (index == V3D_SRQUA) {
+    srqua = value;
+  } else if (index == V3D_SRQCS) {
+    // Bits clear things when written as 1s
+    uint32_t srqcs = regs[V3D_SRQCS];
+    if (value & (1 << 0)) {
+      queued = 0;
+      srqcs &= ~0x3f;
+    }
+    if (value & (1 << 7)) srqcs &= ~(1 << 7);
+    if (value & (1 << 8)) srqcs &= ~0xff00;
+    if (value & (1 << 16)) srqcs &= ~0xff0000;
+    regs[V3D_SRQCS] = srqcs;
+  } else if (index == V3D_PCTRC) {
+    for (int i = 0; i < 16; i++) {
+      if (value & (1 << i)) pctrbase[i] = qpusim_counter(regs[V3D_PCTRS(i)]);
+    }
+  } else {
+    regs[index] = value;
+  }
+}
+
+// No display, so no vsyncs to wait for and no console to touch
+static int fake_openfb() {
+  return -1;
+}
+
+static void fake_closefb(int) {
+}
+
+static int fake_waitvsync(int) {
+  return -1;
+}
+
+static void fake_console(bool) {
+}
+
+const Device fake_device = {
+  "fake", fake_open, fake_close, fake_property, fake_mapmem, fake_unmapmem,
+  fake_read, fake_write, fake_openfb, fake_closefb, fake_waitvsync,
+  fake_console
+};
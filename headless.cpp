@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+#include "cpurender.h"
+#include "scheduler.h"
+#include "colour.h"
+#include "deepzoom.h"
+#include "subdivide.h"
+#include "antialias.h"
+#include "tilecache.h"
+#include "headless.h"
+
+int read_frame_list(const char *filename, HeadlessFrame *&frames)
+{
+  FILE *fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "Can't open frame list %s\n", filename);
+    return -1;
+  }
+  std::vector<HeadlessFrame> list;
+  char line[512];
+  int lineno = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    lineno++;
+    char *p = line + strspn(line, " \t");
+    if (*p == '#' || *p == '\n' || *p == 0) continue;
+    HeadlessFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    int n = sscanf(p, "%lf %lf %lf %d %255s",
+                   &frame.xcentre, &frame.ycentre, &frame.xscale,
+                   &frame.maxiterations, frame.output);
+    if (n < 4 || frame.xscale <= 0 || frame.maxiterations <= 0) {
+      fprintf(stderr, "%s:%d: bad frame\n", filename, lineno);
+      fclose(fp);
+      return -1;
+    }
+    list.push_back(frame);
+  }
+  fclose(fp);
+  frames = new HeadlessFrame[list.size()];
+  std::copy(list.begin(), list.end(), frames);
+  return list.size();
+}
+
+struct CountsFrame {
+  RenderParams params;
+  uint32_t *counts;
+  int width;
+};
+
+static void counts_tile(const Tile &tile, void *arg) {
+  CountsFrame *frame = (CountsFrame*)arg;
+  cpu_render_counts(frame->params, tile.x, tile.y, tile.w, tile.h,
+                    frame->counts, frame->width);
+}
+
+static bool has_suffix(const char *s, const char *suffix) {
+  size_t n = strlen(s), m = strlen(suffix);
+  return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+// rgb, if not NULL, is the colours for a .ppm, already worked out.
+static bool write_frame(const char *filename, const uint32_t *counts,
+                        const uint8_t *rgb, int width, int height,
+                        int maxiterations) {
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "Can't open %s for writing\n", filename);
+    return false;
+  }
+  uint32_t mask = maxiterations-1;
+  size_t npixels = (size_t)width*height;
+  bool ok;
+  if (has_suffix(filename, ".raw")) {
+    ok = fwrite(counts, sizeof(uint32_t), npixels, fp) == npixels;
+  } else if (has_suffix(filename, ".ppm") && rgb) {
+    fprintf(fp, "P6\n%d %d\n255\n", width, height);
+    ok = fwrite(rgb, 3, npixels, fp) == npixels;
+  } else if (has_suffix(filename, ".ppm")) {
+    unsigned palette[256];
+    make_palette(palette, maxiterations);
+    fprintf(fp, "P6\n%d %d\n255\n", width, height);
+    std::vector<uint8_t> row(3*width);
+    ok = true;
+    for (int y = 0; ok && y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        unsigned c = palette[counts[y*width+x] & mask & 0xff];
+        row[3*x] = palette_r(c);
+        row[3*x+1] = palette_g(c);
+        row[3*x+2] = palette_b(c);
+      }
+      ok = fwrite(&row[0], 1, row.size(), fp) == row.size();
+    }
+  } else {
+    fprintf(fp, "P5\n%d %d\n255\n", width, height);
+    std::vector<uint8_t> row(width);
+    ok = true;
+    for (int y = 0; ok && y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        row[x] = counts[y*width+x] & mask;
+      }
+      ok = fwrite(&row[0], 1, row.size(), fp) == row.size();
+    }
+  }
+  if (fclose(fp) != 0) ok = false;
+  if (!ok) fprintf(stderr, "Error writing %s\n", filename);
+  return ok;
+}
+
+static double seconds(const timespec &start, const timespec &end) {
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int headless_main(const HeadlessOptions &options)
+{
+  HeadlessFrame *frames = NULL;
+  int nframes = 1;
+  if (options.framelist && options.deep) {
+    fprintf(stderr, "Deep zoom only does single frames\n");
+    return EXIT_FAILURE;
+  }
+  if (options.deep && options.aasamples) {
+    // The extra points would need perturbing too
+    fprintf(stderr, "Deep zoom can't be anti-aliased\n");
+    return EXIT_FAILURE;
+  }
+  if (options.framelist) {
+    nframes = read_frame_list(options.framelist, frames);
+    if (nframes < 0) return EXIT_FAILURE;
+  } else {
+    frames = new HeadlessFrame[1];
+    frames[0] = options.frame;
+  }
+  int width = options.width;
+  int height = options.height;
+  size_t npixels = (size_t)width*height;
+  if (options.deep) {
+    fprintf(stderr, "Headless: deep zoom %s %s %g, %dx%d, %d threads\n",
+            options.deep->xcentre, options.deep->ycentre,
+            options.deep->xscale, width, height, sched_threads());
+    frames[0].maxiterations = options.deep->maxiterations;
+  } else if (options.render) {
+    fprintf(stderr, "Headless: %d frames of %dx%d, %s\n",
+            nframes, width, height, options.rendername);
+  } else {
+    fprintf(stderr, "Headless: %d frames of %dx%d, %s kernel, %d threads\n",
+            nframes, width, height, cpu_kernel_name(), sched_threads());
+  }
+
+  CountsFrame frame;
+  frame.counts = new uint32_t[npixels];
+  frame.width = width;
+  uint8_t *fb = options.render ? new uint8_t[npixels] : NULL;
+  uint8_t *rgb = options.aasamples ? new uint8_t[3*npixels] : NULL;
+  double totaltime = 0;
+  int errors = 0;
+  for (int i = 0; i < nframes; i++) {
+    HeadlessFrame f = frames[i];
+    if (options.cached && !options.deep) {
+      cache_snap(f.xcentre, f.ycentre, f.xscale, width, height);
+    }
+    view_params(frame.params, f.xcentre, f.ycentre, f.xscale,
+                width, height, f.maxiterations);
+    timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (options.deep) {
+      if (!deep_render(*options.deep, width, height, options.tilesize,
+                       frame.counts)) {
+        errors++;
+        break;
+      }
+    } else if (options.cached) {
+      cache_render(f.xcentre, f.ycentre, f.xscale, width, height,
+                   f.maxiterations, frame.counts, width, NULL, 0);
+    } else if (options.render) {
+      options.render(frame.params, width, height, fb, width);
+    } else if (options.subdivide) {
+      subdiv_render(frame.params, width, height, options.verify,
+                    frame.counts, width);
+    } else {
+      sched_frame(width, height, options.tilesize, counts_tile, &frame);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (fb) std::copy(fb, fb + npixels, frame.counts);
+    double t = seconds(start, end);
+    totaltime += t;
+    uint64_t iterations = 0;
+    for (size_t j = 0; j < npixels; j++) iterations += frame.counts[j];
+
+    char filename[512];
+    if (f.output[0]) {
+      snprintf(filename, sizeof(filename), "%s", f.output);
+    } else {
+      snprintf(filename, sizeof(filename), options.output, i);
+    }
+    bool aa = rgb && has_suffix(filename, ".ppm");
+    if (aa) {
+      aa_render(frame.params, frame.counts, width, height,
+                options.aasamples, rgb);
+    } else if (rgb) {
+      fprintf(stderr, "Only .ppm output is anti-aliased\n");
+    }
+    if (!write_frame(filename, frame.counts, aa ? rgb : NULL, width, height,
+                     f.maxiterations)) {
+      errors++;
+    }
+    fprintf(stderr, "Frame %d: %s %.3f ms %.2f Mpixels/s %.3f Giterations/s%s\n",
+            i, filename, t*1e3, npixels/t/1e6, iterations/t/1e9,
+            frame.params.precise && !options.deep ? " (double-float)" : "");
+    if (aa) aa_print_stats(stderr);
+    if (options.deep) deep_print_stats(stderr);
+    else if (options.cached) {
+      CacheStats cs;
+      cache_stats(cs);
+      fprintf(stderr, "Tiles: %u cached, %u from the store, %u rendered\n",
+              cs.framehits, cs.framestorehits, cs.framemisses);
+    } else if (options.subdivide && !options.render) {
+      subdiv_print_stats(stderr);
+    }
+  }
+  if (nframes > 1) {
+    fprintf(stderr, "Total: %d frames %.3f s %.2f frames/s %.2f Mpixels/s\n",
+            nframes, totaltime, nframes/totaltime,
+            nframes*npixels/totaltime/1e6);
+  }
+  delete [] frame.counts;
+  delete [] fb;
+  delete [] rgb;
+  delete [] frames;
+  return errors ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,45 @@
+// Batch rendering, without the framebuffer, mailbox or terminal.
+//
+// Frames are rendered on the CPU (or by a FrameRenderer) into memory and written out as PPM
+// (coloured with the usual palette), PGM (the 8-bit values the QPU
+// would put in the framebuffer) or raw 32-bit iteration counts, chosen
+// by the file extension.
+
+struct HeadlessFrame {
+  double xcentre;
+  double ycentre;
+  double xscale;
+  int maxiterations;
+  char output[256]; // Empty to use the default
+};
+
+// Renders a whole frame of 8-bit values, as the QPUs would.
+typedef void (*FrameRenderer)(const RenderParams &params, int width, int height,
+                              uint8_t *fb, int pitch);
+
+struct HeadlessOptions {
+  int width;
+  int height;
+  int tilesize;
+  const char *output;    // May contain a printf %d for the frame number
+  const char *framelist; // File of frames, or NULL for just one
+  HeadlessFrame frame;   // The one frame, if no frame list
+  // NULL to use the CPU kernels. Otherwise .raw files only get the
+  // masked counts, as that is all the renderer gives us.
+  FrameRenderer render;
+  const char *rendername;
+  const DeepView *deep;   // Deep zoom (see deepzoom.h) instead of frame
+  bool subdivide;         // CPU frames by subdivision (see subdivide.h)
+  int verify;             // Points checked before filling a rectangle
+  int aasamples;          // Anti-alias the edges (see antialias.h), 0 not to
+  bool cached;           // Through the tile cache (see tilecache.h), the
+                         // views snapped to its grid
+};
+
+// Read a list of frames, one per line:
+//   xcentre ycentre xscale maxiterations [output]
+// Blank lines and lines starting with # are ignored.
+// Returns the number of frames, or -1 on error.
+int read_frame_list(const char *filename, HeadlessFrame *&frames);
+
+int headless_main(const HeadlessOptions &options);
@@ -34,14 +34,17 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdint.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <linux/fb.h>
+#include <linux/kd.h>
 
 #include "mailbox.h"
+#include "device.h"
 
 //#define DEBUG
 
 #define PAGE_SIZE (4*1024)
 
-void *mapmem(unsigned base, unsigned size)
+static void *hw_mapmem(unsigned base, unsigned size)
 {
    int mem_fd;
    unsigned offset = base % PAGE_SIZE;
@@ -62,14 +65,14 @@ void *mapmem(unsigned base, unsigned size)
    printf("base=0x%x, mem=%p\n", base, mem);
 #endif
    if (mem == MAP_FAILED) {
-      printf("mmap error %d\n", (int)mem);
+      printf("mmap error %p\n", mem);
       return NULL;
    }
    close(mem_fd);
    return (char *)mem + offset;
 }
 
-void unmapmem(void *addr, unsigned size)
+static void hw_unmapmem(void *addr, unsigned size)
 {
    int s = munmap(addr, size);
    if (s != 0) {
@@ -82,7 +85,7 @@ void unmapmem(void *addr, unsigned size)
  * use ioctl to send mbox property message
  */
 
-static int mbox_property(int file_desc, void *buf)
+static int hw_property(int file_desc, void *buf)
 {
    int ret_val = ioctl(file_desc, IOCTL_MBOX_PROPERTY, buf);
 
@@ -99,6 +102,21 @@ static int mbox_property(int file_desc, void *buf)
    return ret_val;
 }
 
+static int mbox_property(int file_desc, void *buf)
+{
+   return device_property(file_desc, buf);
+}
+
+void *mapmem(unsigned base, unsigned size)
+{
+   return device_mapmem(base, size);
+}
+
+void unmapmem(void *addr, unsigned size)
+{
+   device_unmapmem(addr, size);
+}
+
 unsigned mem_alloc(int file_desc, unsigned size, unsigned align, unsigned flags)
 {
    int i=0;
@@ -106,7 +124,7 @@ unsigned mem_alloc(int file_desc, unsigned size, unsigned align, unsigned flags)
    p[i++] = 0; // size
    p[i++] = 0x00000000; // process request
 
-   p[i++] = 0x3000c; // (the tag id)
+   p[i++] = MEM_ALLOCATE; // (the tag id)
    p[i++] = 12; // (size of the buffer)
    p[i++] = 12; // (size of the data)
    p[i++] = size; // (num bytes? or pages?)
@@ -127,7 +145,7 @@ unsigned mem_free(int file_desc, unsigned handle)
    p[i++] = 0; // size
    p[i++] = 0x00000000; // process request
 
-   p[i++] = 0x3000f; // (the tag id)
+   p[i++] = MEM_RELEASE; // (the tag id)
    p[i++] = 4; // (size of the buffer)
    p[i++] = 4; // (size of the data)
    p[i++] = handle;
@@ -146,7 +164,7 @@ unsigned mem_lock(int file_desc, unsigned handle)
    p[i++] = 0; // size
    p[i++] = 0x00000000; // process request
 
-   p[i++] = 0x3000d; // (the tag id)
+   p[i++] = MEM_LOCK; // (the tag id)
    p[i++] = 4; // (size of the buffer)
    p[i++] = 4; // (size of the data)
    p[i++] = handle;
@@ -165,7 +183,7 @@ unsigned mem_unlock(int file_desc, unsigned handle)
    p[i++] = 0; // size
    p[i++] = 0x00000000; // process request
 
-   p[i++] = 0x3000e; // (the tag id)
+   p[i++] = MEM_UNLOCK; // (the tag id)
    p[i++] = 4; // (size of the buffer)
    p[i++] = 4; // (size of the data)
    p[i++] = handle;
@@ -184,7 +202,7 @@ unsigned execute_code(int file_desc, unsigned code, unsigned r0, unsigned r1, un
    p[i++] = 0; // size
    p[i++] = 0x00000000; // process request
 
-   p[i++] = 0x30010; // (the tag id)
+   p[i++] = EXECUTE_CODE; // (the tag id)
    p[i++] = 28; // (size of the buffer)
    p[i++] = 28; // (size of the data)
    p[i++] = code;
@@ -210,7 +228,7 @@ unsigned qpu_enable(int file_desc, unsigned enable)
    p[i++] = 0; // size
    p[i++] = 0x00000000; // process request
 
-   p[i++] = 0x30012; // (the tag id)
+   p[i++] = QPU_ENABLE; // (the tag id)
    p[i++] = 4; // (size of the buffer)
    p[i++] = 4; // (size of the data)
    p[i++] = enable;
@@ -228,7 +246,7 @@ unsigned execute_qpu(int file_desc, unsigned num_qpus, unsigned control, unsigne
 
    p[i++] = 0; // size
    p[i++] = 0x00000000; // process request
-   p[i++] = 0x30011; // (the tag id)
+   p[i++] = EXECUTE_QPU; // (the tag id)
    p[i++] = 16; // (size of the buffer)
    p[i++] = 16; // (size of the data)
    p[i++] = num_qpus;
@@ -243,7 +261,7 @@ unsigned execute_qpu(int file_desc, unsigned num_qpus, unsigned control, unsigne
    return p[5];
 }
 
-int mbox_open() {
+static int hw_open() {
    int file_desc;
 
    // open a char device file used for communicating with kernel mbox driver
@@ -255,37 +273,56 @@ int mbox_open() {
    return file_desc;
 }
 
-void mbox_close(int file_desc) {
+static void hw_close(int file_desc) {
   close(file_desc);
 }
 
-#define FB_ALLOCATE 0x00040001
-#define FB_RELEASE  0x00048001
-#define FB_GET_PHYSICAL 0x00040003
-#define FB_TEST_PHYSICAL 0x00044003
-#define FB_SET_PHYSICAL 0x00048003
-#define FB_GET_VIRTUAL 0x00040004
-#define FB_TEST_VIRTUAL 0x00044004
-#define FB_SET_VIRTUAL 0x00048004
-#define FB_GET_BPP 0x00040005
-#define FB_TEST_BPP 0x00044005
-#define FB_SET_BPP 0x00048005
-#define FB_GET_PIXEL_ORDER 0x00040006
-#define FB_TEST_PIXEL_ORDER 0x00044006
-#define FB_SET_PIXEL_ORDER 0x00048006
-#define FB_GET_ALPHA_MODE 0x00040007
-#define FB_TEST_ALPHA_MODE 0x00044007
-#define FB_SET_ALPHA_MODE 0x00048007
-#define FB_GET_PITCH 0x00040008
-#define FB_GET_VIRTUAL_OFFSET 0x00040009
-#define FB_TEST_VIRTUAL_OFFSET 0x00044009
-#define FB_SET_VIRTUAL_OFFSET 0x00048009
-#define FB_GET_OVERSCAN 0x0004000A
-#define FB_TEST_OVERSCAN 0x0004400A
-#define FB_SET_OVERSCAN 0x0004800A
-#define FB_GET_PALETTE 0x0004000B
-#define FB_TEST_PALETTE 0x0004400B
-#define FB_SET_PALETTE 0x0004800B
+static uint32_t hw_read(volatile uint32_t *regs, unsigned index) {
+  return regs[index];
+}
+
+static void hw_write(volatile uint32_t *regs, unsigned index, uint32_t value) {
+  regs[index] = value;
+}
+
+static int hw_openfb() {
+  int fd = open("/dev/fb0", O_RDWR);
+  if (fd < 0) fprintf(stderr, "Error: cannot open framebuffer device.\n");
+  return fd;
+}
+
+static void hw_closefb(int fd) {
+  if (fd >= 0) close(fd);
+}
+
+static int hw_waitvsync(int fd) {
+  return ioctl(fd, FBIO_WAITFORVSYNC, 0);
+}
+
+static void hw_console(bool graphics) {
+  static int kbfd = -1;
+  if (graphics) {
+    kbfd = open("/dev/tty0", O_WRONLY);
+    if (kbfd >= 0) ioctl(kbfd, KDSETMODE, KD_GRAPHICS);
+  } else if (kbfd >= 0) {
+    ioctl(kbfd, KDSETMODE, KD_TEXT);
+    close(kbfd);
+    kbfd = -1;
+  }
+}
+
+const Device hw_device = {
+  "hw", hw_open, hw_close, hw_property, hw_mapmem, hw_unmapmem,
+  hw_read, hw_write, hw_openfb, hw_closefb, hw_waitvsync, hw_console
+};
+
+int mbox_open() {
+  return device_open();
+}
+
+void mbox_close(int file_desc) {
+  device_close(file_desc);
+}
 
 
 unsigned create_frame_buffer(int file_desc, FrameBufferDesc *fbd) {
@@ -439,10 +476,6 @@ unsigned set_frame_buffer_palette(int file_desc, unsigned palette[256]) {
   return 1;
 }
 
-#define MB_GET_FIRMWARE_REVISION 0x00000001
-#define MB_GET_BOARD_MODEL 0x00010001
-#define MB_GET_BOARD_REVISION 0x00010002
-#define MB_GET_BOARD_SERIAL 0x00010004
 
 int get_mbox_property(int fd, uint32_t op, void *buf, int buflen)
 {
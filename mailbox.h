@@ -48,6 +48,48 @@ static inline uint32_t PHYS_TO_BUS(uint32_t x) {
   return x;
 }
 
+// Property tags
+#define MEM_ALLOCATE 0x3000c
+#define MEM_LOCK 0x3000d
+#define MEM_UNLOCK 0x3000e
+#define MEM_RELEASE 0x3000f
+#define EXECUTE_CODE 0x30010
+#define EXECUTE_QPU 0x30011
+#define QPU_ENABLE 0x30012
+
+#define FB_ALLOCATE 0x00040001
+#define FB_RELEASE  0x00048001
+#define FB_GET_PHYSICAL 0x00040003
+#define FB_TEST_PHYSICAL 0x00044003
+#define FB_SET_PHYSICAL 0x00048003
+#define FB_GET_VIRTUAL 0x00040004
+#define FB_TEST_VIRTUAL 0x00044004
+#define FB_SET_VIRTUAL 0x00048004
+#define FB_GET_BPP 0x00040005
+#define FB_TEST_BPP 0x00044005
+#define FB_SET_BPP 0x00048005
+#define FB_GET_PIXEL_ORDER 0x00040006
+#define FB_TEST_PIXEL_ORDER 0x00044006
+#define FB_SET_PIXEL_ORDER 0x00048006
+#define FB_GET_ALPHA_MODE 0x00040007
+#define FB_TEST_ALPHA_MODE 0x00044007
+#define FB_SET_ALPHA_MODE 0x00048007
+#define FB_GET_PITCH 0x00040008
+#define FB_GET_VIRTUAL_OFFSET 0x00040009
+#define FB_TEST_VIRTUAL_OFFSET 0x00044009
+#define FB_SET_VIRTUAL_OFFSET 0x00048009
+#define FB_GET_OVERSCAN 0x0004000A
+#define FB_TEST_OVERSCAN 0x0004400A
+#define FB_SET_OVERSCAN 0x0004800A
+#define FB_GET_PALETTE 0x0004000B
+#define FB_TEST_PALETTE 0x0004400B
+#define FB_SET_PALETTE 0x0004800B
+
+#define MB_GET_FIRMWARE_REVISION 0x00000001
+#define MB_GET_BOARD_MODEL 0x00010001
+#define MB_GET_BOARD_REVISION 0x00010002
+#define MB_GET_BOARD_SERIAL 0x00010004
+
 int mbox_open();
 void mbox_close(int file_desc);
 
@@ -11,14 +11,32 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/ioctl.h>
-#include <linux/fb.h>
-#include <linux/kd.h>
 #include <linux/ioctl.h>
 #include <algorithm>
+#include <vector>
 #include <curses.h> // For key definitions
 #include <termios.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include "mailbox.h"
+#include "device.h"
+#include "v3d.h"
+#include "cpurender.h"
+#include "scheduler.h"
+#include "colour.h"
+#include "deepzoom.h"
+#include "headless.h"
+#include "bench.h"
+#include "subdivide.h"
+#include "qpuwait.h"
+#include "trace.h"
+#include "counters.h"
+#include "qpusim.h"
+#include "tilestore.h"
+#include "tilecache.h"
+#include "tileservice.h"
+#include "video.h"
 
 // cached=0xC; direct=0x4
 static const uint32_t GPU_MEM_FLG = 0x04;
@@ -52,63 +70,40 @@ void setsighandler(bool runonce = true) {
 int width = 1280;
 int height = 720;
 
-float xcentre = -0.7449;
-float ycentre = 0.1;
+double xcentre = -0.7449;
+double ycentre = 0.1;
 int maxiterations = 256;
 
-float xscale = 1;
+int framelimit = 0; // Stop after this many frames, 0 to run until ^C
+unsigned traceframe = 0; // Frame number for trace events
+uint64_t framestart = 0;   // When the keys for it were taken
+bool keyboard = false; // Taking keys from the terminal
+
+double xscale = 1;
 float xinc = 0;
 float xzoom = 1;
 
 static const int MAXQPUS = 16;
-static const int MAXUNIFS = 16;
+static const int MAXUNIFS = 18;
 static const int MAXBLOCKS = 4;
 
 static const uint32_t hexcode[] = {
   #include HEXFILE
 };
 
+// Double-float version, for deep views
+static const uint32_t dfhexcode[] = {
+  #include DFHEXFILE
+};
+
 #define ARRAYSIZE(a) ((sizeof(a))/sizeof((a)[0]))
 
 #define DEBUG(...) (fprintf(stderr,__VA_ARGS__))
 //#define DEBUG(...)
 #define ERROR(...) (fprintf(stderr,"Error: " __VA_ARGS__))
 
-#define REG(x) ((0xC00000 + x) >>2)
-//#define REG(x) ((x)>>2)
-
 #define	BLOCK_SIZE (4*1024)
 
-// Address base is at 0x7ec00000 on BCM2835
-// Translates to IO_BASE + c00000 + register offset
-
-// V3D spec: http://www.broadcom.com/docs/support/videocore/VideoCoreIV-AG100-R.pdf
-#define V3D_IDENT0   REG(0x00)
-#define V3D_IDENT1   REG(0x04)
-#define V3D_IDENT2   REG(0x08)
-#define V3D_SQCNTL   REG(0x418)
-#define V3D_VPACNTL  REG(0x500)
-#define V3D_VPMBASE  REG(0x504)
-#define V3D_PCTRC    REG(0x670)
-#define V3D_PCTRE    REG(0x674)
-#define V3D_PCTR(i) (REG(0x680) + 2*i)
-#define V3D_PCTRS(i)(REG(0x684) + 2*i)
-#define V3D_ERRSTAT  REG(0xf20)
-
-#define V3D_SQRSV0   REG(0x410)
-#define V3D_SQRSV1   REG(0x414)
-
-#define V3D_L2CACTL (0xC00020>>2)
-#define V3D_SLCACTL (0xC00024>>2)
-#define V3D_SRQPC   (0xC00430>>2)
-#define V3D_SRQUA   (0xC00434>>2)
-#define V3D_SRQUL   (0xC00438>>2)
-#define V3D_SRQCS   (0xC0043c>>2)
-
-#define V3D_DBCFG   (0xC00e00>>2)
-#define V3D_DBQITE  (0xC00e2c>>2)
-#define V3D_DBQITC  (0xC00e30>>2)
-
 struct GPUData;
 
 struct GPU {
@@ -131,7 +126,7 @@ static inline int BITS(uint32_t n, int last, int first) {
   return (n >> first) & ((1<<(last+1-first))-1);
 }
 
-#define PRINTREG(REG) (fprintf(stderr,"%-12s %08x\n", #REG ":", peri[REG]))
+#define PRINTREG(REG) (fprintf(stderr,"%-12s %08x\n", #REG ":", reg_read(peri, REG)))
 
 int gpu_prepare(GPU &gpu, size_t datasize)
 {
@@ -153,9 +148,9 @@ int gpu_prepare(GPU &gpu, size_t datasize)
   if (peri) {
     fprintf(stderr,"IO_BASE: %08x\n", IO_BASE);
     fprintf(stderr,"IO_LEN:  %08x\n", IO_LEN);
-    uint32_t ident0 = peri[V3D_IDENT0];
-    uint32_t ident1 = peri[V3D_IDENT1];
-    uint32_t ident2 = peri[V3D_IDENT2];
+    uint32_t ident0 = reg_read(peri, V3D_IDENT0);
+    uint32_t ident1 = reg_read(peri, V3D_IDENT1);
+    uint32_t ident2 = reg_read(peri, V3D_IDENT2);
     // Can't do char width reads on a register so copy and cast.
     fprintf(stderr, "%.3s %08x %08x %08x\n",
 	    (char*)&ident0, ident0, ident1, ident2);
@@ -171,16 +166,16 @@ int gpu_prepare(GPU &gpu, size_t datasize)
     PRINTREG(V3D_SRQCS); // Queue control
   }
 
-  peri[V3D_SRQCS] = 0;
-  //peri[V3D_ERRSTAT] = 0; // Any way to clear this?
+  reg_write(peri, V3D_SRQCS, 0);
+  //reg_write(peri, V3D_ERRSTAT, 0); // Any way to clear this?
 
 #if 0
   if (peri) {
     // This extends the VPM memory available to GPU programs
     // but there doesn't seem to be any way of using it.
     // (see errata to V3D spec)
-    peri[V3D_VPMBASE] = (1<<6)-1;
-    fprintf(stderr,"%08x\n",peri[V3D_VPMBASE]);
+    reg_write(peri, V3D_VPMBASE, (1<<6)-1);
+    fprintf(stderr,"%08x\n",reg_read(peri, V3D_VPMBASE));
     fprintf(stderr,"%08x\n",(1<<6)-1);
   }
 #endif
@@ -215,11 +210,15 @@ int gpu_prepare(GPU &gpu, size_t datasize)
 uint32_t gpu_execute(int mb, uint32_t control, int nqpus)
 {
   //DEBUG("msg=%x\n", gpu.vc);
-  return execute_qpu(mb,
-                     nqpus,
-                     control, //gpu.vc + offsetof(struct GPUData, control),
-                     1 /* no flush */,
-                     5000 /* timeout */);
+  QpuWaitTimer timer;
+  qpuwait_begin(timer);
+  uint32_t res = execute_qpu(mb,
+                             nqpus,
+                             control, //gpu.vc + offsetof(struct GPUData, control),
+                             1 /* no flush */,
+                             5000 /* timeout */);
+  qpuwait_end(timer);
+  return res;
 }
 
 void gpu_release(int mb, GPU &gpu)
@@ -231,118 +230,48 @@ void gpu_release(int mb, GPU &gpu)
   mbox_close(mb);
 }
 
-// Performance counters
-
-#define DEFCOUNTER(name,n) { #name, n }
-
-struct Counter {
-  const char* name;
-  int index;
-  uint32_t value;
-} counters[] = {
-  DEFCOUNTER(QPU_TOTAL_IDLE, 13),
-  DEFCOUNTER(QPU_TOTAL_VERTEX, 14),
-  DEFCOUNTER(QPU_TOTAL_FRAGMENT, 15),
-  DEFCOUNTER(QPU_TOTAL_VALID, 16),
-  DEFCOUNTER(QPU_TOTAL_TMU_STALL, 17),
-  DEFCOUNTER(QPU_TOTAL_SCOREBOARD_STALL, 18),
-  //DEFCOUNTER(QPU_TOTAL_VARYINGS_STALL, 19),
-  DEFCOUNTER(QPU_TOTAL_ICACHE_HITS, 20),
-  DEFCOUNTER(QPU_TOTAL_ICACHE_MISSES, 21),
-  DEFCOUNTER(QPU_TOTAL_UCACHE_HITS, 22),
-  DEFCOUNTER(QPU_TOTAL_UCACHE_MISSES, 23),
-  DEFCOUNTER(QPU_TOTAL_TMU_PROCESSED, 24),
-  DEFCOUNTER(QPU_TOTAL_TMU_MISSES, 25),
-  DEFCOUNTER(QPU_TOTAL_VDW_STALL, 26),
-  DEFCOUNTER(QPU_TOTAL_VCD_STALL, 27),
-  DEFCOUNTER(QPU_TOTAL_L2_HITS, 28),
-  DEFCOUNTER(QPU_TOTAL_L2_MISSES, 29)
-};
-
-#undef DEFCOUNTER
-
-void counter_setup() {
-  int ncounters = ARRAYSIZE(counters);
-  assert(ncounters <= 16);
-  for (int i = 0; i < ncounters; i++) {
-    uint32_t reg = V3D_PCTRS(i);
-    //fprintf(stderr,"Setting counter %08x to %d\n", 4*reg, counters[i]);
-    peri[reg] = counters[i].index;
-  }
-  // Counters only seem to work if top bit in PCTRE is set
-  peri[V3D_PCTRE] = 0x8000ffff;
-}
-
-void counter_clear() {
-  peri[V3D_PCTRC] = 0x0000ffff;
-}
-
-void counter_read() {
-  int ncounters = ARRAYSIZE(counters);
-  for (int i = 0; i < ncounters; i++) {
-    counters[i].value = peri[V3D_PCTR(i)];
-  }
-}
-
-void counter_print() {
-  int ncounters = ARRAYSIZE(counters);
-  for (int i = 0; i < ncounters; i++) {
-    fprintf(stderr, "%s: %u\n",
-	    counters[i].name, counters[i].value);
-  }
-}
-
 #define GPU_TIMEOUT 5000
 
-unsigned gpu_execute_direct(GPUControl *control, int num_qpus) {
-    time_t limit = 0;
+// Have num_qpus (an int) all finished?
+bool qpus_done(void *arg) {
+  return ((reg_read(peri, V3D_SRQCS)>>16) & 0xff) == (uint32_t)*(int*)arg;
+}
 
-    peri[V3D_DBCFG] = 0;   // Disallow IRQ
-    peri[V3D_DBQITE] = 0;  // Disable IRQ
-    peri[V3D_DBQITC] = -1; // Resets IRQ flags
+// pixels is only to help qpuwait guess how long it will take
+unsigned gpu_execute_direct(GPUControl *control, int num_qpus,
+                            unsigned pixels) {
+    uint64_t start = trace_now();
+    reg_write(peri, V3D_DBCFG, 0);   // Disallow IRQ
+    reg_write(peri, V3D_DBQITE, 0);  // Disable IRQ
+    reg_write(peri, V3D_DBQITC, -1); // Resets IRQ flags
 
-    peri[V3D_L2CACTL] =  1<<2; // Clear L2 cache
-    peri[V3D_SLCACTL] = -1;    // Clear other caches
+    reg_write(peri, V3D_L2CACTL, 1<<2); // Clear L2 cache
+    reg_write(peri, V3D_SLCACTL, -1);    // Clear other caches
 
-    peri[V3D_SRQCS] = (1<<7) | (1<<8) | (1<<16); // Reset error bit and counts
-    peri[V3D_SRQCS] = (1<<0); // Clear queue
+    reg_write(peri, V3D_SRQCS, (1<<7) | (1<<8) | (1<<16)); // Reset error bit and counts
+    reg_write(peri, V3D_SRQCS, (1<<0)); // Clear queue
 
     //PRINTREG(V3D_SRQCS); // Queue control
     if (0) {
-      uint32_t srqcs = peri[V3D_SRQCS];
+      uint32_t srqcs = reg_read(peri, V3D_SRQCS);
       fprintf(stderr,"QPURQCC=%d QPURQCM=%d QPURQERR=%d QPURQL=%d\n",
 	      BITS(srqcs,23,16),BITS(srqcs,15,8),
 	      BITS(srqcs,7,7),BITS(srqcs,5,0));
     }
     for (int q = 0; q < num_qpus; q++) { // Launch shader(s)
-        peri[V3D_SRQUA] = control[q].punifs;
-        peri[V3D_SRQPC] = control[q].pcode;
+        reg_write(peri, V3D_SRQUA, control[q].punifs);
+        reg_write(peri, V3D_SRQPC, control[q].pcode);
     }
     if (0) {
-      uint32_t srqcs = peri[V3D_SRQCS];
+      uint32_t srqcs = reg_read(peri, V3D_SRQCS);
       fprintf(stderr,"QPURQCC=%d QPURQCM=%d QPURQERR=%d QPURQL=%d\n",
 	      BITS(srqcs,23,16),BITS(srqcs,15,8),
 	      BITS(srqcs,7,7),BITS(srqcs,5,0));
     }
     //PRINTREG(V3D_SRQCS); // Queue control
+    trace_end(TRACE_DISPATCH, start, traceframe);
 
-    // Busy wait polling
-    for (;;) {
-      // Could do something useful here, like output some counts
-      // or even nanosleep a bit.
-      int q = 1000;
-      do {
-	if (((peri[V3D_SRQCS]>>16) & 0xff) == (uint32_t)num_qpus) { // All done?
-	  return 0;
-	}
-      } while (--q);
-      if (!limit) {
-	limit = clock() + CLOCKS_PER_SEC / 1000 * GPU_TIMEOUT;
-      } else if (clock() >= limit) {
-	// TODO: some cleanup required?
-	return -1;
-      }
-    }
+    return qpuwait(qpus_done, &num_qpus, pixels, GPU_TIMEOUT);
 }
 
 // Program data
@@ -357,45 +286,129 @@ struct GPUData {
   uint32_t unifs[MAXQPUS][MAXUNIFS];
   uint32_t output[VPMSIZE];
   uint32_t code[ARRAYSIZE(hexcode)];
+  uint32_t dfcode[ARRAYSIZE(dfhexcode)];
 };
 
 uint32_t floattoint(float x) {
   return *(uint32_t*)&x;
 }
 
-float scale = 0.02;
-float xorigin = -1;
-float yorigin = -0.5;
+RenderParams viewparams; // As setscale last worked them out
+// The view viewparams was worked out for. Panning since has only moved
+// its origin by whole pixels, so the centre is this plus those.
+double viewxcentre, viewycentre, viewxscale = 0;
 
-float PI = 3.14159;
 unsigned int palette[256];
 int fbfd = -1;
-int kbfd = -1;
 struct termios saved_attributes;
 
 FrameBufferDesc fbd;
+uint32_t fboffset = 0; // Offset of the buffer we are drawing into
+
+// The framebuffer is NPAGES pages one above the other: the one on
+// display, the one that replaced it if the firmware hasn't switched
+// to it yet (it does at the next vsync), and the one we draw into, so
+// we never have to wait for the vsync before getting on with the next
+// frame. A page can be drawn into again once a vsync has gone by
+// since it was replaced on display.
+static const int NPAGES = 3;
+int showpage = 0;
+int drawpage = 0;
+int64_t pageflip[NPAGES] = { -1, -1, -1 }; // vsyncs when replaced
+
+// Counted by vsync_thread
+pthread_mutex_t vsynclock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t vsynccond = PTHREAD_COND_INITIALIZER;
+int64_t vsyncs = 0;
+bool vsyncing = false;   // Thread running, so vsyncs is being counted
+unsigned pagewaits = 0;  // Times we had to wait for a page
+long pagewaittime = 0;   // usecs
+
+// Whole pixels the view has just been panned by: new pixel (x,y) is
+// the old (x+scrollx,y+scrolly), so most of the frame on display can
+// be copied rather than rendered again.
+int scrollx = 0;
+int scrolly = 0;
+
+// With -C frames are rendered as raw iteration counts, into counts
+// (in GPU memory, after GPUData, for the QPUs), and colourised into
+// the framebuffer afterwards, so the colouring can be changed without
+// rendering anything.
+bool rawcounts = false;
+uint32_t *counts = NULL;
+uint32_t countsbus = 0;  // Bus address of counts
+int colourmod = 0;       // Length of the colour cycle, 0 for maxiterations
+int colouroffset = 0;    // Added to the counts, for colour cycling
+bool recolour = false;   // Only the colouring has changed
+
+// Bus address the QPUs write pixel (x,y) of the frame to
+uint32_t frame_address(int x, int y) {
+  if (rawcounts) return countsbus + (y*fbd.width + x)*sizeof(uint32_t);
+  return fbd.gpu_address + fboffset + y*fbd.pitch + x;
+}
 
-void setscale(GPUData *gpudata, int nqpus) {
-  fprintf(stderr, "setscale: %10.10g %10.10g %10.10g\n", xcentre, ycentre, xscale);
-  int swidth = fbd.width;
-  int sheight = fbd.height;
-  scale = 1/(xscale * sheight/2);
-  xorigin = xcentre-scale*swidth/2;
-  yorigin = ycentre-scale*sheight/2;
+void colourise_frame() {
+  colourise(counts, fbd.width, fbd.width, fbd.height,
+            fbd.arm_address + fboffset, fbd.pitch, maxiterations,
+            colourmod ? colourmod : maxiterations, colouroffset);
+}
+
+// The bus address setup was given
+uint32_t gpubase(const GPUData *gpudata) {
+  return gpudata->control[0].punifs - offsetof(GPUData, unifs);
+}
+
+void setparams(GPUData *gpudata, int nqpus, const RenderParams &params) {
+  // Switch to the double-float code when the view needs it
+  uint32_t pcode = gpubase(gpudata) +
+    (params.precise ? offsetof(GPUData, dfcode) : offsetof(GPUData, code));
   for (int i = 0; i < nqpus; i++) {
-    gpudata->unifs[i][9]  = maxiterations; // maximum iterations
-    gpudata->unifs[i][10] = floattoint(xorigin); // x0
-    gpudata->unifs[i][11] = floattoint(yorigin); // y0
-    gpudata->unifs[i][12] = floattoint(scale); // scale
+    gpudata->control[i].pcode = pcode;
+    gpudata->unifs[i][9]  = params.maxiterations; // maximum iterations
+    gpudata->unifs[i][10] = floattoint(params.xorigin); // x0
+    gpudata->unifs[i][11] = floattoint(params.yorigin); // y0
+    gpudata->unifs[i][12] = floattoint(params.scale); // scale
+    gpudata->unifs[i][13] = floattoint(params.xoriginlo); // Low words,
+    gpudata->unifs[i][14] = floattoint(params.yoriginlo); // only used by
+    gpudata->unifs[i][15] = floattoint(params.scalelo);   // mandel_df
+    gpudata->unifs[i][16] = params.col0; // Pixel offsets of the frame
+    gpudata->unifs[i][17] = params.row0;
   }
 }
 
+void setscale(GPUData *gpudata, int nqpus) {
+  if (cache_enabled()) {
+    cache_snap(xcentre, ycentre, xscale, fbd.width, fbd.height);
+  }
+  // A pan moves the origin by exactly that many pixels, rather than
+  // working it out again from the new centre, so that the pixels
+  // scrolled across are exactly those a full render of the view gives.
+  double pixel = 1/(xscale * fbd.height/2);
+  if (scrollx != 0 || scrolly != 0) {
+    view_offset(viewparams, scrollx, scrolly);
+    xcentre = viewxcentre + viewparams.col0*pixel;
+    ycentre = viewycentre + viewparams.row0*pixel;
+  } else if (xscale != viewxscale ||
+             xcentre != viewxcentre + viewparams.col0*pixel ||
+             ycentre != viewycentre + viewparams.row0*pixel) {
+    view_params(viewparams, xcentre, ycentre, xscale,
+                fbd.width, fbd.height, maxiterations);
+    viewxcentre = xcentre;
+    viewycentre = ycentre;
+    viewxscale = xscale;
+  }
+  viewparams.maxiterations = maxiterations;
+  fprintf(stderr, "setscale: %.17g %.17g %.17g\n", xcentre, ycentre, xscale);
+  if (viewparams.precise) fprintf(stderr, "setscale: double-float\n");
+  setparams(gpudata, nqpus, viewparams);
+}
+
 void getframebuffer(int mb, FrameBufferDesc &fbd, int width, int height) {
   memset(&fbd, 0, sizeof(fbd));  
   fbd.width = width;
   fbd.height = height;
   fbd.v_width = width;
-  fbd.v_height = height*2;
+  fbd.v_height = height*NPAGES;
   fbd.bpp = 8;
   if (!create_frame_buffer(mb, &fbd)) {
     DEBUG("Frame buffer failure\n");
@@ -425,39 +438,52 @@ void getframebuffer(int mb, FrameBufferDesc &fbd, int width, int height) {
   memset(fbd.arm_address, 0x55, fbd.memory_size);
 }
 
-uint32_t setfb(FrameBufferDesc &fbd, int mb, int n){
-  uint32_t offset;
-  uint32_t xfb, yfb;
-  if (n == 0) {
-    xfb = 0; yfb = fbd.height;
-    offset = 0;
-  } else {
-    xfb = 0; yfb = 0;
-    offset = fbd.pitch * fbd.height;
-  }
+uint32_t pageoffset(int page) {
+  return page * fbd.pitch * fbd.height;
+}
+
+// Display page n, from the next vsync
+void setfb(FrameBufferDesc &fbd, int mb, int n){
+  uint32_t xfb = 0, yfb = n * fbd.height;
   set_frame_buffer_pos(mb, &xfb, &yfb);
-  return offset;
+}
+
+void *vsync_thread(void *) {
+  while (true) {
+    int res = device_waitvsync(fbfd);
+    int err = errno;
+    pthread_mutex_lock(&vsynclock);
+    if (res == 0) vsyncs++;
+    else vsyncing = false;
+    pthread_cond_broadcast(&vsynccond);
+    pthread_mutex_unlock(&vsynclock);
+    if (res != 0) {
+      fprintf(stderr, "FBIO_WAITFORVSYNC failed: %s\n", strerror(err));
+      return NULL;
+    }
+  }
+}
+
+// Wait until page is off the screen
+void wait_page(int page) {
+  pthread_mutex_lock(&vsynclock);
+  if (vsyncing && vsyncs <= pageflip[page]) {
+    timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (vsyncing && vsyncs <= pageflip[page]) {
+      pthread_cond_wait(&vsynccond, &vsynclock);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pagewaits++;
+    pagewaittime += (end.tv_sec - start.tv_sec) * 1000000 +
+      (end.tv_nsec - start.tv_nsec) / 1000;
+  }
+  pthread_mutex_unlock(&vsynclock);
 }
 
 void setpalette(int mb)
 {
-  palette[0] = 0;
-  for (int i = 1; i < 256; ++i) {
-    float f = 2*PI * i / maxiterations;
-
-    int k = 255; int j = 150;
-    int r = j + cos(f + PI/3) * k;
-    int g = j + cos(f + 3 * PI / 3) * k;
-    int b = j + cos(f + 5 * PI / 3) * k;
-
-    r = std::min(r, 255);
-    g = std::min(g, 255);
-    b = std::min(b, 255);
-    r = r < 0 ? 0 : r;
-    g = g < 0 ? 0 : g;
-    b = b < 0 ? 0 : b;
-    palette[i] =  (b << 16) | (g << 8) | r;
-  }
+  make_palette(palette, maxiterations);
   if (!set_frame_buffer_palette(mb, palette)) {
     fprintf(stderr, "error: can't set palette\n");
   }
@@ -506,37 +532,16 @@ set_input_mode (void)
   tcsetattr (STDIN_FILENO, TCSAFLUSH, &tattr);
 }
 
-void appsetup(GPUData *gpudata, int nqpus, int mb) {
-  const char *kbfds = "/dev/tty0";
-  set_input_mode();
-  //needed for vsync...
-  fbfd = open("/dev/fb0", O_RDWR);
-  if (fbfd < 0) {
-    fprintf(stderr, "Error: cannot open framebuffer device.\n");
-  }
-  getframebuffer(mb, fbd, width, height);
-  kbfd = open(kbfds, O_WRONLY);
-  if (kbfd >= 0) {
-    ioctl(kbfd, KDSETMODE, KD_GRAPHICS);
-  }
-  // Set up "control" at start
-  uint32_t offset = setfb(fbd, mb, 1);
-  for (int i = 0; i < nqpus; i++) {
-    gpudata->unifs[i][4] = fbd.gpu_address + offset;
-    gpudata->unifs[i][5] = fbd.width;   // Width
-    gpudata->unifs[i][6] = fbd.height;  // Height
-    gpudata->unifs[i][7] = fbd.pitch;   // Pitch
-    gpudata->unifs[i][8] = fbd.bpp;     // Depth
-  }
-  setscale(gpudata, nqpus);
-  setpalette(mb);
-}
-
 int termchar() {
   int state = 0;
   while (true) {
     int c = getchar();
-    if (c < 0) return c;
+    if (c < 0) {
+      // Nothing there (VMIN is 0), which stdio takes as end of file and
+      // would keep on returning.
+      clearerr(stdin);
+      return c;
+    }
     //fprintf(stderr, "%02x\n", c);
     if (state == 0) {
       switch (c) {
@@ -563,32 +568,138 @@ int termchar() {
   }
 }
 
+// Keys are read by input_thread and passed to the main loop through
+// keyqueue, a ring with the one writer and the one reader, so neither
+// has to wait for the other.
+static const unsigned KEYQUEUE = 64;
+int keyqueue[KEYQUEUE];
+unsigned keyhead = 0; // Written by input_thread
+unsigned keytail = 0; // Written by the main loop
+
+bool key_push(int c) {
+  unsigned head = __atomic_load_n(&keyhead, __ATOMIC_RELAXED);
+  unsigned tail = __atomic_load_n(&keytail, __ATOMIC_ACQUIRE);
+  if (head - tail == KEYQUEUE) return false;
+  keyqueue[head % KEYQUEUE] = c;
+  __atomic_store_n(&keyhead, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// Next key, or -1 if there isn't one
+int key_pop() {
+  unsigned tail = __atomic_load_n(&keytail, __ATOMIC_RELAXED);
+  unsigned head = __atomic_load_n(&keyhead, __ATOMIC_ACQUIRE);
+  if (head == tail) return -1;
+  int c = keyqueue[tail % KEYQUEUE];
+  __atomic_store_n(&keytail, tail + 1, __ATOMIC_RELEASE);
+  return c;
+}
+
+bool key_waiting() {
+  return __atomic_load_n(&keyhead, __ATOMIC_ACQUIRE) !=
+    __atomic_load_n(&keytail, __ATOMIC_RELAXED);
+}
+
+void *input_thread(void *) {
+  while (!terminated) {
+    pollfd p = { STDIN_FILENO, POLLIN, 0 };
+    int n = poll(&p, 1, 100);
+    if (n < 0 && errno != EINTR) break;
+    if (n <= 0) continue;
+    int c = termchar();
+    // Readable but nothing there is the end of a pipe
+    if (c < 0 && !keyboard) break;
+    for (; c >= 0; c = termchar()) {
+      if (!key_push(c)) fprintf(stderr, "Key dropped\n");
+    }
+  }
+  return NULL;
+}
+
+void appsetup(GPUData *gpudata, int nqpus, int mb) {
+  // Fixed length runs can do without a terminal
+  if (framelimit == 0 || isatty(STDIN_FILENO)) {
+    set_input_mode();
+    keyboard = true;
+  }
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, input_thread, NULL) == 0) {
+    pthread_detach(thread);
+  } else {
+    fprintf(stderr, "Error: cannot start input thread.\n");
+  }
+  //needed for vsync...
+  fbfd = device_openfb();
+  if (fbfd >= 0) {
+    vsyncing = true;
+    if (pthread_create(&thread, NULL, vsync_thread, NULL) == 0) {
+      pthread_detach(thread);
+    } else {
+      vsyncing = false;
+      fprintf(stderr, "Error: cannot start vsync thread.\n");
+    }
+  }
+  getframebuffer(mb, fbd, width, height);
+  if (rawcounts && fbd.width*fbd.height > (unsigned)(width*height)) {
+    fprintf(stderr, "Framebuffer bigger than asked for, no room for counts\n");
+    exit(EXIT_FAILURE);
+  }
+  device_console(true);
+  // Show page 0 and draw in page 1
+  setfb(fbd, mb, 0);
+  drawpage = 1;
+  fboffset = pageoffset(drawpage);
+  for (int i = 0; i < nqpus; i++) {
+    gpudata->unifs[i][4] = frame_address(0, 0);
+    gpudata->unifs[i][5] = fbd.width;   // Width
+    gpudata->unifs[i][6] = fbd.height;  // Height
+    if (rawcounts) {
+      gpudata->unifs[i][7] = fbd.width*sizeof(uint32_t);
+      gpudata->unifs[i][8] = 32;
+    } else {
+      gpudata->unifs[i][7] = fbd.pitch;   // Pitch
+      gpudata->unifs[i][8] = fbd.bpp;     // Depth
+    }
+  }
+  setscale(gpudata, nqpus);
+  setpalette(mb);
+}
+
 void appprepare(GPUData *gpudata, int nqpus, int mb, unsigned i) {
   (void)gpudata; (void)nqpus; (void)mb, (void)i;
+  uint64_t start = trace_now();
   bool handled = false;
   while (!handled && !terminated) {
     handled = true;
     int ch = -1;
     while (true) {
-      int tmp = termchar();
+      int tmp = key_pop();
       if (tmp == 0x7e) continue;
       if (tmp >= 0) ch = tmp;
       else break;
     }
-    float inc = 1/(5*xscale);
-    float zoom = 1.1;
+    // About a tenth of the height, snapped to whole 16 pixel blocks,
+    // the QPUs' unit of work, so the strip that scrolls into view
+    // costs no more than it has to.
+    int step = std::max(16, (int)fbd.height/10/16*16);
+    // The cache only has power of 2 scales
+    float zoom = cache_enabled() ? 2 : 1.1;
+    scrollx = scrolly = 0;
+    recolour = false;
+    int modulus = colourmod ? colourmod : maxiterations;
     switch (ch) {
+    // setscale moves the centre
     case 's': case KEY_UP:
-      ycentre -= inc;
+      scrolly = -step;
       break;
     case 'd': case KEY_DOWN:
-      ycentre += inc;
+      scrolly = step;
       break;
     case 'a': case KEY_LEFT:
-      xcentre += inc;
+      scrollx = step;
       break;
     case 'f': case KEY_RIGHT:
-      xcentre -= inc;
+      scrollx = -step;
       break;
     case 'w': case KEY_PPAGE:
       xscale *= zoom;
@@ -608,25 +719,66 @@ void appprepare(GPUData *gpudata, int nqpus, int mb, unsigned i) {
       maxiterations *= 2;
       fprintf(stderr, "Maxiterations now %d\n", maxiterations);
       break;
+    case 'c':
+      colouroffset++;
+      recolour = rawcounts;
+      handled = rawcounts;
+      break;
+    case ',':
+      if (modulus >= 4) colourmod = modulus / 2;
+      fprintf(stderr, "Colour cycle now %d\n", colourmod);
+      recolour = rawcounts;
+      handled = rawcounts;
+      break;
+    case '.':
+      if (modulus < (1 << 30)) colourmod = modulus * 2;
+      fprintf(stderr, "Colour cycle now %d\n", colourmod);
+      recolour = rawcounts;
+      handled = rawcounts;
+      break;
     default:
       handled = false;
     }
+    // Don't wait for keys when running a fixed number of frames.
+    if (framelimit > 0) break;
+    if (!handled && !key_waiting()) {
+      timespec t = { 0, 1000*1000 };
+      nanosleep(&t, NULL);
+      start = trace_now();
+    }
+  }
+  if (xzoom != 1 || xinc != 0 || cache_enabled()) {
+    // Not just a pan, so the view is worked out again from the centre
+    xcentre += scrollx/(xscale * fbd.height/2);
+    ycentre += scrolly/(xscale * fbd.height/2);
+    scrollx = scrolly = 0;
   }
   xscale *= xzoom;
   xcentre += xinc;
+  trace_end(TRACE_INPUT, start, i);
+  framestart = start;
+  start = trace_now();
   setscale(gpudata, nqpus);
+  trace_end(TRACE_SETSCALE, start, i);
 }  
 
 void appupdate(GPUData *gpudata, int nqpus, int mb, unsigned i) {
-  uint32_t offset = setfb(fbd, mb, i%2);
-  // Do vsync after flipping the buffers (to avoid writing
-  // before the flip actually happens?).
-  if (ioctl(fbfd, FBIO_WAITFORVSYNC, 0) != 0) {
-    fprintf(stderr, "FBIO_WAITFORVSYNC failed: %s\n",
-	    strerror(errno));
-  }
+  // Show the page we have been drawing into and move on to the next,
+  // which went off the screen a frame ago, so there's usually no wait.
+  uint64_t start = trace_now();
+  setfb(fbd, mb, drawpage);
+  pthread_mutex_lock(&vsynclock);
+  pageflip[showpage] = vsyncs;
+  pthread_mutex_unlock(&vsynclock);
+  showpage = drawpage;
+  drawpage = (drawpage + 1) % NPAGES;
+  trace_end(TRACE_FLIP, start, i);
+  start = trace_now();
+  wait_page(drawpage);
+  trace_end(TRACE_VSYNC, start, i);
+  fboffset = pageoffset(drawpage);
   for (int i = 0; i < nqpus; i++) {
-    gpudata->unifs[i][4] = fbd.gpu_address + offset;
+    gpudata->unifs[i][4] = frame_address(0, 0);
   }
 }
 
@@ -648,12 +800,9 @@ void append(GPUData *gpudata, int nqpus, int mb) {
       fprintf(stdout, "\n");
     }
   }
-  if (kbfd >= 0) {
-    ioctl(kbfd, KDSETMODE, KD_TEXT);
-    close(kbfd);
-  }
+  device_console(false);
   release_frame_buffer(mb, &fbd);
-  close(fbfd);
+  device_closefb(fbfd);
 }
 
 void setup(GPUData *gpudata, uint32_t gpubase, int nqpus, int mb) {
@@ -672,22 +821,779 @@ void setup(GPUData *gpudata, uint32_t gpubase, int nqpus, int mb) {
     gpudata->unifs[i][3] = nqpus;
   }
   memcpy((void*)gpudata->code, hexcode, sizeof gpudata->code);
+  memcpy((void*)gpudata->dfcode, dfhexcode, sizeof gpudata->dfcode);
+}
+
+int tilesize = 16;
+bool subdivide = false;
+int verify = 0;
+uint32_t *cpucounts = NULL;
+
+struct CpuFrame {
+  RenderParams params;
+  uint8_t *fb;
+  int pitch;
+  uint32_t *counts; // Raw counts instead, if not NULL
+};
+
+void cpu_tile(const Tile &tile, void *arg) {
+  CpuFrame *frame = (CpuFrame*)arg;
+  if (frame->counts) {
+    cpu_render_counts(frame->params, tile.x, tile.y, tile.w, tile.h,
+                      frame->counts, fbd.width);
+  } else {
+    cpu_render(frame->params, tile.x, tile.y, tile.w, tile.h,
+               frame->fb, frame->pitch);
+  }
+}
+
+// With -R, each pixel's state is kept, so that when only maxiterations
+// changes the pixels still running carry on from where they were.
+bool keepstate = false;
+PixelState *pixelstate = NULL;
+RenderParams stateparams; // View it is for
+bool statevalid = false;
+
+struct StateFrame {
+  RenderParams params;
+  PixelState *state;
+  uint8_t *fb;
+  int pitch;
+  int width;
+  int iterated; // Updated atomically
+};
+
+void state_tile(const Tile &tile, void *arg) {
+  StateFrame *frame = (StateFrame*)arg;
+  int n = cpu_render_state(frame->params, tile.x, tile.y, tile.w, tile.h,
+                           frame->state, frame->width,
+                           frame->fb, frame->pitch);
+  __atomic_add_fetch(&frame->iterated, n, __ATOMIC_RELAXED);
+}
+
+uint32_t state_execute() {
+  size_t npixels = fbd.width*fbd.height;
+  if (!pixelstate) pixelstate = new PixelState[npixels];
+  if (!statevalid || viewparams.xorigin != stateparams.xorigin ||
+      viewparams.yorigin != stateparams.yorigin ||
+      viewparams.col0 != stateparams.col0 ||
+      viewparams.row0 != stateparams.row0 ||
+      viewparams.scale != stateparams.scale) {
+    memset(pixelstate, 0, npixels*sizeof(PixelState));
+  }
+  StateFrame frame;
+  frame.params = viewparams;
+  frame.state = pixelstate;
+  frame.fb = fbd.arm_address + fboffset;
+  frame.pitch = fbd.pitch;
+  frame.width = fbd.width;
+  frame.iterated = 0;
+  sched_frame(fbd.width, fbd.height, tilesize, state_tile, &frame);
+  stateparams = viewparams;
+  statevalid = true;
+  fprintf(stderr, "State: %.1f%% of pixels iterated\n",
+          100.0*frame.iterated/npixels);
+  return 0;
+}
+
+// Render the current view on the CPU instead, straight into the
+// framebuffer, using the parameters setscale has just calculated.
+uint32_t cpu_execute() {
+  if (cache_enabled()) {
+    cache_render(xcentre, ycentre, xscale, fbd.width, fbd.height,
+                 maxiterations, rawcounts ? counts : NULL, fbd.width,
+                 fbd.arm_address + fboffset, fbd.pitch);
+    return 0;
+  }
+  if (keepstate && !rawcounts && !viewparams.precise) {
+    return state_execute();
+  }
+  CpuFrame frame;
+  frame.params = viewparams;
+  frame.fb = fbd.arm_address + fboffset;
+  frame.pitch = fbd.pitch;
+  frame.counts = rawcounts ? counts : NULL;
+  if (subdivide) {
+    // Needs the raw counts to compare, so render those and colourise
+    // them afterwards.
+    if (!cpucounts) {
+      cpucounts = rawcounts ? counts : new uint32_t[fbd.width*fbd.height];
+    }
+    subdiv_render(frame.params, fbd.width, fbd.height, verify,
+                  cpucounts, fbd.width);
+    if (!rawcounts) {
+      colourise(cpucounts, fbd.width, fbd.width, fbd.height,
+                frame.fb, frame.pitch, maxiterations, maxiterations, 0);
+    }
+    subdiv_print_stats(stderr);
+    return 0;
+  }
+  sched_frame(fbd.width, fbd.height, tilesize, cpu_tile, &frame);
+  return 0;
+}
+
+// Copy the frame on display into the one we are drawing, moved by
+// (scrollx,scrolly), and return the strip still to be rendered. Only
+// one of them is set, as we take a key at a time.
+Tile scroll_frame() {
+  int w = fbd.width, h = fbd.height, pitch = fbd.pitch;
+  if (rawcounts) {
+    // Only the one buffer, so move it in place, rows in the order
+    // that doesn't overwrite any before they are read.
+    for (int i = 0; i < h - abs(scrolly); i++) {
+      int y = scrolly > 0 ? i : h-1-i;
+      memmove(counts + y*w + std::max(0, -scrollx),
+              counts + (y+scrolly)*w + std::max(0, scrollx),
+              (w - abs(scrollx))*sizeof(uint32_t));
+    }
+  } else {
+    uint8_t *fb = fbd.arm_address + fboffset;
+    const uint8_t *prev = fbd.arm_address + pageoffset(showpage);
+    for (int y = std::max(0, -scrolly); y < std::min(h, h-scrolly); y++) {
+      memcpy(fb + y*pitch + std::max(0, -scrollx),
+             prev + (y+scrolly)*pitch + std::max(0, scrollx),
+             w - abs(scrollx));
+    }
+  }
+  Tile strip = { 0, 0, w, h };
+  if (scrollx > 0) strip.x = w - scrollx;
+  if (scrollx != 0) strip.w = abs(scrollx);
+  if (scrolly > 0) strip.y = h - scrolly;
+  if (scrolly != 0) strip.h = abs(scrolly);
+  return strip;
+}
+
+uint32_t cpu_execute_strip(const Tile &strip) {
+  CpuFrame frame;
+  frame.params = viewparams;
+  frame.fb = fbd.arm_address + fboffset;
+  frame.pitch = fbd.pitch;
+  frame.counts = rawcounts ? counts : NULL;
+  std::vector<Tile> tiles;
+  for (int y = strip.y; y < strip.y + strip.h; y += tilesize) {
+    for (int x = strip.x; x < strip.x + strip.w; x += tilesize) {
+      Tile t = { x, y, std::min(tilesize, strip.x + strip.w - x),
+                 std::min(tilesize, strip.y + strip.h - y) };
+      tiles.push_back(t);
+    }
+  }
+  sched_run(&tiles[0], tiles.size(), cpu_tile, &frame);
+  return 0;
+}
+
+// The QPU code only does whole frames, 16 rows per QPU at a time, so
+// render the view in params (origin at the top left of area) as a
+// frame of its own in area, with fewer QPUs if it is short.
+uint32_t gpu_execute_area(GPU &gpu, int mb, int nqpus, bool direct,
+                          const RenderParams &params, const Tile &area) {
+  int n = std::max(1, std::min(nqpus, (area.h+15)/16));
+  setparams(gpu.data, n, params);
+  for (int i = 0; i < n; i++) {
+    gpu.data->unifs[i][3] = n;
+    gpu.data->unifs[i][4] = frame_address(area.x, area.y);
+    gpu.data->unifs[i][5] = area.w;
+    gpu.data->unifs[i][6] = area.h;
+  }
+  uint32_t res = direct ? gpu_execute_direct(gpu.data->control, n,
+                                           area.w*area.h)
+    : gpu_execute(mb, gpu.vc + offsetof(GPUData,control), n);
+  // Back to the whole frame
+  setparams(gpu.data, n, viewparams);
+  for (int i = 0; i < n; i++) {
+    gpu.data->unifs[i][3] = nqpus;
+    gpu.data->unifs[i][4] = frame_address(0, 0);
+    gpu.data->unifs[i][5] = fbd.width;
+    gpu.data->unifs[i][6] = fbd.height;
+  }
+  return res;
+}
+
+uint32_t gpu_execute_strip(GPU &gpu, int mb, int nqpus, bool direct,
+                           const Tile &strip) {
+  RenderParams params = viewparams;
+  view_offset(params, strip.x, strip.y);
+  return gpu_execute_area(gpu, mb, nqpus, direct, params, strip);
+}
+
+// Progressive rendering. Pass 0 computes every 4th pixel each way and
+// fills 4x4 blocks with it, pass 1 the rest of every 2nd pixel, filling
+// 2x2 blocks, and pass 2 the rest. Each is shown as soon as it is done.
+// A key pressed meanwhile cancels the frame, a tile at a time on the
+// CPU and between passes on the QPUs, but the first pass always
+// finishes so there is something to look at.
+
+bool progressive = false;
+bool framecomplete = true; // Last frame got to the final pass
+int cancelled = 0;         // Set (atomically) once input is seen
+
+// Has a key been pressed? Cheap enough to ask after every tile, as
+// input_thread does the reading.
+bool check_cancel() {
+  if (__atomic_load_n(&cancelled, __ATOMIC_RELAXED)) return true;
+  if (!keyboard || !key_waiting()) return false;
+  __atomic_store_n(&cancelled, 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+struct PassFrame {
+  RenderParams params;
+  uint8_t *fb;
+  int pitch;
+  int pass;
+};
+
+void pass_tile(const Tile &tile, void *arg) {
+  PassFrame *f = (PassFrame*)arg;
+  if (f->pass > 0 && check_cancel()) return;
+  cpu_render_pass(f->params, tile.x, tile.y, tile.w, tile.h, 4 >> f->pass,
+                  f->fb, f->pitch);
+}
+
+// Blow the top left (width/factor) x (height/factor) pixels of the
+// drawing buffer up to the whole frame. Back to front, so nothing is
+// overwritten before it is read.
+void expand_frame(int factor) {
+  uint8_t *fb = fbd.arm_address + fboffset;
+  for (int y = fbd.height-1; y >= 0; y--) {
+    const uint8_t *src = fb + y/factor*fbd.pitch;
+    uint8_t *dst = fb + y*fbd.pitch;
+    for (int x = fbd.width-1; x >= 0; x--) dst[x] = src[x/factor];
+  }
+}
+
+uint32_t progressive_execute(GPU &gpu, int mb, int nqpus, bool use_cpu,
+                             bool direct) {
+  __atomic_store_n(&cancelled, 0, __ATOMIC_RELAXED);
+  framecomplete = false;
+  PassFrame frame;
+  frame.params = viewparams;
+  frame.pitch = fbd.pitch;
+  uint32_t res = 0;
+  for (int pass = 0; pass < 3; pass++) {
+    timespec start, end;
+    if (pass > 0) {
+      if (check_cancel()) return res;
+      // Show what we have and carry on in the other buffer, from a
+      // copy of it if we're going to reuse it.
+      appupdate(gpu.data, nqpus, mb, traceframe);
+      if (use_cpu) {
+        memcpy(fbd.arm_address + fboffset,
+               fbd.arm_address + pageoffset(showpage),
+               fbd.pitch*fbd.height);
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (use_cpu) {
+      frame.fb = fbd.arm_address + fboffset;
+      frame.pass = pass;
+      sched_frame(fbd.width, fbd.height, (tilesize+3) & ~3, pass_tile, &frame);
+    } else {
+      // Every factor'th pixel is just the pixel of a view with factor
+      // times the scale (powers of 2, so exactly the same coordinates;
+      // pans are whole blocks of 16, so the offsets divide too). The
+      // QPUs do it as a smaller frame, rounded up so it covers the
+      // whole of this one.
+      int factor = 4 >> pass;
+      RenderParams params = viewparams;
+      params.scale *= factor;
+      params.scalelo *= factor;
+      params.col0 /= factor;
+      params.row0 /= factor;
+      Tile area = { 0, 0, ((int)fbd.width + factor-1)/factor,
+                    ((int)fbd.height + factor-1)/factor };
+      res = gpu_execute_area(gpu, mb, nqpus, direct, params, area);
+      if (factor > 1) expand_frame(factor);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr, "Pass %d: %ld usecs%s\n", pass,
+            (end.tv_sec - start.tv_sec) * 1000000 +
+            (end.tv_nsec - start.tv_nsec) / 1000,
+            pass > 0 && cancelled ? " (cancelled)" : "");
+    if (res != 0) return res;
+  }
+  if (!cancelled) framecomplete = true;
+  return res;
+}
+
+// Simulated QPUs, for -b sim. The bus addresses are made up, they
+// just have to be where qpusim_map puts things.
+static const uint32_t SIM_DATA = 0xC1000000;
+static const uint32_t SIM_FB = 0xC2000000;
+GPUData *simdata = NULL;
+int simqpus = 12;
+bool simtimes = true; // Print the simulated time of each frame
+
+// Headless renderer running the QPU code in the simulator.
+void sim_render(const RenderParams &params, int width, int height,
+                uint8_t *fb, int pitch) {
+  if (!simdata) {
+    void *ptr;
+    if (posix_memalign(&ptr, 4096, sizeof(GPUData)) != 0) {
+      ERROR("can't allocate simulator memory\n");
+      exit(EXIT_FAILURE);
+    }
+    simdata = (GPUData*)ptr;
+    memset(ptr, 0, sizeof(GPUData));
+    setup(simdata, SIM_DATA, simqpus, -1);
+    qpusim_map(SIM_DATA, simdata, sizeof(GPUData));
+    qpusim_clear_counters();
+  }
+  qpusim_map(SIM_FB, fb, pitch*height);
+  for (int i = 0; i < simqpus; i++) {
+    simdata->unifs[i][4] = SIM_FB;
+    simdata->unifs[i][5] = width;
+    simdata->unifs[i][6] = height;
+    simdata->unifs[i][7] = pitch;
+    simdata->unifs[i][8] = 8;
+  }
+  setparams(simdata, simqpus, params);
+  unsigned res = qpusim_execute(simqpus,
+                                SIM_DATA + offsetof(GPUData, control),
+                                GPU_TIMEOUT);
+  if (res != 0) {
+    fprintf(stderr, "qpusim_execute failed: %u\n", res);
+  } else if (simtimes) {
+    fprintf(stderr, "Simulated time = %.0f usecs\n",
+            1e6 * qpusim_cycles() / QPUSIM_CLOCK_HZ);
+  }
+  qpusim_unmap(SIM_FB);
+}
+
+// Simulate n QPUs from the next frame on.
+void sim_set_qpus(int n) {
+  if (n == simqpus) return;
+  free(simdata);
+  simdata = NULL;
+  simqpus = n;
+}
+
+void usage() {
+  fprintf(stderr, "Usage: mandel [-b qpu|cpu|sim] [-k kernel] [-t threads] [-T tilesize]\n"
+                  "              [-x xcentre] [-y ycentre] [-z zoom] [-m maxiterations]\n"
+                  "              [-s <width>x<height>] [-n frames] [-D hw|fake] [-d] [-w spin|backoff]\n"
+                  "              [-X xcentre] [-Y ycentre] [-Z zoom] [-M] [-V samples] [-P] [-R] [-C]\n"
+                  "              [-J trace.json] [-S stats.csv] [-A samples] [-K Mbytes]\n"
+                  "              [-E store]\n"
+                  "              [<num QPUs>]\n"
+                  "       mandel -H [-o output] [-f framelist] [options]\n"
+                  "       mandel -B bench.csv [-b cpu|sim] [-t threads] [-n frames] [options]\n"
+                  "       mandel -E store -p levels [-x xcentre] [-y ycentre] [-z zoom]\n"
+                  "              [-m maxiterations] [-s <width>x<height>] [-t threads]\n"
+                  "       mandel -v keyframes [-e] [-o video.y4m] [-s <width>x<height>] [-t threads]\n"
+                  "       mandel -U socket [-t threads] [-T tilesize] [-S requests.csv]\n"
+                  "       mandel -G socket [-t connections] [-n requests] [-s <size>x<size>]\n"
+                  "              [-m maxiterations] [-C]\n"
+                  "-H renders without a display, to output (default mandel.ppm),\n"
+                  "or for each line \"xcentre ycentre zoom maxiterations [output]\"\n"
+                  "in framelist, on the CPU or, with -b sim, on simulated\n"
+                  "QPUs. -A anti-aliases .ppm output, rendering that many\n"
+                  "(4, 9, 16...) more points for each pixel on an edge.\n"
+                  "-B renders a catalogue of views at several iteration limits\n"
+                  "on 1 to threads CPU threads and 1 to <num QPUs> simulated\n"
+                  "QPUs (only one with -b), n frames each (default 5, 320x192),\n"
+                  "writing the times and throughput to bench.csv.\n"
+                  "-v renders a zoom video through the keyframes, lines of\n"
+                  "\"xcentre ycentre zoom maxiterations [frames]\", frames (default\n"
+                  "100) to the next, zooming exponentially, and writes it to\n"
+                  "stdout (or -o) as Y4M at 30 frames/s. -e, for zooms into\n"
+                  "one point, renders the zoom once as an exponential map and\n"
+                  "looks the frames up in it.\n"
+                  "-U serves tiles, rendered on the CPU, to requests on the\n"
+                  "Unix domain socket (see tileservice.h), until ^C. -G sends\n"
+                  "it requests from that many connections at once (default 4),\n"
+                  "n each (default 100), for tiles of that size (default\n"
+                  "256x256), as raw counts with -C, and prints the throughput.\n"
+                  "-D fake runs without a Pi (or root), emulating the mailbox,\n"
+                  "GPU memory and V3D registers, -d starts the QPUs through the\n"
+                  "registers rather than the mailbox, -n stops after that many\n"
+                  "frames, not waiting for keys.\n"
+                  "-w sets how -d waits for the QPUs: spin polls the registers\n"
+                  "flat out, backoff (the default) mostly sleeps.\n"
+                  "-X, -Y and -Z give the centre and zoom for a deep zoom\n"
+                  "(headless, one frame), the centre to any number of digits\n"
+                  "and the zoom up to 1e290.\n"
+                  "-M renders on the CPU by subdividing rectangles and filling\n"
+                  "those with uniform borders, -V checks that many random\n"
+                  "points inside each one first.\n"
+                  "-P renders each frame at 1/16, then 1/4, then full\n"
+                  "resolution, stopping early if a key is pressed.\n"
+                  "-R keeps where each pixel got to, so that raising the\n"
+                  "maximum iterations only carries on the ones still going.\n"
+                  "-C renders raw iteration counts and colours them afterwards,\n"
+                  "so \"c\", \",\" and \".\" recolour without rendering.\n"
+                  "-J traces each phase of every frame, printing percentiles and\n"
+                  "writing the events to trace.json for chrome://tracing.\n"
+                  "-S writes the performance counters for every frame to\n"
+                  "stats.csv (with -C, iterations per QPU cycle too).\n"
+                  "-K renders on the CPU through a cache of up to that many\n"
+                  "Mbytes of tiles, zooming by 2 at a time, so views seen\n"
+                  "before come back without rendering them again. -E takes\n"
+                  "the tiles it can from the tile store first (display and -H),\n"
+                  "and with -p fills it with the tiles of the view and of\n"
+                  "levels-1 more levels each zoomed in by 2, then exits.\n");
+  fprintf(stderr, "CPU kernels:\n");
+  cpu_list_kernels(stderr);
 }
 
 // A general purpose driver function
 int main(int argc, char *argv[]) {
   int nqpus = 12;
   int exec_direct = false;
-  argc--; argv++;
+  bool use_cpu = false;
+  bool use_sim = false;
+  const char *kernel = NULL;
+  int nthreads = 0;
+  bool headless = false;
+  const char *output = NULL;
+  const char *framelist = NULL;
+  const char *tracefile = NULL;
+  const char *statsfile = NULL;
+  const char *benchfile = NULL;
+  const char *servesocket = NULL;
+  const char *loadsocket = NULL;
+  bool sizegiven = false;
+  int aasamples = 0;
+  int cachemb = 0;
+  const char *storefile = NULL;
+  int prebuild = 0;
+  const char *keyframes = NULL;
+  bool expmap = false;
+  DeepView deep;
+  memset(&deep, 0, sizeof(deep));
+  int opt;
+  while ((opt = getopt(argc, argv, "b:k:t:T:x:y:z:m:s:o:f:n:D:dw:J:S:B:X:Y:Z:MV:A:K:E:p:U:G:v:ePRCHh")) != -1) {
+    switch (opt) {
+    case 'b':
+      if (strcmp(optarg, "cpu") == 0) use_cpu = true;
+      else if (strcmp(optarg, "qpu") == 0) use_cpu = false;
+      else if (strcmp(optarg, "sim") == 0) use_sim = headless = true;
+      else { usage(); exit(EXIT_FAILURE); }
+      break;
+    case 'k':
+      kernel = optarg;
+      use_cpu = true;
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    case 'T':
+      tilesize = atoi(optarg);
+      if (tilesize <= 0) { usage(); exit(EXIT_FAILURE); }
+      break;
+    case 'x':
+      xcentre = atof(optarg);
+      break;
+    case 'y':
+      ycentre = atof(optarg);
+      break;
+    case 'z':
+      xscale = atof(optarg);
+      if (xscale <= 0) { usage(); exit(EXIT_FAILURE); }
+      break;
+    case 'm':
+      maxiterations = atoi(optarg);
+      if (maxiterations <= 0) { usage(); exit(EXIT_FAILURE); }
+      break;
+    case 's':
+      if (sscanf(optarg, "%dx%d", &width, &height) != 2 ||
+          width <= 0 || height <= 0) {
+        usage(); exit(EXIT_FAILURE);
+      }
+      sizegiven = true;
+      break;
+    case 'n':
+      framelimit = atoi(optarg);
+      break;
+    case 'D':
+      if (!device_select(optarg)) exit(EXIT_FAILURE);
+      break;
+    case 'd':
+      exec_direct = true;
+      break;
+    case 'w':
+      if (!qpuwait_select(optarg)) exit(EXIT_FAILURE);
+      exec_direct = true;
+      break;
+    case 'J':
+      tracefile = optarg;
+      break;
+    case 'S':
+      statsfile = optarg;
+      break;
+    case 'B':
+      benchfile = optarg;
+      break;
+    case 'v':
+      keyframes = optarg;
+      break;
+    case 'e':
+      expmap = true;
+      break;
+    case 'U':
+      servesocket = optarg;
+      break;
+    case 'G':
+      loadsocket = optarg;
+      break;
+    case 'X':
+      deep.xcentre = optarg;
+      headless = true;
+      break;
+    case 'Y':
+      deep.ycentre = optarg;
+      headless = true;
+      break;
+    case 'Z':
+      deep.xscale = atof(optarg);
+      if (deep.xscale <= 0) { usage(); exit(EXIT_FAILURE); }
+      headless = true;
+      break;
+    case 'M':
+      subdivide = use_cpu = true;
+      break;
+    case 'V':
+      verify = atoi(optarg);
+      if (verify < 0) { usage(); exit(EXIT_FAILURE); }
+      subdivide = use_cpu = true;
+      break;
+    case 'A': {
+      aasamples = atoi(optarg);
+      int grid = (int)(sqrt((double)aasamples) + 0.5);
+      if (aasamples < 4 || grid*grid != aasamples) {
+        usage(); exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    case 'K':
+      cachemb = atoi(optarg);
+      if (cachemb <= 0) { usage(); exit(EXIT_FAILURE); }
+      use_cpu = true;
+      break;
+    case 'E':
+      storefile = optarg;
+      use_cpu = true;
+      break;
+    case 'p':
+      prebuild = atoi(optarg);
+      if (prebuild <= 0) { usage(); exit(EXIT_FAILURE); }
+      break;
+    case 'P':
+      progressive = true;
+      break;
+    case 'R':
+      keepstate = use_cpu = true;
+      break;
+    case 'C':
+      rawcounts = true;
+      break;
+    case 'H':
+      headless = true;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'f':
+      framelist = optarg;
+      break;
+    default:
+      usage();
+      exit(opt == 'h' ? 0 : EXIT_FAILURE);
+    }
+  }
+  argc -= optind; argv += optind;
   if (argc > 0) {
     nqpus = std::min(MAXQPUS,(int)strtoul(argv[0],NULL,0));
     argc--; argv++;
   }
+  if (keyframes) {
+    if (!cpu_select(kernel)) exit(EXIT_FAILURE);
+    sched_start(nthreads);
+    VideoOptions options;
+    options.width = width;
+    options.height = height;
+    options.tilesize = tilesize;
+    options.keyframes = keyframes;
+    options.output = output;
+    options.fps = 30;
+    options.inflight = 4;
+    options.expmap = expmap;
+    int res = video_main(options);
+    sched_print_stats(stderr);
+    sched_stop();
+    return res;
+  }
+  if (prebuild) {
+    if (!storefile) { usage(); exit(EXIT_FAILURE); }
+    if (!cpu_select(kernel)) exit(EXIT_FAILURE);
+    sched_start(nthreads);
+    int res = cache_prebuild(storefile, xcentre, ycentre, xscale, width,
+                             height, maxiterations, prebuild);
+    sched_print_stats(stderr);
+    sched_stop();
+    return res;
+  }
+  if ((cachemb || storefile) && (benchfile || servesocket || loadsocket)) {
+    fprintf(stderr, "-K and -E are only for the display and -H, ignored\n");
+    cachemb = 0;
+    storefile = NULL;
+  }
+  if (storefile) {
+    if (!store_open(storefile, CACHE_TILE)) exit(EXIT_FAILURE);
+    // Somewhere to keep the tiles found in it
+    if (!cachemb) cachemb = 64;
+  }
+  if (cachemb) cache_setup((size_t)cachemb << 20);
+  if (loadsocket) {
+    LoadOptions options;
+    options.socket = loadsocket;
+    options.connections = nthreads > 0 ? nthreads : 4;
+    options.requests = framelimit > 0 ? framelimit : 100;
+    options.size = sizegiven ? width : 256;
+    options.maxiterations = maxiterations;
+    options.raw = rawcounts;
+    return service_load(options);
+  }
+  if (servesocket) {
+    if (!cpu_select(kernel)) exit(EXIT_FAILURE);
+    sched_start(nthreads);
+    setsighandler();
+    ServiceOptions options;
+    options.socket = servesocket;
+    options.tilesize = tilesize;
+    options.statsfile = statsfile;
+    options.stop = &terminated;
+    int res = service_main(options);
+    sched_print_stats(stderr);
+    sched_stop();
+    return res;
+  }
+  if (benchfile) {
+    // Small enough for the simulator to get through 12 QPUs' worth
+    if (!sizegiven) {
+      width = 320;
+      height = 192;
+    }
+    BenchOptions options;
+    memset(&options, 0, sizeof(options));
+    options.width = width;
+    options.height = height;
+    options.tilesize = tilesize;
+    options.frames = framelimit;
+    options.cpu = !use_sim;
+    options.maxthreads = nthreads;
+    options.subdivide = subdivide;
+    options.verify = verify;
+    if (!use_cpu) {
+      if (nqpus <= 0) {
+        usage();
+        exit(EXIT_FAILURE);
+      }
+      options.simrender = sim_render;
+      options.simqpus = sim_set_qpus;
+      options.maxqpus = nqpus;
+      simtimes = false;
+    }
+    options.output = benchfile;
+    if (!cpu_select(kernel)) exit(EXIT_FAILURE);
+    return bench_main(options);
+  }
+  if (headless) {
+    HeadlessOptions options;
+    memset(&options, 0, sizeof(options));
+    if (use_sim) {
+      if (nqpus <= 0) {
+        usage();
+        exit(EXIT_FAILURE);
+      }
+      simqpus = nqpus;
+      options.render = sim_render;
+      options.rendername = "simulated QPU";
+      // The extra points for anti-aliasing are done on the CPU
+      if (aasamples) {
+        if (!cpu_select(kernel)) exit(EXIT_FAILURE);
+        sched_start(nthreads);
+      }
+    } else {
+      // No real QPUs without the mailbox.
+      if (!cpu_select(kernel)) exit(EXIT_FAILURE);
+      sched_start(nthreads);
+    }
+    options.width = width;
+    options.height = height;
+    options.tilesize = tilesize;
+    options.subdivide = subdivide;
+    options.verify = verify;
+    options.aasamples = aasamples;
+    options.cached = cache_enabled() && !use_sim;
+    if (cache_enabled() && use_sim) {
+      fprintf(stderr, "-K and -E render on the CPU, ignored with -b sim\n");
+    }
+    options.output = output ? output : framelist ? "mandel%04d.ppm" : "mandel.ppm";
+    options.framelist = framelist;
+    options.frame.xcentre = xcentre;
+    options.frame.ycentre = ycentre;
+    options.frame.xscale = xscale;
+    options.frame.maxiterations = maxiterations;
+    char xbuf[32], ybuf[32];
+    if (deep.xcentre || deep.ycentre || deep.xscale > 0) {
+      // Anything not given comes from the ordinary view
+      snprintf(xbuf, sizeof(xbuf), "%.17g", xcentre);
+      snprintf(ybuf, sizeof(ybuf), "%.17g", ycentre);
+      if (!deep.xcentre) deep.xcentre = xbuf;
+      if (!deep.ycentre) deep.ycentre = ybuf;
+      if (deep.xscale <= 0) deep.xscale = xscale;
+      deep.maxiterations = maxiterations;
+      options.deep = &deep;
+    }
+    int res = headless_main(options);
+    if (use_sim) {
+      counters_record(qpusim_counter, 0, 0, 0);
+      counters_print(stderr);
+      if (statsfile) counters_write_csv(statsfile);
+      qpusim_print_stats(stderr);
+      sched_stop();
+    } else {
+      sched_print_stats(stderr);
+      sched_stop();
+    }
+    if (options.cached) cache_print_stats(stderr);
+    return res;
+  }
+  if (aasamples) {
+    fprintf(stderr, "-A is only for headless .ppm output, ignored\n");
+  }
+  // The cache has the frames already, or fills them a tile at a time
+  if (cache_enabled() && (subdivide || keepstate || progressive)) {
+    fprintf(stderr, "-K and -E render through the cache, ignoring -M, -R "
+            "and -P\n");
+    subdivide = keepstate = progressive = false;
+  }
+  if (tracefile) trace_start(1 << 16);
+  if (use_cpu) {
+    if (!cpu_select(kernel)) exit(EXIT_FAILURE);
+    sched_start(nthreads);
+    fprintf(stderr, "Using %s CPU kernel, %d threads, %dx%d tiles\n",
+            cpu_kernel_name(), sched_threads(), tilesize, tilesize);
+  }
 
   struct GPU gpu;
   size_t datasize = sizeof(struct GPUData);
+  // The QPUs' raw counts go after the rest, a page on
+  size_t countsoffset = (datasize + BLOCK_SIZE-1) & ~(BLOCK_SIZE-1);
+  if (rawcounts && !use_cpu) {
+    datasize = countsoffset + width*height*sizeof(uint32_t);
+  }
   int mb = gpu_prepare(gpu, datasize);
   if (mb < 0) return mb; // Should have already reported error
+  if (rawcounts) {
+    if (use_cpu) {
+      counts = new uint32_t[width*height];
+    } else {
+      counts = (uint32_t*)((uint8_t*)gpu.data + countsoffset);
+      countsbus = gpu.vc + countsoffset;
+    }
+    memset(counts, 0, width*height*sizeof(uint32_t));
+  }
 
   uint32_t firmware = get_firmware_revision(mb);
   uint32_t model = get_board_model(mb);
@@ -696,7 +1602,7 @@ int main(int argc, char *argv[]) {
   fprintf(stderr, "firmware: %x\n", firmware);
   fprintf(stderr, "model: %d\n", model);
   fprintf(stderr, "revision: %x\n", revision);
-  fprintf(stderr, "serial: %llx\n", serial);
+  fprintf(stderr, "serial: %llx\n", (unsigned long long)serial);
   setup(gpu.data, gpu.vc, nqpus, mb);
   appsetup(gpu.data, nqpus, mb);
 
@@ -704,16 +1610,38 @@ int main(int argc, char *argv[]) {
 
   // We could use the GPU timer registers for this
   timespec start, end;
-  counter_setup();
+  counters_setup(peri);
+  device_clear_stats();
   int exec;
-  for (unsigned i = 0; !terminated; i++) {
+  unsigned i;
+  for (i = 0; !terminated && (framelimit == 0 || i < (unsigned)framelimit); i++) {
+    traceframe = i;
+    framestart = trace_now();
     if (i > 0) appprepare(gpu.data, nqpus, mb, i);
 
     clock_gettime(CLOCK_MONOTONIC,&start);
-    counter_clear();
-    exec = exec_direct ? gpu_execute_direct(gpu.data->control, nqpus)
-      : gpu_execute(mb, gpu.vc + offsetof(GPUData,control), nqpus);
-    counter_read();
+    uint64_t tracestart = trace_now();
+    counters_clear();
+    if (recolour) {
+      exec = 0;
+    } else if ((scrollx != 0 || scrolly != 0) && framecomplete) {
+      Tile strip = scroll_frame();
+      exec = use_cpu ? cpu_execute_strip(strip)
+        : gpu_execute_strip(gpu, mb, nqpus, exec_direct, strip);
+    } else if (progressive && !keepstate && !rawcounts) {
+      exec = progressive_execute(gpu, mb, nqpus, use_cpu, exec_direct);
+    } else {
+      exec = use_cpu ? cpu_execute()
+        : exec_direct ? gpu_execute_direct(gpu.data->control, nqpus,
+                                         fbd.width*fbd.height)
+        : gpu_execute(mb, gpu.vc + offsetof(GPUData,control), nqpus);
+    }
+    trace_end(TRACE_EXECUTE, tracestart, i);
+    if (rawcounts) {
+      tracestart = trace_now();
+      colourise_frame();
+      trace_end(TRACE_COLOURISE, tracestart, i);
+    }
     clock_gettime(CLOCK_MONOTONIC,&end);
 
     if (exec != 0) {
@@ -721,13 +1649,44 @@ int main(int argc, char *argv[]) {
     }
     // I doubt if the clock granularity is down to ns
     int tdiff = (end.tv_sec - start.tv_sec) * (1000 * 1000) + (end.tv_nsec - start.tv_nsec)/1000;
-    fprintf(stderr,"Time =  %d usecs\n", tdiff);
+    // The trace has it all, without the cost of printing every frame
+    if (!trace_enabled()) fprintf(stderr,"Time =  %d usecs\n", tdiff);
+    uint64_t iterations = 0;
+    if (statsfile && rawcounts) {
+      for (unsigned j = 0; j < fbd.width*fbd.height; j++) {
+        iterations += counts[j];
+      }
+    }
+    if (cache_enabled()) {
+      CacheStats cs;
+      cache_stats(cs);
+      counters_extra("cache_hits", cs.framehits);
+      counters_extra("cache_misses", cs.framemisses);
+      counters_extra("cache_storehits", cs.framestorehits);
+      counters_extra("cache_bytes", cs.bytes);
+    }
+    counters_read(i, tdiff, iterations);
     appupdate(gpu.data, nqpus, mb, i);
+    trace_end(TRACE_FRAME, framestart, i);
     //fprintf(stderr,"%d\n", i);
   }
-  counter_print();
+  counters_print(stderr);
+  if (statsfile) counters_write_csv(statsfile);
+  device_print_stats(stderr, i);
+  qpuwait_print_stats(stderr);
+  trace_print_stats(stderr);
+  if (tracefile) trace_write(tracefile);
+  if (vsyncing) {
+    fprintf(stderr, "Waited for a page %u times, %ld usecs\n",
+            pagewaits, pagewaittime);
+  }
+  if (use_cpu) {
+    sched_print_stats(stderr);
+    sched_stop();
+  }
+  if (cache_enabled()) cache_print_stats(stderr);
   PRINTREG(V3D_ERRSTAT);
-  if (peri[V3D_ERRSTAT] & ~(1<<12)) {
+  if (reg_read(peri, V3D_ERRSTAT) & ~(1<<12)) {
     fprintf(stderr,"There were errors!\n");
   }
   
@@ -26,6 +26,25 @@
 .set y0,     rb13
 .set y,      rb14
 .set inc,    rb15
+.set col0,   rb24 # Pixel (0,0) of the frame is (col0,row0) from the
+.set row0,   rb25 # origin
+
+# For the periodicity check
+.set xs,     rb16 # Saved point
+.set ys,     ra11
+.set pc,     ra12 # Groups until we next save it
+.set group,  ra13 # Groups done
+.set eps,    ra14 # Square of the distance that counts as coming back
+
+# How results are written out, worked out from depth
+.set npts,     rb17 # Points per VDW store
+.set omask,    rb18 # Mask for the results
+.set vpmw,     rb19 # VPM write setup for our block
+.set vdwbase,  rb20 # VDW store setup for our block
+.set eshift,   rb21 # Log2 of the bytes per point
+.set rowsper,  rb22 # Rows per VDW store, 16 or 1
+.set vdwstep,  rb23 # Added to the VDW setup for each store
+.set bandrows, ra15 # Rows of this band inside the frame
 
 # Get our uniforms
 mov input, unif   # 0
@@ -41,6 +60,56 @@ mov iters, unif
 mov xorigin, unif # 10
 mov yorigin, unif
 mov scale, unif
+mov -, unif       # The low words, for mandel_df
+mov -, unif
+mov -, unif       # 15
+mov col0, unif
+mov row0, unif
+
+mov eps, 1e-12
+mov r5, 1     # For counting groups, no small immediate being free
+
+# Depth 8 writes the counts mod iters, a byte each; depth 32 writes
+# the raw counts. Either way a VDW store is our 4 columns of the VPM
+# by 16 rows, so 16 or 4 points, bytes or words being its units.
+mov r0, iters
+sub omask, r0, 1
+mov npts, 16
+mov eshift, 0
+shl r0, index, 4 # 2 bits for byte address, 2 bits for row address
+mov r1, (1 << 12) | (0 << 11) | (1 << 10) | (0 << 8) # Vertical, laned, 8 bit
+add vpmw, r1, r0
+mov vdwbase, vdw_setup_0(0, 0, dma_h8p(0,0,0))
+mov r2, vdw_setup_0(0, 0, dma_h32(0,0))
+mov r1, 32
+sub.setf -, depth, r1
+mov.ifz omask, -1
+mov.ifz npts, 4
+mov.ifz eshift, 2
+mov.ifz vdwbase, r2
+and r0, index, 0x3 # Bottom 2 bits of index are the column
+shl r0, r0, 2
+shr r1, index, 2   # and the top 2 bits [5,4] of the row
+shl r1, r1, 4
+add r0, r0, r1
+mov r1, (1 << 12) | (0 << 11) | (1 << 10) | (2 << 8) # Vertical, 32 bit
+add.ifz vpmw, r1, r0
+
+# Our block for the VDW, units and depth being filled in for each store
+and r0, index, 0x3  # Bottom 2 bit of index
+shl r0, r0, 2+3     # become top 2 bits of column
+shr r1, index, 2    # Top 2 bits of index
+shl r1, r1, 4+4+3   # become bits [5,4] of row
+add r0, r0, r1
+add vdwbase, vdwbase, r0
+mov vdwstep, 1 << 7 # A row of the VPM
+
+# The VDW stride is only 13 bits, so if the output is wider than
+# that the rows have to be stored one at a time.
+mov rowsper, 16
+mov r0, 8192
+sub.setf -, pitch, r0
+mov.ifnn rowsper, 1
 
 # Clear VPM (easier debugging)
 mov count, 64
@@ -68,23 +137,32 @@ nop # Branch delay
 # add r1, r1, r2
 # nop
 
-# Initialize our framebuffer pointer
-nop; mul24 r0, index, pitch
-shl r0, r0, 4
-add fbout, fbbase, r0
-
 # Nested loop, down the y direction first
-# Each QPU does 16 rows, so start at index * 16
-shl row, index, 4
+# Each QPU does 16 rows, so start at index * 16, unless that is
+# already past the bottom of a short frame.
+shl r0, index, 4
+sub.setf -, r0, height
+brr.allnn -, :finish
+mov row, r0
+nop
+nop
 
 :rowloop
 
+# Our rows of the output, and how many of the 16 are inside the frame
+nop; mul24 r0, row, pitch
+add fbout, fbbase, r0
+sub r0, height, row
+mov r1, 16
+min bandrows, r0, r1
+
 # Each QPU does a whole row at a time.
 mov col, 0
 
 # Calculate our y-coordinate
 mov r0, row
 add r0, r0, elem_num
+add r0, r0, row0
 itof r0, r0
 nop;	fmul r0, r0, scale
 fadd y0, yorigin, r0
@@ -92,19 +170,14 @@ fadd y0, yorigin, r0
 :colloop
 mov count, 0  # Count up
 
-# VPM block write setup
-# Stride = 1, vertical, laned, 8 bit, start address 0
-mov r0, (1 << 12) | (0 << 11) | (1 << 10) | (0 << 8) | (0 << 0)
-
-# Add the start address of our block of the VPM
-shl r1, index, 4 # 2 bits for byte address, 2 bits for row address
-add vw_setup, r0, r1
+mov vw_setup, vpmw # Start of our block of the VPM
 
 :pointloop
 
 # Calculate our x-coordinate
 mov r0, col
 add r0, r0, count
+add r0, r0, col0
 itof r0, r0
 nop; 	fmul r0, r0, scale
 fadd x0, xorigin, r0
@@ -120,18 +193,33 @@ fadd x0, xorigin, r0
 .set y2,  r2
 .set res, r3
 
-mov res, 0   # Result will go here
-mov x, x0    # Our point
-mov y, y0
-
-mov inc, 1   # Increment res by this each time
-mov i, iters   # Maximum number of iterations
+# Points in the main cardioid or the period 2 bulb never escape, so
+# give them the full count straight away. In the cardioid if
+# q(q + x - 1/4) < y^2/4, where q = (x - 1/4)^2 + y^2, in the bulb
+# if (x + 1)^2 + y^2 < 1/16.
+nop;             fmul r2, y0, y0
+fsub r0, x0, 0.25
+fadd r1, x0, 1.0; fmul r3, r0, r0
+fadd r3, r3, r2;  fmul r1, r1, r1   # q
+fadd r1, r1, r2;  fmul r2, r2, 0.25 # Bulb, and y^2/4
+fadd r0, r3, r0
+fsub r1, r1, 0.0625; fmul r0, r3, r0
+fsub r0, r0, r2
+fmin.setf -, r0, r1
+
+mov res, 0;       mov x, x0    # Result will go here, and our point
+mov.ifn res, iters; mov xs, x0
+brr.alln -, :endloop           # All inside?
+mov inc, -1                    # Increment res by -inc each time
+mov.ifn inc, 0;   mov group, 0
+mov y, y0;        mov ys, y0
+mov pc, 1;        fmul x2, x, x
+mov i, iters                   # Maximum number of iterations
 
 # We fuse several iterations together and save a couple of
-# instructions per iteration. (2 + 9*UNROLL instructions total).
-nop;             fmul x2, x, x # Moved to delay slot on loop
+# instructions per iteration. (10 + 9*UNROLL instructions total).
 :mandelloop
-nop;             fmul y2, y, y
+add group, group, r5; fmul y2, y, y
 fadd r0, x2, y2; fmul y1, x, y
 fsub.setf -, 4.0, r0
 brr.alln -, :endloop	# All done?
@@ -143,58 +231,79 @@ fadd y1, y1, y1; mov.ifn inc, 0
 fadd x, x0, x1
 fadd y, y0, y1
 
-add res, res, inc; fmul x2, x, x
+sub res, res, inc; fmul x2, x, x
 nop;               fmul y2, y, y
 fadd r0, x2, y2;   fmul y1, x, y
 fsub.setf -, 4.0, r0
 brr.alln -, :endloop	# All done?
 .endr
 
-fsub x1, x2, y2
+fsub x1, x2, y2;  mov r2, 0
 fadd y1, y1, y1; mov.ifn inc, 0
 
-sub.setf i, i, UNROLL # Branch delay slot, but doesn't matter
+# Back where it was at the last save, so periodic? (Brent's method,
+# saving after 1, 2, 4, 8... groups.) If so it never escapes.
+fsub r0, x, xs
+fsub r1, y, ys;   fmul r0, r0, r0
+sub.setf pc, pc, 1; fmul r1, r1, r1
+fadd r0, r0, r1;  mov.ifz pc, group
+mov.ifz ys, y;    mov.ifz xs, x
+fsub.setf -, r0, eps
+sub r2, i, UNROLL; mov.ifn inc, r2
+mov.ifn res, iters
+
+# Carry on while any point has iterations left and hasn't
+# escaped or been found periodic
+and.setf i, r2, inc
 brr.anynz -, :mandelloop
 fadd x, x0, x1
 fadd y, y0, y1
-add res, res, inc; fmul x2, x, x
+sub res, res, inc; fmul x2, x, x
 
 :endloop
 
 add count, count, 1
-mov r0, iters
-sub r0, r0, 1
-and vpm, res, r0      # Write out result
+and vpm, res, omask   # Write out result
 
 .unset x2
 .unset y2
 .unset res
 
-sub.setf -, count, 16 # Write 16 bytes across (4 words)
+sub.setf -, count, npts # Write 16 bytes across (4 words)
 brr.anynz -, :pointloop
 nop
 nop
 nop
 
-# Now write out our block. Probably would be easier if
-# we wrote horizontal vectors.
-mov r0, vdw_setup_0(16, 4, dma_h32(0,0))
-and r1, index, 0x3  # Bottom 2 bit of index
-shl r1, r1, 2+3     # become top 2 bits of column
+# Now write out our block, as much of it as is inside the frame:
+# up to width - col points across and bandrows rows down.
+sub r0, width, col
+min r0, r0, npts
+shl r1, r0, eshift
+sub r1, pitch, r1
+mov r2, vdw_setup_1(0)
+add vw_setup, r2, r1
+shl r0, r0, 8
+shl r0, r0, 8       # Depth
+mov r3, bandrows
+min r3, r3, rowsper # Rows per store
+shl r1, r3, 12
+shl r1, r1, 11      # Units
 add r0, r0, r1
-shr r1, index, 2    # Top 2 bits of index
-shl r1, r1, 4+4+3   # become bits [5,4] of row
-add vw_setup, r0, r1
-
-mov r0, vdw_setup_1(0)
-add r0, r0, pitch
-sub r0, r0, 16
+add r0, r0, vdwbase
+mov r1, fbout
+mov r2, bandrows
+:storeloop
 mov vw_setup, r0
-
-mov vw_addr, fbout
+mov vw_addr, r1
 mov -, vw_wait
+sub.setf r2, r2, r3
+brr.anynz -, :storeloop
+add r0, r0, vdwstep # Next row of the VPM
+add r1, r1, pitch   # and of the output
+nop
 
-add col, col, 16
+add col, col, npts
 add fbout, fbout, 16
 sub.setf -, col, width
 brr.anyn -, :colloop
@@ -204,13 +313,14 @@ nop
 
 shl r0, nqpus, 4  # Skip over other QPUs output
 add row, row,  r0
-nop; mul24 r0, width, nqpus
+nop
 sub.setf -, row, height
 brr.anyn -, :rowloop
-shl r0, r0, 4
-sub r0, r0, width
-add fbout, fbout, r0
+nop
+nop
+nop
 
+:finish
 # Every QPU releases semaphore 1 (ie. increments it)
 # and terminates, except for QPU 0,
 mov.setf -, index
@@ -0,0 +1,442 @@
+# Double-float version of mandel.qasm, for views too deep for floats.
+#
+# Every number is an unevaluated sum hi + lo of two floats. The steps
+# are those of mandel16_df in cpukernel.h, in the same order, so that
+# the two give the same counts. Uniforms as for mandel.qasm, which
+# skips the low words of xorigin, yorigin and scale that this uses.
+
+.set fbout,  ra0
+.set col,    ra1
+.set row,    ra2
+.set count,  ra3
+.set index,  ra4  # QPU index
+.set nqpus,  ra5  # Total number of QPUs
+
+# The point, as hi + lo. x's low word is needed from both files.
+.set x0h,    ra6
+.set x0l,    ra7
+.set y0l,    ra8
+.set xh,     ra9
+.set xla,    ra10
+.set yla,    ra11
+.set res,    ra12
+.set i,      ra13
+.set sh,     ra19 # scale split into 12 bit halves
+.set cf,     ra21 # scalelo * f
+
+# Uniforms in B registers
+.set input,  rb0
+.set output, rb1
+.set fbbase, rb2
+.set width,  rb3
+.set height, rb4
+.set pitch,  rb5
+.set depth,  rb6
+.set iters,  rb7
+.set xorigin,rb8
+.set yorigin,rb9
+.set scale,  rb10
+.set xoriginlo,rb11
+.set yoriginlo,rb12
+.set scalelo,rb13
+
+.set y0h,    rb14
+.set yh,     rb15
+.set xlb,    rb16
+.set ylb,    rb17
+.set inc,    rb18
+.set sl,     rb27
+.set cq,     rb26 # scale * f
+
+# Loop temporaries, sharing registers where they don't overlap.
+# x^2 error in cx, y^2 error in cy, xy in pp + cp
+.set sx2,  ra14
+.set du,   ra14
+.set s2,   ra14
+.set u4,   ra14
+.set e4b,  ra14
+.set pa2,  ra15
+.set cx,   ra15
+.set de,   ra15
+.set t2,   ra15
+.set ph,   ra15
+.set w4,   ra15
+.set hy,   ra15
+.set pa1,  ra16
+.set qa2,  ra16
+.set qa4,  ra16
+.set qa6,  ra16
+.set m5,   ra16
+.set dbb,  ra16
+.set t2b,  ra16
+.set bb3,  ra16
+.set qa1,  ra17
+.set qa3,  ra17
+.set qa5,  ra17
+.set pp,   ra17
+.set e2,   ra17
+.set t3,   ra17
+.set cp,   ra18
+.set sy2,  rb19
+.set dd,   rb19
+.set bb2,  rb19
+.set pe,   rb19
+.set e4,   rb19
+.set t5,   rb19
+.set pb1,  rb20
+.set cy,   rb20
+.set de2,  rb20
+.set u2,   rb20
+.set e2b,  rb20
+.set t4,   rb20
+.set pb3,  rb21
+.set m4,   rb21
+.set dt,   rb21
+.set w2,   rb21
+.set s3,   rb21
+.set pb2,  rb22
+.set m3,   rb22
+.set dt2,  rb22
+.set hx,   rb22
+.set t4b,  rb22
+.set pb4,  rb23
+.set m6,   rb23
+.set ds,   rb23
+.set m1,   rb24
+.set m7,   rb24
+.set m2,   rb25
+
+# How results are written out, worked out from depth
+.set npts,     rb28 # Points per VDW store
+.set omask,    rb29 # Mask for the results
+.set vpmw,     rb30 # VPM write setup for our block
+.set vdwbase,  rb31 # VDW store setup for our block
+.set eshift,   ra22 # Log2 of the bytes per point
+.set rowsper,  ra23 # Rows per VDW store, 16 or 1
+.set vdwstep,  ra24 # Added to the VDW setup for each store
+.set bandrows, ra25 # Rows of this band inside the frame
+.set col0,     ra26 # Pixel offsets of the frame
+.set row0,     ra27
+
+# Get our uniforms
+mov input, unif   # 0
+mov output, unif
+mov index, unif
+mov nqpus, unif
+mov fbbase,  unif
+mov width, unif   # 5
+mov height, unif
+mov pitch, unif
+mov depth, unif
+mov iters, unif
+mov xorigin, unif # 10
+mov yorigin, unif
+mov scale, unif
+mov xoriginlo, unif
+mov yoriginlo, unif
+mov scalelo, unif # 15
+mov col0, unif
+mov row0, unif
+
+# Dekker's split, 2^12 + 1, kept in r5 throughout
+mov r5, 4097.0
+
+# Split scale once
+nop; fmul r0, scale, r5
+fsub r1, r0, scale
+fsub r0, r0, r1
+fsub sl, scale, r0; mov sh, r0
+
+# Depth 8 writes the counts mod iters, a byte each; depth 32 writes
+# the raw counts. Either way a VDW store is our 4 columns of the VPM
+# by 16 rows, so 16 or 4 points, bytes or words being its units.
+mov r0, iters
+sub omask, r0, 1
+mov npts, 16
+mov eshift, 0
+shl r0, index, 4 # 2 bits for byte address, 2 bits for row address
+mov r1, (1 << 12) | (0 << 11) | (1 << 10) | (0 << 8) # Vertical, laned, 8 bit
+add vpmw, r1, r0
+mov vdwbase, vdw_setup_0(0, 0, dma_h8p(0,0,0))
+mov r2, vdw_setup_0(0, 0, dma_h32(0,0))
+mov r1, 32
+sub.setf -, depth, r1
+mov.ifz omask, -1
+mov.ifz npts, 4
+mov.ifz eshift, 2
+mov.ifz vdwbase, r2
+and r0, index, 0x3 # Bottom 2 bits of index are the column
+shl r0, r0, 2
+shr r1, index, 2   # and the top 2 bits [5,4] of the row
+shl r1, r1, 4
+add r0, r0, r1
+mov r1, (1 << 12) | (0 << 11) | (1 << 10) | (2 << 8) # Vertical, 32 bit
+add.ifz vpmw, r1, r0
+
+# Our block for the VDW, units and depth being filled in for each store
+and r0, index, 0x3  # Bottom 2 bit of index
+shl r0, r0, 2+3     # become top 2 bits of column
+shr r1, index, 2    # Top 2 bits of index
+shl r1, r1, 4+4+3   # become bits [5,4] of row
+add r0, r0, r1
+add vdwbase, vdwbase, r0
+mov vdwstep, 1 << 7 # A row of the VPM
+
+# The VDW stride is only 13 bits, so if the output is wider than
+# that the rows have to be stored one at a time.
+mov rowsper, 16
+mov r0, 8192
+sub.setf -, pitch, r0
+mov.ifnn rowsper, 1
+
+# Nested loop, down the y direction first
+# Each QPU does 16 rows, so start at index * 16, unless that is
+# already past the bottom of a short frame.
+shl r0, index, 4
+sub.setf -, r0, height
+brr.allnn -, :finish
+mov row, r0
+nop
+nop
+
+:rowloop
+
+# Our rows of the output, and how many of the 16 are inside the frame
+nop; mul24 r0, row, pitch
+add fbout, fbbase, r0
+sub r0, height, row
+mov r1, 16
+min bandrows, r0, r1
+
+# Each QPU does a whole row at a time.
+mov col, 0
+
+# Calculate our y-coordinate, yorigin + f*scale in double-float
+# (df_coord in cpurender.cpp does the same)
+mov r0, row
+add r0, r0, elem_num
+add r0, r0, row0
+itof r0, r0
+nop;             fmul r1, r0, r5      # Split f
+fsub r2, r1, r0; fmul cq, r0, scale   # p = f*scale
+fsub r1, r1, r2; fmul cf, r0, scalelo
+fsub r2, r0, r1; fmul r3, sh, r1      # r1 + r2 = f
+fsub r3, r3, cq; fmul r0, sh, r2      # Error of p
+fadd r3, r3, r0; fmul r0, sl, r1
+fadd r3, r3, r0; fmul r0, sl, r2
+fadd r3, r3, r0
+fadd r3, r3, cf; mov r2, cq           # r2 + r3 = f*scale
+fadd r0, r2, yorigin                  # Add yorigin
+fsub r1, r0, yorigin
+fsub r2, r2, r1
+fsub r1, r0, r1
+fsub r1, yorigin, r1
+fadd r1, r1, r2
+fadd r2, yoriginlo, r3
+fadd r1, r1, r2
+fadd r2, r0, r1                       # Renormalise
+fsub r3, r2, r0
+fsub y0l, r1, r3; mov y0h, r2
+
+:colloop
+mov count, 0  # Count up
+
+mov vw_setup, vpmw # Start of our block of the VPM
+
+:pointloop
+
+# Calculate our x-coordinate, the same way
+mov r0, col
+add r0, r0, count
+add r0, r0, col0
+itof r0, r0
+nop;             fmul r1, r0, r5
+fsub r2, r1, r0; fmul cq, r0, scale
+fsub r1, r1, r2; fmul cf, r0, scalelo
+fsub r2, r0, r1; fmul r3, sh, r1
+fsub r3, r3, cq; fmul r0, sh, r2
+fadd r3, r3, r0; fmul r0, sl, r1
+fadd r3, r3, r0; fmul r0, sl, r2
+fadd r3, r3, r0
+fadd r3, r3, cf; mov r2, cq
+fadd r0, r2, xorigin
+fsub r1, r0, xorigin
+fsub r2, r2, r1
+fsub r1, r0, r1
+fsub r1, xorigin, r1
+fadd r1, r1, r2
+fadd r2, xoriginlo, r3
+fadd r1, r1, r2
+fadd r2, r0, r1
+fsub r3, r2, r0
+fsub r1, r1, r3; mov x0h, r2
+
+mov x0l, r1;     mov xlb, r1         # Our point
+mov xla, r1;     mov yh, y0h
+mov xh, r2;      mov ylb, y0l
+mov yla, y0l;    mov inc, 1          # Increment res by this each time
+mov res, 0
+mov i, iters   # Maximum number of iterations
+
+# One iteration per time round, as scheduled by hand. Registers
+# written in one instruction can't be read in the next, hence the nops.
+# Like mandel.qasm, all 16 points go round together, with inc set to 0
+# for the ones that have escaped.
+:dfloop
+nop                     ; fmul r0, xh, xh
+mov sx2, r0             ; fmul r1, yh, yh
+fadd r2, r0, r1         ; mov sy2, r1
+fsub.setf -, 4.0, r2    ; fmul r2, xh, r5
+brr.alln -, :dfend
+fsub r3, r2, xh         ; mov.ifn inc, 0
+fsub r2, r2, r3         ; fmul r0, yh, r5
+add res, res, inc       ; fmul pb1, r2, r2
+fsub r3, xh, r2         ; fmul pa2, xh, xlb
+fsub r1, r0, yh         ; fmul pa1, r2, r3
+fsub r0, r0, r1         ; fmul pb3, r3, r3
+fsub r1, yh, r0         ; fmul qa1, r0, r0
+nop                     ; fmul pb2, pa1, 2.0
+nop                     ; fmul pb4, pa2, 2.0
+fsub cx, pb1, sx2       ; fmul m1, r2, r0
+fsub cy, qa1, sy2       ; fmul qa2, r0, r1
+fadd cx, cx, pb2        ; fmul m2, r2, r1
+nop                     ; fmul qa3, qa2, 2.0
+fadd cx, cx, pb3        ; fmul m3, r3, r0
+fadd cy, cy, qa3        ; fmul qa4, r1, r1
+fadd cx, cx, pb4        ; fmul m4, r3, r1
+nop                     ; fmul qa5, yh, yla
+fadd cy, cy, qa4
+nop                     ; fmul qa6, qa5, 2.0
+nop                     ; fmul pp, xh, yh
+fadd cy, cy, qa6
+nop                     ; fmul m5, xh, ylb
+nop                     ; fmul m6, xla, yh
+fsub cp, m1, pp
+fadd m7, m5, m6
+fadd cp, cp, m2
+fsub ds, sx2, sy2
+fadd cp, cp, m3
+fsub dbb, ds, sx2
+fadd cp, cp, m4
+fsub dt, ds, dbb
+fadd cp, cp, m7
+fsub dt2, sx2, dt
+fadd du, sy2, dbb
+fsub dd, cx, cy
+fsub de, dt2, du
+fadd s2, ds, x0h
+fadd de2, de, dd
+fsub bb2, s2, ds
+fadd w2, de2, x0l
+fsub t2, s2, bb2
+fsub u2, x0h, bb2
+fsub t2b, ds, t2
+nop                     ; fmul ph, pp, 2.0
+fadd e2, t2b, u2
+nop                     ; fmul pe, cp, 2.0
+fadd e2b, e2, w2
+fadd s3, ph, y0h
+fadd hx, s2, e2b
+fsub bb3, s3, ph
+fsub t3, hx, s2
+nop                     ; mov xh, hx
+fsub xlb, e2b, t3
+fsub t4, s3, bb3
+nop                     ; mov xla, xlb
+fsub t4b, ph, t4
+fsub u4, y0h, bb3
+fadd w4, pe, y0l
+fadd e4, t4b, u4
+sub.setf i, i, 1
+fadd e4b, e4, w4
+nop
+fadd hy, s3, e4b
+nop
+fsub t5, hy, s3
+nop                     ; mov yh, hy
+brr.anynz -, :dfloop
+fsub ylb, e4b, t5
+nop
+nop                     ; mov yla, ylb
+
+:dfend
+
+add count, count, 1
+and vpm, res, omask   # Write out result
+
+sub.setf -, count, npts # Write 16 bytes across (4 words)
+brr.anynz -, :pointloop
+nop
+nop
+nop
+
+# Now write out our block, as much of it as is inside the frame:
+# up to width - col points across and bandrows rows down.
+sub r0, width, col
+min r0, r0, npts
+shl r1, r0, eshift
+sub r1, pitch, r1
+mov r2, vdw_setup_1(0)
+add vw_setup, r2, r1
+shl r0, r0, 8
+shl r0, r0, 8       # Depth
+mov r3, bandrows
+min r3, r3, rowsper # Rows per store
+shl r1, r3, 12
+shl r1, r1, 11      # Units
+add r0, r0, r1
+add r0, r0, vdwbase
+mov r1, fbout
+mov r2, bandrows
+:storeloop
+mov vw_setup, r0
+mov vw_addr, r1
+mov -, vw_wait
+sub.setf r2, r2, r3
+brr.anynz -, :storeloop
+add r0, r0, vdwstep # Next row of the VPM
+add r1, r1, pitch   # and of the output
+nop
+
+add col, col, npts
+add fbout, fbout, 16
+sub.setf -, col, width
+brr.anyn -, :colloop
+nop
+nop
+nop
+
+shl r0, nqpus, 4  # Skip over other QPUs output
+add row, row,  r0
+nop
+sub.setf -, row, height
+brr.anyn -, :rowloop
+nop
+nop
+nop
+
+:finish
+# Every QPU releases semaphore 1 (ie. increments it)
+# and terminates, except for QPU 0,
+mov.setf -, index
+brr.anynz -, :end
+srel -, 1
+nop
+nop
+
+# which acquires the semaphore nqpus times
+mov r0, nqpus
+:semloop
+sub.setf r0, r0, 1
+brr.anynz -, :semloop
+sacq -, 1
+nop
+nop
+
+# and interrupts the host.
+mov interrupt, 1;
+
+:end
+nop; nop; thrend
+nop
+nop
@@ -0,0 +1,785 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+
+#include "qpusim.h"
+
+// V3D spec: http://www.broadcom.com/docs/support/videocore/VideoCoreIV-AG100-R.pdf
+
+#define MAXQPUS 16
+#define PHYSQPUS 12      // On the Pi 2, so idle time includes unused QPUs
+#define QPUS_PER_SLICE 4
+#define NSLICES (MAXQPUS/QPUS_PER_SLICE)
+#define NELEMS 16
+#define NSEMS 16
+
+// Timing model, all in QPU clock cycles.
+#define ISSUE_CYCLES 4           // 16 elements on a 4-way ALU
+#define LINE_SIZE 64
+#define ICACHE_LINES 64          // Per slice
+#define UCACHE_LINES 16          // Per slice
+#define L2_LINES 2048            // 128K
+#define L2_HIT_CYCLES 12
+#define L2_MISS_CYCLES 60
+#define VDW_SETUP_CYCLES 16
+#define VDW_BYTES_PER_CYCLE 8
+
+// Performance counter sources, as in counters[] in mandel.cpp
+enum {
+  PC_QPU_TOTAL_IDLE = 13,
+  PC_QPU_TOTAL_VERTEX = 14,
+  PC_QPU_TOTAL_FRAGMENT = 15,
+  PC_QPU_TOTAL_VALID = 16,
+  PC_QPU_TOTAL_TMU_STALL = 17,
+  PC_QPU_TOTAL_SCOREBOARD_STALL = 18,
+  PC_QPU_TOTAL_VARYINGS_STALL = 19,
+  PC_QPU_TOTAL_ICACHE_HITS = 20,
+  PC_QPU_TOTAL_ICACHE_MISSES = 21,
+  PC_QPU_TOTAL_UCACHE_HITS = 22,
+  PC_QPU_TOTAL_UCACHE_MISSES = 23,
+  PC_QPU_TOTAL_TMU_PROCESSED = 24,
+  PC_QPU_TOTAL_TMU_MISSES = 25,
+  PC_QPU_TOTAL_VDW_STALL = 26,
+  PC_QPU_TOTAL_VCD_STALL = 27,
+  PC_QPU_TOTAL_L2_HITS = 28,
+  PC_QPU_TOTAL_L2_MISSES = 29,
+  PC_NCOUNTERS = 30
+};
+
+struct Region {
+  uint32_t bus;
+  uint32_t size;
+  uint8_t *host;
+};
+
+static std::vector<Region> regions;
+
+struct Qpu {
+  int num;
+  uint32_t pc;
+  uint32_t unif;
+  uint32_t ra[32][NELEMS];
+  uint32_t rb[32][NELEMS];
+  uint32_t acc[6][NELEMS];
+  bool zf[NELEMS], nf[NELEMS], cf[NELEMS];
+  int branchdelay;       // Instructions left before the branch happens
+  uint32_t branchtarget;
+  int enddelay;          // Same for thrend
+  bool done;
+  int semwait;           // Semaphore we are blocked on, or -1
+  bool mutexwait;
+  uint32_t vpmwsetup;    // VPM generic block write setup
+  uint32_t vdwsetup;     // VDW DMA setup
+  uint32_t vdwstride;
+  uint64_t dmadone;      // When our last DMA finishes
+  uint64_t time;         // When we can issue the next instruction
+  uint64_t busy;         // Cycles issuing or stalled
+};
+
+static Qpu qpus[MAXQPUS];
+static uint32_t vpm[64][16];
+static int sems[NSEMS];
+static int mutexowner;
+static uint64_t vdwfree;          // When the VDW can take another DMA
+static uint32_t icachetags[NSLICES][ICACHE_LINES];
+static uint32_t ucachetags[NSLICES][UCACHE_LINES];
+static uint32_t l2tags[L2_LINES];
+static uint64_t counts[PC_NCOUNTERS];
+static uint64_t lastcycles;
+static uint64_t instructions, interrupts;
+static uint64_t semstall, mutexstall, vdwbytes;
+static const char *error;
+
+void qpusim_map(uint32_t busaddr, void *host, uint32_t size)
+{
+  qpusim_unmap(busaddr);
+  Region r = { busaddr, size, (uint8_t*)host };
+  regions.push_back(r);
+}
+
+void qpusim_unmap(uint32_t busaddr)
+{
+  for (unsigned i = 0; i < regions.size(); i++) {
+    if (regions[i].bus == busaddr) {
+      regions.erase(regions.begin() + i);
+      return;
+    }
+  }
+}
+
+static uint8_t *translate(uint32_t bus, uint32_t size)
+{
+  for (unsigned i = 0; i < regions.size(); i++) {
+    const Region &r = regions[i];
+    if (bus >= r.bus && bus - r.bus <= r.size && size <= r.size - (bus - r.bus)) {
+      return r.host + (bus - r.bus);
+    }
+  }
+  error = "access to unmapped memory";
+  return NULL;
+}
+
+static uint32_t read32(uint32_t bus)
+{
+  uint8_t *p = translate(bus, 4);
+  uint32_t x = 0;
+  if (p) memcpy(&x, p, 4);
+  return x;
+}
+
+// Caches just keep tags, we only want to count hits and misses.
+static uint64_t l2_access(uint32_t bus)
+{
+  uint32_t line = bus / LINE_SIZE;
+  uint32_t &tag = l2tags[line % L2_LINES];
+  if (tag == line) {
+    counts[PC_QPU_TOTAL_L2_HITS]++;
+    return L2_HIT_CYCLES;
+  }
+  tag = line;
+  counts[PC_QPU_TOTAL_L2_MISSES]++;
+  return L2_MISS_CYCLES;
+}
+
+static uint64_t cache_access(uint32_t *tags, int nlines, uint32_t bus,
+                             int hits, int misses)
+{
+  uint32_t line = bus / LINE_SIZE;
+  uint32_t &tag = tags[line % nlines];
+  if (tag == line) {
+    counts[hits]++;
+    return 0;
+  }
+  tag = line;
+  counts[misses]++;
+  return l2_access(bus);
+}
+
+static inline float asfloat(uint32_t x) { float f; memcpy(&f, &x, 4); return f; }
+static inline uint32_t asint(float f) { uint32_t x; memcpy(&x, &f, 4); return x; }
+
+// The QPU flushes denormals to zero.
+static inline uint32_t ftz(uint32_t x) {
+  return (x & 0x7f800000) == 0 ? x & 0x80000000 : x;
+}
+static inline float getf(uint32_t x) { return asfloat(ftz(x)); }
+static inline uint32_t putf(float f) { return ftz(asint(f)); }
+
+static inline uint32_t bytewise(uint32_t a, uint32_t b, int op)
+{
+  uint32_t r = 0;
+  for (int i = 0; i < 32; i += 8) {
+    int x = (a >> i) & 0xff, y = (b >> i) & 0xff, z;
+    switch (op) {
+    case 0: z = (x*y + 127) / 255; break;   // v8muld
+    case 1: z = x < y ? x : y; break;       // v8min
+    case 2: z = x > y ? x : y; break;       // v8max
+    case 3: z = x + y > 255 ? 255 : x + y; break; // v8adds
+    default: z = x - y < 0 ? 0 : x - y; break;    // v8subs
+    }
+    r |= (uint32_t)z << i;
+  }
+  return r;
+}
+
+static inline int32_t ftoi(float f)
+{
+  if (!(f > -2147483648.0f && f < 2147483648.0f)) return 0;
+  return (int32_t)f;
+}
+
+// The ALUs work on all 16 elements at once, so the decoding is done
+// once per instruction rather than once per element.
+#define ELEMENTWISE(expr) \
+  for (int e = 0; e < NELEMS; e++) { \
+    uint32_t a = in0[e], b = in1[e]; (void)a; (void)b; res[e] = (expr); \
+  }
+
+// Add ALU. Returns true for a float result, sets carry for the flags.
+static bool addop(int op, const uint32_t *in0, const uint32_t *in1,
+                  uint32_t *res, bool *carry)
+{
+  memset(carry, 0, NELEMS*sizeof(bool));
+  switch (op) {
+  case 0: ELEMENTWISE(0); return false;
+  case 1: ELEMENTWISE(putf(getf(a) + getf(b))); return true;
+  case 2: ELEMENTWISE(putf(getf(a) - getf(b))); return true;
+  case 3: ELEMENTWISE(putf(fminf(getf(a), getf(b)))); return true;
+  case 4: ELEMENTWISE(putf(fmaxf(getf(a), getf(b)))); return true;
+  case 5: ELEMENTWISE(putf(fminf(fabsf(getf(a)), fabsf(getf(b))))); return true;
+  case 6: ELEMENTWISE(putf(fmaxf(fabsf(getf(a)), fabsf(getf(b))))); return true;
+  case 7: ELEMENTWISE(ftoi(getf(a))); return false;
+  case 8: ELEMENTWISE(putf((float)(int32_t)a)); return true;
+  case 12:
+    for (int e = 0; e < NELEMS; e++) carry[e] = (uint64_t)in0[e] + in1[e] > 0xffffffffULL;
+    ELEMENTWISE(a + b);
+    return false;
+  case 13:
+    for (int e = 0; e < NELEMS; e++) carry[e] = in0[e] < in1[e];
+    ELEMENTWISE(a - b);
+    return false;
+  case 14: ELEMENTWISE(a >> (b & 31)); return false;
+  case 15: ELEMENTWISE((int32_t)a >> (b & 31)); return false;
+  case 16: ELEMENTWISE((a >> (b & 31)) | (a << ((32 - (b & 31)) & 31))); return false;
+  case 17: ELEMENTWISE(a << (b & 31)); return false;
+  case 18: ELEMENTWISE((int32_t)a < (int32_t)b ? a : b); return false;
+  case 19: ELEMENTWISE((int32_t)a > (int32_t)b ? a : b); return false;
+  case 20: ELEMENTWISE(a & b); return false;
+  case 21: ELEMENTWISE(a | b); return false;
+  case 22: ELEMENTWISE(a ^ b); return false;
+  case 23: ELEMENTWISE(~a); return false;
+  case 24: ELEMENTWISE(a ? __builtin_clz(a) : 32); return false;
+  case 30: ELEMENTWISE(bytewise(a, b, 3)); return false;
+  case 31: ELEMENTWISE(bytewise(a, b, 4)); return false;
+  default:
+    error = "unsupported add op";
+    return false;
+  }
+}
+
+static bool mulop(int op, const uint32_t *in0, const uint32_t *in1,
+                  uint32_t *res)
+{
+  switch (op) {
+  case 0: ELEMENTWISE(0); return false;
+  case 1: ELEMENTWISE(putf(getf(a) * getf(b))); return true;
+  case 2: ELEMENTWISE((a & 0xffffff) * (b & 0xffffff)); return false;
+  default: ELEMENTWISE(bytewise(a, b, op - 3)); return false;
+  }
+}
+
+#undef ELEMENTWISE
+
+static void condition(const Qpu &q, int cond, bool *mask)
+{
+  for (int e = 0; e < NELEMS; e++) {
+    switch (cond) {
+    case 0: mask[e] = false; break;
+    case 1: mask[e] = true; break;
+    case 2: mask[e] = q.zf[e]; break;
+    case 3: mask[e] = !q.zf[e]; break;
+    case 4: mask[e] = q.nf[e]; break;
+    case 5: mask[e] = !q.nf[e]; break;
+    case 6: mask[e] = q.cf[e]; break;
+    default: mask[e] = !q.cf[e]; break;
+    }
+  }
+}
+
+static bool branch_condition(const Qpu &q, int cond)
+{
+  if (cond == 15) return true;
+  const bool *flags = cond < 4 ? q.zf : cond < 8 ? q.nf : q.cf;
+  bool set = (cond & 1) == 0;   // eg. allz vs allnz
+  bool any = (cond & 2) != 0;
+  if (cond >= 12) {
+    error = "bad branch condition";
+    return false;
+  }
+  for (int e = 0; e < NELEMS; e++) {
+    if (any && flags[e] == set) return true;
+    if (!any && flags[e] != set) return false;
+  }
+  return !any;
+}
+
+static void setflags(Qpu &q, const uint32_t *res, bool isfloat, const bool *carry)
+{
+  for (int e = 0; e < NELEMS; e++) {
+    if (isfloat) {
+      float f = asfloat(res[e]);
+      q.zf[e] = f == 0;
+      q.nf[e] = f < 0;
+      q.cf[e] = f > 0;
+    } else {
+      q.zf[e] = res[e] == 0;
+      q.nf[e] = (res[e] >> 31) != 0;
+      q.cf[e] = carry[e];
+    }
+  }
+}
+
+// Write a vector to the VPM as set up by vw_setup, then step the
+// address on by the stride.
+static void vpm_write(Qpu &q, const uint32_t *val)
+{
+  uint32_t setup = q.vpmwsetup;
+  int stride = (setup >> 12) & 0x3f;
+  bool horiz = (setup >> 11) & 1;
+  bool laned = (setup >> 10) & 1;
+  int size = (setup >> 8) & 3;   // 0: 8 bit, 1: 16 bit, 2: 32 bit
+  int addr = setup & 0xff;
+  uint8_t *bytes = (uint8_t*)vpm;
+  for (int e = 0; e < NELEMS; e++) {
+    int y, x, sub; // row, word, byte/half
+    if (size == 2) {
+      if (horiz) { y = addr & 0x3f; x = e; }
+      else { y = (addr & 0x30) + e; x = addr & 0xf; }
+      sub = 0;
+    } else if (size == 1) {
+      int h = addr & 1;
+      if (horiz) {
+        y = (addr >> 1) & 0x3f;
+        if (laned) { x = e; sub = h; }
+        else { x = h*8 + e/2; sub = e & 1; }
+      } else {
+        y = ((addr >> 1) & 0x30) + e; x = (addr >> 1) & 0xf; sub = h;
+      }
+    } else {
+      int b = addr & 3;
+      if (horiz) {
+        y = (addr >> 2) & 0x3f;
+        if (laned) { x = e; sub = b; }
+        else { x = b*4 + e/4; sub = e & 3; }
+      } else {
+        y = ((addr >> 2) & 0x30) + e; x = (addr >> 2) & 0xf; sub = b;
+      }
+    }
+    y &= 0x3f;
+    if (size == 2) {
+      vpm[y][x] = val[e];
+    } else if (size == 1) {
+      memcpy(bytes + (y*16 + x)*4 + sub*2, &val[e], 2);
+    } else {
+      bytes[(y*16 + x)*4 + sub] = val[e];
+    }
+  }
+  addr += stride;
+  q.vpmwsetup = (setup & ~0xff) | (addr & 0xff);
+}
+
+// Start a VDW DMA store from the VPM to bus address addr.
+static uint64_t vdw_store(Qpu &q, uint32_t addr, uint64_t now)
+{
+  uint32_t setup = q.vdwsetup;
+  int units = (setup >> 23) & 0x7f;
+  int depth = (setup >> 16) & 0x7f;
+  bool horiz = (setup >> 14) & 1;
+  int y = (setup >> 7) & 0x7f;
+  int x = (setup >> 3) & 0xf;
+  int modew = setup & 7;
+  if (units == 0) units = 128;
+  if (depth == 0) depth = 128;
+  // Units of depth are the element size.
+  int width = modew == 0 ? 4 : modew < 4 ? 2 : 1;
+  int offset = modew == 0 ? 0 : modew < 4 ? (modew & 1)*2 : modew & 3;
+  const uint8_t *bytes = (const uint8_t*)vpm;
+  uint32_t rowbytes = depth*width;
+  for (int u = 0; u < units; u++) {
+    uint8_t *dst = translate(addr, rowbytes);
+    if (!dst) return 0;
+    if (horiz) {
+      int start = ((y + u) & 0x3f)*64 + x*4 + offset;
+      for (uint32_t i = 0; i < rowbytes; i++) {
+        dst[i] = bytes[(start + i) % sizeof(vpm)];
+      }
+    } else {
+      // Each unit is a column, depth rows down.
+      for (int i = 0; i < depth; i++) {
+        int start = ((y + i) & 0x3f)*64 + ((x + u) & 0xf)*4 + offset;
+        memcpy(dst + i*width, bytes + start, width);
+      }
+    }
+    addr += rowbytes + q.vdwstride;
+  }
+  vdwbytes += units*rowbytes;
+  // The DMA engine is shared between all the QPUs.
+  uint64_t start = now > vdwfree ? now : vdwfree;
+  vdwfree = start + VDW_SETUP_CYCLES + units*rowbytes/VDW_BYTES_PER_CYCLE;
+  q.dmadone = vdwfree;
+  return start - now;
+}
+
+// A register read. Side effects (uniform reads, stalls) have been done
+// already.
+static void regread(const Qpu &q, bool isb, int addr, uint32_t unifval,
+                    uint32_t *val)
+{
+  if (addr < 32) {
+    memcpy(val, isb ? q.rb[addr] : q.ra[addr], NELEMS*sizeof(uint32_t));
+    return;
+  }
+  for (int e = 0; e < NELEMS; e++) {
+    switch (addr) {
+    case 32: val[e] = unifval; break;
+    case 38: val[e] = isb ? q.num : e; break;
+    case 39: case 49: case 50: case 51: val[e] = 0; break;
+    default:
+      error = "unsupported register read";
+      val[e] = 0;
+    }
+  }
+}
+
+// A register write, under the element mask.
+static void regwrite(Qpu &q, bool isb, int addr, const uint32_t *val,
+                     const bool *mask, uint64_t &stall)
+{
+  bool any = false;
+  for (int e = 0; e < NELEMS; e++) any |= mask[e];
+  if (!any) return;
+  if (addr < 32) {
+    uint32_t *reg = isb ? q.rb[addr] : q.ra[addr];
+    for (int e = 0; e < NELEMS; e++) if (mask[e]) reg[e] = val[e];
+    return;
+  }
+  switch (addr) {
+  case 32: case 33: case 34: case 35:
+    for (int e = 0; e < NELEMS; e++) if (mask[e]) q.acc[addr-32][e] = val[e];
+    break;
+  case 37: // r5: per quad from A, all from B
+    for (int e = 0; e < NELEMS; e++) {
+      q.acc[5][e] = isb ? val[0] : val[e & ~3];
+    }
+    break;
+  case 38:
+    interrupts++;
+    break;
+  case 39:
+    break;
+  case 40:
+    q.unif = val[0];
+    break;
+  case 48:
+    vpm_write(q, val);
+    break;
+  case 49:
+    if (!isb) {
+      error = "VPM reads not supported";
+    } else {
+      switch (val[0] >> 30) {
+      case 0: case 1: q.vpmwsetup = val[0]; break;
+      case 2: q.vdwsetup = val[0]; break;
+      case 3: q.vdwstride = val[0] & 0x1fff; break;
+      }
+    }
+    break;
+  case 50:
+    if (!isb) {
+      error = "VCD DMA loads not supported";
+    } else {
+      uint64_t wait = vdw_store(q, val[0], q.time);
+      counts[PC_QPU_TOTAL_VDW_STALL] += wait;
+      stall += wait;
+    }
+    break;
+  case 51:
+    mutexowner = -1;
+    break;
+  case 52: case 53: case 54: case 55:
+    for (int e = 0; e < NELEMS; e++) {
+      float f = getf(val[e]);
+      float r = addr == 52 ? 1/f : addr == 53 ? 1/sqrtf(f)
+        : addr == 54 ? exp2f(f) : log2f(f);
+      q.acc[4][e] = putf(r);
+    }
+    break;
+  default:
+    error = "unsupported register write";
+  }
+}
+
+static uint64_t read_unif(Qpu &q, uint32_t &val)
+{
+  int slice = q.num / QPUS_PER_SLICE;
+  uint64_t stall = cache_access(ucachetags[slice], UCACHE_LINES, q.unif,
+                                PC_QPU_TOTAL_UCACHE_HITS,
+                                PC_QPU_TOTAL_UCACHE_MISSES);
+  val = read32(q.unif);
+  q.unif += 4;
+  return stall;
+}
+
+static void release_sem(int n, uint64_t now)
+{
+  if (sems[n] < 15) sems[n]++;
+  for (int i = 0; i < MAXQPUS; i++) {
+    Qpu &q = qpus[i];
+    if (q.semwait == n) {
+      q.semwait = -1;
+      if (q.time < now) {
+        semstall += now - q.time;
+        q.busy += now - q.time;
+        q.time = now;
+      }
+    }
+  }
+}
+
+// Execute one instruction. Returns false if the QPU is now blocked.
+static bool step(Qpu &q)
+{
+  int slice = q.num / QPUS_PER_SLICE;
+  uint64_t stall = cache_access(icachetags[slice], ICACHE_LINES, q.pc,
+                                PC_QPU_TOTAL_ICACHE_HITS,
+                                PC_QPU_TOTAL_ICACHE_MISSES);
+  uint32_t lo = read32(q.pc);
+  uint32_t hi = read32(q.pc + 4);
+  if (error) return false;
+  int sig = hi >> 28;
+  int waddr_add = (hi >> 6) & 0x3f;
+  int waddr_mul = hi & 0x3f;
+  bool ws = (hi >> 12) & 1;
+  bool sf = (hi >> 13) & 1;
+  int cond_add = (hi >> 17) & 7;
+  int cond_mul = (hi >> 14) & 7;
+  uint32_t addres[NELEMS], mulres[NELEMS];
+  bool addmask[NELEMS], mulmask[NELEMS], carry[NELEMS];
+  bool addfloat = false, mulfloat = false;
+  bool flagsfromadd = true;
+  bool haveflags = false;
+
+  if (sig == 15) {
+    // Branch
+    int cond = (hi >> 20) & 0xf;
+    bool rel = (hi >> 19) & 1;
+    bool reg = (hi >> 18) & 1;
+    int raddr_a = (hi >> 13) & 0x1f;
+    uint32_t target = rel ? q.pc + 4*8 + lo : lo;
+    if (reg) target += q.ra[raddr_a][0];
+    if (branch_condition(q, cond)) {
+      q.branchdelay = 4;   // Counting this instruction
+      q.branchtarget = target;
+    }
+    // Link address
+    for (int e = 0; e < NELEMS; e++) {
+      addres[e] = mulres[e] = q.pc + 4*8;
+      addmask[e] = mulmask[e] = true;
+    }
+  } else if (sig == 14) {
+    // Load immediate or semaphore
+    int mode = (hi >> 25) & 7;
+    if (mode == 4) {
+      int n = lo & 0xf;
+      if (lo & 0x10) {
+        if (sems[n] == 0) {
+          q.semwait = n;
+          return false;
+        }
+        sems[n]--;
+      } else {
+        release_sem(n, q.time);
+      }
+    }
+    for (int e = 0; e < NELEMS; e++) {
+      uint32_t v = lo;
+      if (mode == 1 || mode == 3) {
+        // Per-element 2 bit values
+        int bit0 = (lo >> e) & 1, bit1 = (lo >> (16 + e)) & 1;
+        v = bit0 | (bit1 << 1);
+        if (mode == 1 && bit1) v |= ~3U;
+      }
+      addres[e] = mulres[e] = v;
+      carry[e] = false;
+    }
+    condition(q, cond_add, addmask);
+    condition(q, cond_mul, mulmask);
+    haveflags = sf;
+  } else {
+    // ALU instruction, possibly with a small immediate
+    int op_mul = lo >> 29;
+    int op_add = (lo >> 24) & 0x1f;
+    int raddr_a = (lo >> 18) & 0x3f;
+    int raddr_b = (lo >> 12) & 0x3f;
+    int muxes[4] = {
+      (int)(lo >> 9) & 7, (int)(lo >> 6) & 7, (int)(lo >> 3) & 7, (int)lo & 7
+    };
+    if (sig == 3) q.enddelay = 3;   // Counting this instruction
+    else if (sig != 1 && sig != 2 && sig != 13) {
+      error = "unsupported signal";
+      return false;
+    }
+    if ((hi >> 20) & 0xff) {
+      error = "pack and unpack not supported";
+      return false;
+    }
+    // Which inputs are actually used?
+    bool usea = false, useb = false;
+    for (int i = 0; i < 4; i++) {
+      if ((i < 2 ? op_add : op_mul) == 0) continue;
+      usea |= muxes[i] == 6;
+      useb |= muxes[i] == 7;
+    }
+    bool smallimm = sig == 13;
+    // Stalls and side effects of reads happen once per instruction
+    if ((usea && raddr_a == 51) || (useb && !smallimm && raddr_b == 51)) {
+      if (mutexowner >= 0 && mutexowner != q.num) {
+        q.mutexwait = true;
+        return false;
+      }
+      mutexowner = q.num;
+    }
+    if (useb && !smallimm && raddr_b == 50 && q.dmadone > q.time) {
+      uint64_t wait = q.dmadone - q.time;
+      counts[PC_QPU_TOTAL_VDW_STALL] += wait;
+      stall += wait;
+    }
+    uint32_t unifval = 0;
+    if ((usea && raddr_a == 32) || (useb && !smallimm && raddr_b == 32)) {
+      stall += read_unif(q, unifval);
+    }
+    uint32_t immval = 0;
+    if (smallimm) {
+      if (raddr_b < 16) immval = raddr_b;
+      else if (raddr_b < 32) immval = raddr_b - 32;
+      else if (raddr_b < 40) immval = asint((float)(1 << (raddr_b - 32)));
+      else if (raddr_b < 48) immval = asint(1.0f / (1 << (48 - raddr_b)));
+      else {
+        error = "vector rotation not supported";
+        return false;
+      }
+    }
+    uint32_t rega[NELEMS], regb[NELEMS];
+    if (usea) regread(q, false, raddr_a, unifval, rega);
+    if (useb) {
+      if (smallimm) {
+        for (int e = 0; e < NELEMS; e++) regb[e] = immval;
+      } else {
+        regread(q, true, raddr_b, unifval, regb);
+      }
+    }
+    const uint32_t *in[4];
+    for (int i = 0; i < 4; i++) {
+      int m = muxes[i];
+      in[i] = m < 6 ? q.acc[m] : m == 6 ? rega : regb;
+    }
+    addfloat = addop(op_add, in[0], in[1], addres, carry);
+    mulfloat = mulop(op_mul, in[2], in[3], mulres);
+    condition(q, op_add ? cond_add : 0, addmask);
+    condition(q, op_mul ? cond_mul : 0, mulmask);
+    haveflags = sf;
+    flagsfromadd = op_add != 0 && cond_add != 0;
+  }
+
+  regwrite(q, ws, waddr_add, addres, addmask, stall);
+  regwrite(q, !ws, waddr_mul, mulres, mulmask, stall);
+  if (haveflags) {
+    if (flagsfromadd) setflags(q, addres, addfloat, carry);
+    else {
+      bool nocarry[NELEMS] = { false };
+      setflags(q, mulres, mulfloat, nocarry);
+    }
+  }
+
+  instructions++;
+  counts[PC_QPU_TOTAL_VALID] += ISSUE_CYCLES;
+  q.time += ISSUE_CYCLES + stall;
+  q.busy += ISSUE_CYCLES + stall;
+  q.pc += 8;
+  if (q.branchdelay > 0 && --q.branchdelay == 0) {
+    q.pc = q.branchtarget;
+  }
+  if (q.enddelay > 0 && --q.enddelay == 0) {
+    q.done = true;
+  }
+  return true;
+}
+
+unsigned qpusim_execute(unsigned num_qpus, uint32_t control, unsigned timeout)
+{
+  if (num_qpus < 1 || num_qpus > MAXQPUS) {
+    fprintf(stderr, "qpusim: bad number of QPUs %u\n", num_qpus);
+    return 1;
+  }
+  error = NULL;
+  memset(vpm, 0, sizeof(vpm));
+  memset(sems, 0, sizeof(sems));
+  mutexowner = -1;
+  vdwfree = 0;
+  // Caches are flushed for each run, like execute_qpu does
+  memset(icachetags, 0xff, sizeof(icachetags));
+  memset(ucachetags, 0xff, sizeof(ucachetags));
+  for (unsigned i = 0; i < num_qpus; i++) {
+    Qpu &q = qpus[i];
+    memset(&q, 0, sizeof(q));
+    q.num = i;
+    q.unif = read32(control + 8*i);
+    q.pc = read32(control + 8*i + 4);
+    q.semwait = -1;
+  }
+  if (error) {
+    fprintf(stderr, "qpusim: %s reading control block at %08x\n",
+            error, control);
+    return 1;
+  }
+  uint64_t limit = (uint64_t)timeout * (QPUSIM_CLOCK_HZ / 1000);
+  uint64_t elapsed = 0;
+  while (true) {
+    // Run whoever is furthest behind.
+    Qpu *next = NULL;
+    bool running = false;
+    for (unsigned i = 0; i < num_qpus; i++) {
+      Qpu &q = qpus[i];
+      if (q.done) continue;
+      running = true;
+      if (q.semwait >= 0) continue;
+      if (!next || q.time < next->time) next = &q;
+    }
+    if (!running) break;
+    if (!next) {
+      fprintf(stderr, "qpusim: deadlock, all QPUs waiting on semaphores\n");
+      return 2;
+    }
+    if (next->time > limit) {
+      fprintf(stderr, "qpusim: timeout\n");
+      return 3;
+    }
+    bool ok = step(*next);
+    if (error) {
+      fprintf(stderr, "qpusim: QPU %d at %08x: %s\n",
+              next->num, next->pc, error);
+      return 4;
+    }
+    if (!ok) {
+      if (next->mutexwait) {
+        // Just try again later
+        next->mutexwait = false;
+        next->time += ISSUE_CYCLES;
+        next->busy += ISSUE_CYCLES;
+        mutexstall += ISSUE_CYCLES;
+      }
+    }
+  }
+  for (unsigned i = 0; i < num_qpus; i++) {
+    if (qpus[i].time > elapsed) elapsed = qpus[i].time;
+    if (qpus[i].dmadone > elapsed) elapsed = qpus[i].dmadone;
+  }
+  unsigned nphys = num_qpus > PHYSQPUS ? num_qpus : PHYSQPUS;
+  for (unsigned i = 0; i < nphys; i++) {
+    uint64_t busy = i < num_qpus ? qpus[i].busy : 0;
+    counts[PC_QPU_TOTAL_IDLE] += elapsed - busy;
+  }
+  lastcycles = elapsed;
+  return 0;
+}
+
+uint32_t qpusim_counter(int index)
+{
+  if (index < 0 || index >= PC_NCOUNTERS) return 0;
+  return counts[index];
+}
+
+void qpusim_clear_counters()
+{
+  memset(counts, 0, sizeof(counts));
+}
+
+uint64_t qpusim_cycles()
+{
+  return lastcycles;
+}
+
+void qpusim_print_stats(FILE *fp)
+{
+  fprintf(fp, "qpusim: %llu cycles (%.3f ms at %d MHz), %llu instructions\n",
+          (unsigned long long)lastcycles,
+          1e3 * lastcycles / QPUSIM_CLOCK_HZ, QPUSIM_CLOCK_HZ / 1000000,
+          (unsigned long long)instructions);
+  fprintf(fp, "qpusim: semaphore stalls %llu, mutex stalls %llu, "
+          "VDW bytes %llu, interrupts %llu\n",
+          (unsigned long long)semstall, (unsigned long long)mutexstall,
+          (unsigned long long)vdwbytes, (unsigned long long)interrupts);
+}
@@ -0,0 +1,40 @@
+// Software model of the VideoCore IV QPUs.
+//
+// Runs QPU code (eg. the hexcode[] array built from mandel.qasm) on the
+// host, with the same GPUControl/uniforms layout execute_qpu takes, so
+// kernels can be checked and timed without a Pi (or root).
+//
+// The simulated QPUs see bus addresses: host memory has to be mapped in
+// with qpusim_map before the code can read uniforms or code from it, or
+// DMA results into it. Supported are the ALU operations, small and load
+// immediates, branches, semaphores, uniforms, VPM writes and VDW (DMA)
+// stores; TMU, VPM reads, VCD and the TLB are not.
+//
+// Timing is a simple model: a QPU issues one instruction every 4 cycles
+// and stalls on instruction and uniform cache misses (with a shared L2
+// behind them), on semaphores and waiting for the single VDW engine.
+// It is good enough to compare kernels, not to predict frame times to
+// the microsecond.
+
+// Make size bytes of host memory visible at bus address busaddr,
+// replacing any existing mapping there.
+void qpusim_map(uint32_t busaddr, void *host, uint32_t size);
+void qpusim_unmap(uint32_t busaddr);
+
+// Like execute_qpu: control is the bus address of num_qpus pairs of
+// (uniforms address, code address). Returns 0 when all the QPUs have
+// ended, nonzero for an error or if they haven't finished within
+// timeout (in simulated ms).
+unsigned qpusim_execute(unsigned num_qpus, uint32_t control, unsigned timeout);
+
+// Value of V3D performance counter source index (as set in V3D_PCTRS,
+// eg. 13 for QPU_TOTAL_IDLE) accumulated since the last clear.
+uint32_t qpusim_counter(int index);
+void qpusim_clear_counters();
+
+// Simulated cycles taken by the last qpusim_execute.
+uint64_t qpusim_cycles();
+// Simulated clock rate, to turn cycles into time.
+#define QPUSIM_CLOCK_HZ 250000000
+
+void qpusim_print_stats(FILE *fp);
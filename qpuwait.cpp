@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <algorithm>
+
+#include "qpuwait.h"
+
+// Backing off: polls this many times before sleeping at all, then
+// sleeps from BACKOFF_MIN doubling to BACKOFF_MAX (ns), after first
+// sleeping for PREDICT_NUM/PREDICT_DEN of the last wait.
+#define SPIN_POLLS 16
+#define BACKOFF_MIN 20000
+#define BACKOFF_MAX 200000
+#define PREDICT_NUM 7
+#define PREDICT_DEN 8
+
+static bool spin = false;
+static uint64_t lastwait = 0; // ns, for lastwork
+static unsigned lastwork = 0;
+
+static unsigned waits = 0;
+static uint64_t waitwall = 0;
+static uint64_t waitcpu = 0;
+static unsigned sleeps = 0;
+
+static uint64_t now(clockid_t clock) {
+  timespec t;
+  clock_gettime(clock, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns) {
+  timespec t = { (time_t)(ns / 1000000000), (long)(ns % 1000000000) };
+  nanosleep(&t, NULL);
+  sleeps++;
+}
+
+bool qpuwait_select(const char *name) {
+  if (strcmp(name, "spin") == 0) spin = true;
+  else if (strcmp(name, "backoff") == 0) spin = false;
+  else {
+    fprintf(stderr, "Unknown wait \"%s\" (spin or backoff)\n", name);
+    return false;
+  }
+  return true;
+}
+
+const char *qpuwait_name() {
+  return spin ? "spin" : "backoff";
+}
+
+void qpuwait_begin(QpuWaitTimer &timer) {
+  timer.wall = now(CLOCK_MONOTONIC);
+  timer.cpu = now(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void qpuwait_end(const QpuWaitTimer &timer) {
+  uint64_t wall = now(CLOCK_MONOTONIC) - timer.wall;
+  waits++;
+  waitwall += wall;
+  waitcpu += now(CLOCK_THREAD_CPUTIME_ID) - timer.cpu;
+}
+
+int qpuwait(bool (*done)(void *arg), void *arg, unsigned work,
+            int timeoutms) {
+  QpuWaitTimer timer;
+  qpuwait_begin(timer);
+  uint64_t deadline = timer.wall + (uint64_t)timeoutms * 1000000;
+  int res = -1;
+  if (spin) {
+    for (;;) {
+      // Only look at the clock now and again
+      for (int q = 0; q < 1000 && res < 0; q++) {
+        if (done(arg)) res = 0;
+      }
+      if (res == 0 || now(CLOCK_MONOTONIC) >= deadline) break;
+    }
+  } else {
+    for (int q = 0; q < SPIN_POLLS && res < 0; q++) {
+      if (done(arg)) res = 0;
+    }
+    if (res < 0 && lastwork > 0) {
+      uint64_t predicted = lastwait * work / lastwork;
+      predicted = predicted * PREDICT_NUM / PREDICT_DEN;
+      if (predicted > BACKOFF_MIN) {
+        sleep_ns(std::min(predicted, deadline - timer.wall));
+      }
+    }
+    uint64_t backoff = BACKOFF_MIN;
+    while (res < 0) {
+      if (done(arg)) {
+        res = 0;
+        break;
+      }
+      uint64_t t = now(CLOCK_MONOTONIC);
+      if (t >= deadline) break;
+      sleep_ns(std::min(backoff, deadline - t));
+      backoff = std::min(backoff * 2, (uint64_t)BACKOFF_MAX);
+    }
+  }
+  qpuwait_end(timer);
+  if (res == 0 && work > 0) {
+    lastwait = now(CLOCK_MONOTONIC) - timer.wall;
+    lastwork = work;
+  }
+  return res;
+}
+
+void qpuwait_print_stats(FILE *f) {
+  if (waits == 0) return;
+  fprintf(f, "QPU waits (%s): %u, %.0f usecs each, CPU %.0f usecs each"
+          " (%.0f%%), %u sleeps\n", qpuwait_name(), waits,
+          waitwall / 1e3 / waits, waitcpu / 1e3 / waits,
+          waitwall ? 100.0 * waitcpu / waitwall : 0.0, sleeps);
+}
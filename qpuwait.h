@@ -0,0 +1,33 @@
+// Waiting for the QPUs to finish a frame.
+//
+// Started through the V3D registers (-d), the only way to know they
+// are done is to read the completion count until it comes up. Spinning
+// on it gets the frame back soonest but keeps an ARM core busy all the
+// while. Backing off instead sleeps for most of what the last wait
+// took, scaled to the size of this job (frames usually cost about the
+// same as the one before), then polls with sleeps that double up to a
+// limit. That costs next to no CPU, and at most the limit in latency.
+//
+// Started with the mailbox call, the firmware does the waiting, woken
+// by the QPU interrupt, and we just time it.
+
+// Select "spin" or "backoff" (the default)
+bool qpuwait_select(const char *name);
+const char *qpuwait_name();
+
+// Wait until done(arg) is true or timeoutms milliseconds have gone.
+// work is the size of the job (pixels, say), which the last wait is
+// scaled by to guess how long this one will be. Returns 0, or -1 on
+// timeout.
+int qpuwait(bool (*done)(void *arg), void *arg, unsigned work,
+            int timeoutms);
+
+// Around a wait done some other way, so it's counted too
+struct QpuWaitTimer {
+  uint64_t wall, cpu; // ns
+};
+void qpuwait_begin(QpuWaitTimer &timer);
+void qpuwait_end(const QpuWaitTimer &timer);
+
+// Number of waits, and the time and CPU time they took
+void qpuwait_print_stats(FILE *f);
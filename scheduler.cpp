@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+
+#include "scheduler.h"
+
+struct Task {
+  Tile tile;
+  TileFunc func;
+  void *arg;
+};
+
+// A growable ring buffer of tasks. The owner pushes and pops at the
+// tail, thieves take from the head. A plain mutex per deque is plenty
+// with tiles that take tens of microseconds or more.
+struct Deque {
+  pthread_mutex_t lock;
+  Task *tasks;
+  int size;   // Always a power of 2
+  int head;
+  int tail;
+};
+
+struct Worker {
+  int index;
+  pthread_t thread;
+  Deque deque;
+  unsigned seed;         // For picking victims
+  uint64_t busy;         // ns spent running tasks
+  unsigned ntasks;
+  unsigned nsteals;
+};
+
+static Worker *workers = NULL;
+static int nworkers = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+// Idle workers wait on this for sched_spawn or the end of the run
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static unsigned spawned = 0;  // Updated atomically
+static int sleepers = 0;      // Waiting on work, updated atomically
+static unsigned generation = 0;
+static bool stopping = false;
+static int pending = 0;  // Tasks not yet finished, updated atomically
+static uint64_t wall = 0; // ns spent inside sched_run
+
+static __thread Worker *self = NULL;
+static __thread const Task *current = NULL;
+
+static uint64_t now() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void deque_init(Deque &q) {
+  pthread_mutex_init(&q.lock, NULL);
+  q.size = 64;
+  q.tasks = (Task*)malloc(q.size * sizeof(Task));
+  q.head = q.tail = 0;
+}
+
+static void deque_free(Deque &q) {
+  pthread_mutex_destroy(&q.lock);
+  free(q.tasks);
+}
+
+static void deque_push(Deque &q, const Task &task) {
+  pthread_mutex_lock(&q.lock);
+  if (q.tail - q.head == q.size) {
+    Task *tasks = (Task*)malloc(2 * q.size * sizeof(Task));
+    for (int i = q.head; i != q.tail; i++) {
+      tasks[i & (2*q.size-1)] = q.tasks[i & (q.size-1)];
+    }
+    free(q.tasks);
+    q.tasks = tasks;
+    q.size *= 2;
+  }
+  q.tasks[q.tail++ & (q.size-1)] = task;
+  pthread_mutex_unlock(&q.lock);
+}
+
+static bool deque_pop(Deque &q, Task &task) {
+  bool found = false;
+  pthread_mutex_lock(&q.lock);
+  if (q.tail != q.head) {
+    task = q.tasks[--q.tail & (q.size-1)];
+    found = true;
+  }
+  pthread_mutex_unlock(&q.lock);
+  return found;
+}
+
+static bool deque_steal(Deque &q, Task &task) {
+  // Don't bother taking the lock for an empty deque
+  if (__atomic_load_n(&q.tail, __ATOMIC_RELAXED) ==
+      __atomic_load_n(&q.head, __ATOMIC_RELAXED)) {
+    return false;
+  }
+  bool found = false;
+  pthread_mutex_lock(&q.lock);
+  if (q.tail != q.head) {
+    task = q.tasks[q.head++ & (q.size-1)];
+    found = true;
+  }
+  pthread_mutex_unlock(&q.lock);
+  return found;
+}
+
+static bool find_task(Worker *w, Task &task) {
+  if (deque_pop(w->deque, task)) return true;
+  // Start at a random victim so thieves don't all pile onto one deque.
+  int start = rand_r(&w->seed) % nworkers;
+  for (int i = 0; i < nworkers; i++) {
+    Worker *victim = &workers[(start + i) % nworkers];
+    if (victim != w && deque_steal(victim->deque, task)) {
+      w->nsteals++;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Failed rounds of stealing before an idle worker sleeps
+#define IDLE_SPINS 8
+
+// Sleep until a task is spawned after seen or the run is over
+static void park(unsigned seen) {
+  pthread_mutex_lock(&lock);
+  __atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&spawned, __ATOMIC_SEQ_CST) == seen &&
+         __atomic_load_n(&pending, __ATOMIC_ACQUIRE) > 0) {
+    pthread_cond_wait(&work, &lock);
+  }
+  __atomic_sub_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&lock);
+}
+
+static void run_tasks(Worker *w) {
+  Task task;
+  int spins = 0;
+  while (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) > 0) {
+    unsigned seen = __atomic_load_n(&spawned, __ATOMIC_SEQ_CST);
+    if (!find_task(w, task)) {
+      // The rest are running on other threads, which may spawn more
+      if (++spins < IDLE_SPINS) sched_yield();
+      else park(seen);
+      continue;
+    }
+    spins = 0;
+    uint64_t start = now();
+    current = &task;
+    task.func(task.tile, task.arg);
+    current = NULL;
+    w->busy += now() - start;
+    w->ntasks++;
+    if (__atomic_sub_fetch(&pending, 1, __ATOMIC_ACQ_REL) == 0) {
+      pthread_mutex_lock(&lock);
+      pthread_cond_signal(&finished);
+      pthread_cond_broadcast(&work);
+      pthread_mutex_unlock(&lock);
+    }
+  }
+}
+
+static void *worker_main(void *arg) {
+  Worker *w = (Worker*)arg;
+  self = w;
+  unsigned seen = 0;
+  while (true) {
+    pthread_mutex_lock(&lock);
+    while (!stopping && generation == seen) {
+      pthread_cond_wait(&wakeup, &lock);
+    }
+    seen = generation;
+    bool stop = stopping;
+    pthread_mutex_unlock(&lock);
+    if (stop) break;
+    run_tasks(w);
+  }
+  return NULL;
+}
+
+void sched_start(int nthreads) {
+  assert(workers == NULL);
+  if (nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads <= 0) nthreads = 1;
+  nworkers = nthreads;
+  workers = new Worker[nworkers];
+  stopping = false;
+  for (int i = 0; i < nworkers; i++) {
+    Worker *w = &workers[i];
+    w->index = i;
+    w->seed = i + 1;
+    deque_init(w->deque);
+  }
+  sched_reset_stats();
+  for (int i = 0; i < nworkers; i++) {
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+void sched_stop() {
+  if (!workers) return;
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_broadcast(&wakeup);
+  pthread_mutex_unlock(&lock);
+  for (int i = 0; i < nworkers; i++) {
+    pthread_join(workers[i].thread, NULL);
+    deque_free(workers[i].deque);
+  }
+  delete [] workers;
+  workers = NULL;
+  nworkers = 0;
+}
+
+int sched_threads() {
+  return nworkers;
+}
+
+void sched_run(const Tile *tiles, int ntiles, TileFunc func, void *arg) {
+  if (!workers) sched_start(0);
+  if (ntiles == 0) return;
+  uint64_t start = now();
+  __atomic_store_n(&pending, ntiles, __ATOMIC_RELEASE);
+  // Give each worker a contiguous run of tiles to start with,
+  // stealing evens out the load from there.
+  for (int i = 0; i < nworkers; i++) {
+    int first = (int64_t)ntiles * i / nworkers;
+    int last = (int64_t)ntiles * (i+1) / nworkers;
+    // Pushed in reverse so the owner pops them in order
+    for (int j = last-1; j >= first; j--) {
+      Task task = { tiles[j], func, arg };
+      deque_push(workers[i].deque, task);
+    }
+  }
+  pthread_mutex_lock(&lock);
+  generation++;
+  pthread_cond_broadcast(&wakeup);
+  while (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) > 0) {
+    pthread_cond_wait(&finished, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+  wall += now() - start;
+}
+
+void sched_frame(int width, int height, int tilesize,
+                 TileFunc func, void *arg) {
+  int ncols = (width + tilesize - 1) / tilesize;
+  int nrows = (height + tilesize - 1) / tilesize;
+  Tile *tiles = new Tile[ncols * nrows];
+  int n = 0;
+  for (int y = 0; y < height; y += tilesize) {
+    for (int x = 0; x < width; x += tilesize) {
+      Tile &tile = tiles[n++];
+      tile.x = x;
+      tile.y = y;
+      tile.w = std::min(tilesize, width - x);
+      tile.h = std::min(tilesize, height - y);
+    }
+  }
+  sched_run(tiles, n, func, arg);
+  delete [] tiles;
+}
+
+void sched_spawn(const Tile &tile) {
+  assert(self != NULL && current != NULL);
+  __atomic_add_fetch(&pending, 1, __ATOMIC_ACQ_REL);
+  Task task = { tile, current->func, current->arg };
+  deque_push(self->deque, task);
+  __atomic_add_fetch(&spawned, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&lock);
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+void sched_print_stats(FILE *fp) {
+  uint64_t total = 0;
+  for (int i = 0; i < nworkers; i++) {
+    Worker *w = &workers[i];
+    uint64_t idle = wall > w->busy ? wall - w->busy : 0;
+    fprintf(fp, "thread %2d: busy %8.2f ms idle %8.2f ms (%5.1f%%) tiles %u steals %u\n",
+            i, w->busy/1e6, idle/1e6,
+            wall ? 100.0 * w->busy / wall : 0.0, w->ntasks, w->nsteals);
+    total += w->busy;
+  }
+  // Speedup over running the same tiles on a single thread.
+  if (wall) {
+    fprintf(fp, "%d threads: %.2f ms, parallel speedup %.2f (%.0f%% of linear)\n",
+            nworkers, wall/1e6, (double)total / wall,
+            100.0 * total / wall / nworkers);
+  }
+}
+
+void sched_reset_stats() {
+  for (int i = 0; i < nworkers; i++) {
+    workers[i].busy = 0;
+    workers[i].ntasks = 0;
+    workers[i].nsteals = 0;
+  }
+  wall = 0;
+}
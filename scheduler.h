@@ -0,0 +1,38 @@
+// Work-stealing tile scheduler for the CPU backend.
+//
+// The QPU kernel splits the frame statically, 16 rows per QPU at a
+// time, so one QPU stuck in the interior of the set holds up the whole
+// frame. Here the frame is cut into tiles which are shared out between
+// a pool of threads, each with its own deque. A thread works from the
+// back of its own deque and, when that is empty, steals from the front
+// of someone else's. One that finds nothing to steal for a few rounds
+// sleeps until a tile is spawned or the run ends, rather than spinning
+// through the tail of the run.
+
+struct Tile {
+  int x, y, w, h;
+};
+
+typedef void (*TileFunc)(const Tile &tile, void *arg);
+
+// Start nthreads workers (0 means one per core).
+void sched_start(int nthreads);
+void sched_stop();
+int sched_threads();
+
+// Run func on each tile and wait for them all to finish.
+void sched_run(const Tile *tiles, int ntiles, TileFunc func, void *arg);
+
+// Split a width x height frame into tilesize x tilesize tiles (smaller
+// at the right and bottom edges if need be) and run func on them.
+void sched_frame(int width, int height, int tilesize,
+                 TileFunc func, void *arg);
+
+// Called from inside a TileFunc: add another tile to the current run,
+// it will be passed to the same func.
+void sched_spawn(const Tile &tile);
+
+// Per-thread time spent running tiles (busy) and waiting for the rest
+// of a run to finish (idle), since start or the last reset.
+void sched_print_stats(FILE *fp);
+void sched_reset_stats();
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+
+#include "cpurender.h"
+#include "scheduler.h"
+#include "subdivide.h"
+
+// Size of the first cells, and of the rectangles that are rendered
+// rather than split again.
+#define SUBDIV_CELL 64
+#define SUBDIV_MIN 8
+
+struct SubdivFrame {
+  RenderParams params;
+  uint32_t *counts;
+  int stride;
+  int verify;
+};
+
+static struct {
+  int width, height;
+  int verify;
+  uint64_t iterated;  // Pixels, updated atomically
+  unsigned filled;    // Rectangles
+  unsigned failed;    // Uniform border but failed verification
+} stats;
+
+static void count_iterated(int n) {
+  __atomic_add_fetch(&stats.iterated, (uint64_t)n, __ATOMIC_RELAXED);
+}
+
+// The rectangle (x,y,w,h), gathered into whole vectors of 16 as the
+// pieces here are mostly narrower than that.
+static void render_rect(const SubdivFrame *f, int x, int y, int w, int h) {
+  int cols[256], rows[256];
+  uint32_t res[256];
+  int n = w*h;
+  for (int j = 0; j < n; j += 256) {
+    int m = std::min(256, n-j);
+    for (int i = 0; i < m; i++) {
+      cols[i] = x + (j+i)%w;
+      rows[i] = y + (j+i)/w;
+    }
+    cpu_render_points(f->params, cols, rows, m, res);
+    for (int i = 0; i < m; i++) {
+      f->counts[(size_t)rows[i]*f->stride + cols[i]] = res[i];
+    }
+  }
+  count_iterated(n);
+}
+
+static void row_tile(const Tile &tile, void *arg) {
+  SubdivFrame *f = (SubdivFrame*)arg;
+  cpu_render_counts(f->params, tile.x, tile.y, tile.w, tile.h,
+                    f->counts, f->stride);
+  count_iterated(tile.w*tile.h);
+}
+
+static void column_tile(const Tile &tile, void *arg) {
+  render_rect((SubdivFrame*)arg, tile.x, tile.y, tile.w, tile.h);
+}
+
+static bool uniform_border(const SubdivFrame *f, const Tile &r, uint32_t v) {
+  const uint32_t *top = f->counts + (size_t)r.y*f->stride;
+  const uint32_t *bottom = top + (size_t)(r.h-1)*f->stride;
+  for (int x = r.x; x < r.x+r.w; x++) {
+    if (top[x] != v || bottom[x] != v) return false;
+  }
+  for (int y = 1; y < r.h-1; y++) {
+    if (top[y*f->stride + r.x] != v ||
+        top[y*f->stride + r.x+r.w-1] != v) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Some random points strictly inside r all come out as v?
+static bool verified(const SubdivFrame *f, const Tile &r, uint32_t v) {
+  if (f->verify <= 0) return true;
+  // Seeded by position, so the same frame always checks the same points
+  unsigned seed = r.x*65599 + r.y*31 + r.w*7 + r.h;
+  std::vector<int> cols(f->verify), rows(f->verify);
+  std::vector<uint32_t> res(f->verify);
+  for (int i = 0; i < f->verify; i++) {
+    cols[i] = r.x+1 + rand_r(&seed) % (r.w-2);
+    rows[i] = r.y+1 + rand_r(&seed) % (r.h-2);
+  }
+  cpu_render_points(f->params, &cols[0], &rows[0], f->verify, &res[0]);
+  count_iterated(f->verify);
+  for (int i = 0; i < f->verify; i++) {
+    if (res[i] != v) {
+      __atomic_add_fetch(&stats.failed, 1, __ATOMIC_RELAXED);
+      return false;
+    }
+  }
+  return true;
+}
+
+// The border of r has been computed, do the inside.
+static void rect_tile(const Tile &r, void *arg) {
+  SubdivFrame *f = (SubdivFrame*)arg;
+  int iw = r.w-2, ih = r.h-2;
+  if (iw <= 0 || ih <= 0) return;
+  uint32_t v = f->counts[(size_t)r.y*f->stride + r.x];
+  if (uniform_border(f, r, v) && verified(f, r, v)) {
+    for (int y = r.y+1; y < r.y+r.h-1; y++) {
+      uint32_t *row = f->counts + (size_t)y*f->stride;
+      std::fill(row + r.x+1, row + r.x+r.w-1, v);
+    }
+    __atomic_add_fetch(&stats.filled, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  if (iw <= SUBDIV_MIN || ih <= SUBDIV_MIN) {
+    render_rect(f, r.x+1, r.y+1, iw, ih);
+    return;
+  }
+  // Split across the longer side, the halves sharing the new line.
+  if (r.w >= r.h) {
+    int m = r.x + r.w/2;
+    render_rect(f, m, r.y+1, 1, ih);
+    Tile a = { r.x, r.y, m-r.x+1, r.h };
+    Tile b = { m, r.y, r.x+r.w-m, r.h };
+    sched_spawn(a);
+    sched_spawn(b);
+  } else {
+    int m = r.y + r.h/2;
+    render_rect(f, r.x+1, m, iw, 1);
+    Tile a = { r.x, r.y, r.w, m-r.y+1 };
+    Tile b = { r.x, m, r.w, r.y+r.h-m };
+    sched_spawn(a);
+    sched_spawn(b);
+  }
+}
+
+// 0, SUBDIV_CELL, 2*SUBDIV_CELL... and the last one
+static std::vector<int> grid_lines(int size) {
+  std::vector<int> lines;
+  for (int i = 0; i < size-1; i += SUBDIV_CELL) lines.push_back(i);
+  lines.push_back(size-1);
+  return lines;
+}
+
+void subdiv_render(const RenderParams &params, int width, int height,
+                   int verify, uint32_t *counts, int stride)
+{
+  memset(&stats, 0, sizeof(stats));
+  stats.width = width;
+  stats.height = height;
+  stats.verify = verify;
+  SubdivFrame frame;
+  frame.params = params;
+  frame.counts = counts;
+  frame.stride = stride;
+  frame.verify = verify;
+
+  // The grid first, rows then columns.
+  std::vector<int> xs = grid_lines(width), ys = grid_lines(height);
+  std::vector<Tile> tiles;
+  for (unsigned i = 0; i < ys.size(); i++) {
+    Tile t = { 0, ys[i], width, 1 };
+    tiles.push_back(t);
+  }
+  sched_run(&tiles[0], tiles.size(), row_tile, &frame);
+  tiles.clear();
+  for (unsigned i = 0; i < xs.size(); i++) {
+    Tile t = { xs[i], 0, 1, height };
+    tiles.push_back(t);
+  }
+  sched_run(&tiles[0], tiles.size(), column_tile, &frame);
+
+  // Then the cells between, each sharing its border with its neighbours.
+  tiles.clear();
+  for (unsigned j = 0; j+1 < ys.size(); j++) {
+    for (unsigned i = 0; i+1 < xs.size(); i++) {
+      Tile t = { xs[i], ys[j], xs[i+1]-xs[i]+1, ys[j+1]-ys[j]+1 };
+      tiles.push_back(t);
+    }
+  }
+  if (!tiles.empty()) sched_run(&tiles[0], tiles.size(), rect_tile, &frame);
+}
+
+void subdiv_print_stats(FILE *fp)
+{
+  fprintf(fp, "Subdivide: %.1f%% of pixels iterated, %u rectangles filled, "
+          "%u failed verification (%d points each)\n",
+          100.0 * stats.iterated / ((double)stats.width*stats.height),
+          stats.filled, stats.failed, stats.verify);
+}
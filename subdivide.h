@@ -0,0 +1,22 @@
+// Mariani-Silver subdivision.
+//
+// The set is connected, so if the border of a rectangle all has the
+// same iteration count, so (almost always) does the inside. The frame is
+// cut into cells along a grid of computed rows and columns, and each
+// cell whose border is uniform is filled without iterating any more
+// pixels. The others are split in two across the longer side, computing
+// just the dividing line, until they are small enough to be worth
+// rendering outright. Cells and halves are run as scheduler tasks.
+//
+// A thin feature can sneak inside a uniform border and be missed, so
+// optionally a few random points inside are computed as well before
+// filling, and the rectangle is split if any of them disagree.
+
+// Render a width x height frame of iteration counts (stride is in
+// elements), as cpu_render_counts would, checking verify random points
+// before filling each rectangle.
+void subdiv_render(const RenderParams &params, int width, int height,
+                   int verify, uint32_t *counts, int stride);
+
+// Fraction of pixels iterated, rectangles filled etc. for the last frame.
+void subdiv_print_stats(FILE *fp);
@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+#include "cpurender.h"
+#include "cpukernel.h"
+#include "scheduler.h"
+#include "tilestore.h"
+#include "tilecache.h"
+
+struct CacheKey {
+  int level;         // Pixels 2^-level apart
+  int64_t tx, ty;    // Tile, in CACHE_TILEs from the origin
+  int maxiterations;
+  bool precise;      // Which kernel, float or double-float
+  bool operator==(const CacheKey &k) const {
+    return level == k.level && tx == k.tx && ty == k.ty &&
+      maxiterations == k.maxiterations && precise == k.precise;
+  }
+};
+
+struct CacheKeyHash {
+  size_t operator()(const CacheKey &k) const {
+    uint64_t h = (uint64_t)k.tx * 0x9e3779b97f4a7c15ULL;
+    h ^= (uint64_t)k.ty + 0x632be59bd9b4e019ULL + (h << 6) + (h >> 2);
+    h ^= ((uint64_t)k.level << 32 | (uint32_t)k.maxiterations) +
+      (h << 6) + (h >> 2);
+    return h ^ k.precise;
+  }
+};
+
+struct CacheTile {
+  CacheKey key;
+  int bytesper;              // 2, or 4 for limits over 16 bits
+  std::vector<uint8_t> data; // Counts, row by row
+  const uint16_t *mapped;    // Or in the tile store, if not NULL
+};
+
+typedef std::list<CacheTile> TileList;
+static TileList lru; // Most recently used first
+static std::unordered_map<CacheKey, TileList::iterator, CacheKeyHash> tileindex;
+static size_t budget = 0;
+static CacheStats stats;
+
+// Roughly what the list node and hash entry of a tile take
+#define TILE_OVERHEAD 96
+
+static size_t tile_bytes(const CacheTile &t) {
+  return t.data.size() + TILE_OVERHEAD;
+}
+
+void cache_setup(size_t bytes) {
+  budget = bytes;
+}
+
+bool cache_enabled() {
+  return budget > 0;
+}
+
+// The level whose pixel spacing is nearest the view's
+static int view_level(double xscale, int height) {
+  return (int)floor(-log2(1/(xscale*height/2)) + 0.5);
+}
+
+static int64_t tile_of(int64_t pixel) {
+  return pixel >= 0 ? pixel / CACHE_TILE
+    : -((-pixel + CACHE_TILE-1) / CACHE_TILE);
+}
+
+void cache_snap(double &xcentre, double &ycentre, double &xscale,
+                int width, int height) {
+  double scale = ldexp(1.0, -view_level(xscale, height));
+  xscale = 1/(scale*height/2);
+  double ox = floor((xcentre - scale*width/2)/scale + 0.5);
+  double oy = floor((ycentre - scale*height/2)/scale + 0.5);
+  xcentre = (ox + width/2.0)*scale;
+  ycentre = (oy + height/2.0)*scale;
+}
+
+struct MissingTiles {
+  double scale;
+  std::vector<CacheTile*> tiles;
+};
+
+void cache_render_tile(int level, int64_t tx, int64_t ty, int maxiterations,
+                       uint32_t *counts) {
+  double scale = ldexp(1.0, -level);
+  RenderParams params;
+  origin_params(params, tx*CACHE_TILE*scale, ty*CACHE_TILE*scale, scale,
+                maxiterations);
+  cpu_render_counts(params, 0, 0, CACHE_TILE, CACHE_TILE, counts, CACHE_TILE);
+}
+
+// Render the tile t.x of the list
+static void render_tile(const Tile &t, void *arg) {
+  MissingTiles *m = (MissingTiles*)arg;
+  CacheTile *tile = m->tiles[t.x];
+  uint32_t res[CACHE_TILE*CACHE_TILE];
+  cache_render_tile(tile->key.level, tile->key.tx, tile->key.ty,
+                    tile->key.maxiterations, res);
+  if (tile->bytesper == 2) {
+    uint16_t *d = (uint16_t*)&tile->data[0];
+    for (int i = 0; i < CACHE_TILE*CACHE_TILE; i++) d[i] = res[i];
+  } else {
+    memcpy(&tile->data[0], res, sizeof(res));
+  }
+}
+
+static inline uint32_t tile_count(const CacheTile *t, int i) {
+  if (t->mapped) return t->mapped[i];
+  if (t->bytesper == 2) return ((const uint16_t*)&t->data[0])[i];
+  return ((const uint32_t*)&t->data[0])[i];
+}
+
+void cache_render(double xcentre, double ycentre, double xscale,
+                  int width, int height, int maxiterations,
+                  uint32_t *counts, int stride, uint8_t *fb, int pitch)
+{
+  int level = view_level(xscale, height);
+  double scale = ldexp(1.0, -level);
+  int64_t ox = llround(xcentre/scale - width/2.0);
+  int64_t oy = llround(ycentre/scale - height/2.0);
+  RenderParams params;
+  origin_params(params, 0, 0, scale, maxiterations);
+
+  // Find the tiles the frame overlaps, making room for the missing ones
+  int64_t tx0 = tile_of(ox), tx1 = tile_of(ox + width-1);
+  int64_t ty0 = tile_of(oy), ty1 = tile_of(oy + height-1);
+  std::vector<CacheTile*> frame;
+  MissingTiles missing;
+  missing.scale = scale;
+  stats.framehits = stats.framemisses = stats.framestorehits = 0;
+  for (int64_t ty = ty0; ty <= ty1; ty++) {
+    for (int64_t tx = tx0; tx <= tx1; tx++) {
+      CacheKey key = { level, tx, ty, maxiterations, params.precise };
+      auto it = tileindex.find(key);
+      if (it != tileindex.end()) {
+        lru.splice(lru.begin(), lru, it->second);
+        frame.push_back(&*it->second);
+        stats.framehits++;
+        continue;
+      }
+      lru.push_front(CacheTile());
+      CacheTile &t = lru.front();
+      t.key = key;
+      // Inside points get the limit rounded up to whole unrolled groups
+      uint32_t total = (maxiterations + UNROLL-1) / UNROLL * UNROLL;
+      t.bytesper = total < 65536 ? 2 : 4;
+      t.mapped = store_find(level, tx, ty, maxiterations);
+      if (t.mapped) {
+        stats.framestorehits++;
+      } else {
+        t.data.resize(CACHE_TILE*CACHE_TILE*t.bytesper);
+        missing.tiles.push_back(&t);
+        stats.framemisses++;
+      }
+      tileindex[key] = lru.begin();
+      stats.bytes += tile_bytes(t);
+      frame.push_back(&t);
+    }
+  }
+  std::vector<Tile> work;
+  for (size_t i = 0; i < missing.tiles.size(); i++) {
+    Tile t = { (int)i, 0, 1, 1 };
+    work.push_back(t);
+  }
+  if (!work.empty()) sched_run(&work[0], work.size(), render_tile, &missing);
+
+  // Copy the part of each that is in view
+  uint32_t mask = maxiterations-1;
+  int ntx = tx1 - tx0 + 1;
+  for (size_t i = 0; i < frame.size(); i++) {
+    const CacheTile *t = frame[i];
+    int64_t gx = (tx0 + (int64_t)(i % ntx))*CACHE_TILE;
+    int64_t gy = (ty0 + (int64_t)(i / ntx))*CACHE_TILE;
+    int x0 = std::max<int64_t>(gx, ox) - ox;
+    int x1 = std::min<int64_t>(gx + CACHE_TILE, ox + width) - ox;
+    int y0 = std::max<int64_t>(gy, oy) - oy;
+    int y1 = std::min<int64_t>(gy + CACHE_TILE, oy + height) - oy;
+    for (int y = y0; y < y1; y++) {
+      int row = (int)(y + oy - gy)*CACHE_TILE - (int)(gx - ox);
+      if (counts) {
+        uint32_t *out = counts + y*stride;
+        for (int x = x0; x < x1; x++) out[x] = tile_count(t, row + x);
+      } else {
+        uint8_t *out = fb + y*pitch;
+        for (int x = x0; x < x1; x++) out[x] = tile_count(t, row + x) & mask;
+      }
+    }
+  }
+  stats.hits += stats.framehits;
+  stats.misses += stats.framemisses;
+  stats.storehits += stats.framestorehits;
+
+  while (stats.bytes > budget && !lru.empty()) {
+    stats.bytes -= tile_bytes(lru.back());
+    tileindex.erase(lru.back().key);
+    lru.pop_back();
+    stats.evictions++;
+  }
+  stats.tiles = lru.size();
+}
+
+struct PrebuildBatch {
+  std::vector<CacheKey> keys;
+  std::vector<uint32_t> counts;
+};
+
+static void prebuild_tile(const Tile &t, void *arg) {
+  PrebuildBatch *b = (PrebuildBatch*)arg;
+  const CacheKey &key = b->keys[t.x];
+  cache_render_tile(key.level, key.tx, key.ty, key.maxiterations,
+                    &b->counts[(size_t)t.x*CACHE_TILE*CACHE_TILE]);
+}
+
+int cache_prebuild(const char *path, double xcentre, double ycentre,
+                   double xscale, int width, int height, int maxiterations,
+                   int levels)
+{
+  if (!store_holds(maxiterations)) {
+    fprintf(stderr, "The tile store only holds 16 bit counts\n");
+    return EXIT_FAILURE;
+  }
+  if (!store_create(path, CACHE_TILE)) return EXIT_FAILURE;
+  timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  cache_snap(xcentre, ycentre, xscale, width, height);
+  int top = view_level(xscale, height);
+  double x0 = xcentre - ldexp(1.0, -top)*width/2;
+  double y0 = ycentre - ldexp(1.0, -top)*height/2;
+
+  // Each level has twice the pixels each way of the one before
+  PrebuildBatch batch;
+  for (int l = 0; l < levels; l++) {
+    int level = top + l;
+    double scale = ldexp(1.0, -level);
+    int64_t ox = llround(x0/scale), oy = llround(y0/scale);
+    int64_t tx0 = tile_of(ox), tx1 = tile_of(ox + ((int64_t)width << l) - 1);
+    int64_t ty0 = tile_of(oy), ty1 = tile_of(oy + ((int64_t)height << l) - 1);
+    size_t before = batch.keys.size();
+    for (int64_t ty = ty0; ty <= ty1; ty++) {
+      for (int64_t tx = tx0; tx <= tx1; tx++) {
+        if (store_has(level, tx, ty, maxiterations)) continue;
+        CacheKey key = { level, tx, ty, maxiterations, false };
+        batch.keys.push_back(key);
+      }
+    }
+    fprintf(stderr, "Level %d: %lld tiles, %zu to render\n", level,
+            (long long)((tx1-tx0+1)*(ty1-ty0+1)), batch.keys.size() - before);
+  }
+
+  // A batch at a time for the threads, then into the file
+  std::vector<CacheKey> todo;
+  todo.swap(batch.keys);
+  const size_t BATCH = 1024;
+  std::vector<uint16_t> tile(CACHE_TILE*CACHE_TILE);
+  bool ok = true;
+  for (size_t i = 0; ok && i < todo.size(); i += BATCH) {
+    size_t n = std::min(BATCH, todo.size() - i);
+    batch.keys.assign(todo.begin() + i, todo.begin() + i + n);
+    batch.counts.resize(n*CACHE_TILE*CACHE_TILE);
+    std::vector<Tile> work;
+    for (size_t j = 0; j < n; j++) {
+      Tile t = { (int)j, 0, 1, 1 };
+      work.push_back(t);
+    }
+    sched_run(&work[0], n, prebuild_tile, &batch);
+    for (size_t j = 0; ok && j < n; j++) {
+      const uint32_t *c = &batch.counts[j*CACHE_TILE*CACHE_TILE];
+      for (int k = 0; k < CACHE_TILE*CACHE_TILE; k++) tile[k] = c[k];
+      const CacheKey &key = batch.keys[j];
+      ok = store_add(key.level, key.tx, key.ty, key.maxiterations, &tile[0]);
+    }
+  }
+  if (!store_finish()) ok = false;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "Prebuilt %zu tiles in %.3f s, %.1f tiles/s\n",
+          todo.size(), t, todo.size()/t);
+  return ok ? 0 : EXIT_FAILURE;
+}
+
+void cache_stats(CacheStats &s) {
+  s = stats;
+}
+
+void cache_print_stats(FILE *fp) {
+  uint64_t total = stats.hits + stats.storehits + stats.misses;
+  fprintf(fp, "Tile cache: %llu hits, %llu from the store, %llu misses "
+          "(%.1f%% hits), %llu evicted, %u tiles, %.1f of %.1f Mbytes\n",
+          (unsigned long long)stats.hits, (unsigned long long)stats.storehits,
+          (unsigned long long)stats.misses,
+          total ? 100.0*(total - stats.misses)/total : 0.0,
+          (unsigned long long)stats.evictions, stats.tiles,
+          stats.bytes/1048576.0, budget/1048576.0);
+}
@@ -0,0 +1,54 @@
+// Cache of rendered tiles, so that views seen before come back at once.
+//
+// With the cache on, views are snapped to a quadtree grid: the distance
+// between pixels is a power of 2, so zooming goes a level at a time, and
+// the pixels are at whole multiples of it. The plane at each level is
+// cut into CACHE_TILE x CACHE_TILE tiles, which are kept (keyed by
+// level, tile position, maximum iterations and kernel, float or
+// double-float) as 16 bit counts, or 32 if the limit needs it, up to a
+// memory budget, the least recently used going first. A frame is put
+// together from the tiles it overlaps, only the ones not there being
+// rendered, on the CPU threads. So zooming back out, or scrolling back,
+// costs next to nothing. With a tile store (see tilestore.h) open, the
+// missing tiles are looked for there before they are rendered.
+
+#define CACHE_TILE 32
+
+// Budget in bytes, 0 to turn the cache off.
+void cache_setup(size_t budget);
+bool cache_enabled();
+
+// Snap a view (as given to view_params) to the grid.
+void cache_snap(double &xcentre, double &ycentre, double &xscale,
+                int width, int height);
+
+// Render the (snapped) view, as raw counts (stride in elements) if
+// counts isn't NULL, otherwise as 8-bit values as cpu_render would.
+void cache_render(double xcentre, double ycentre, double xscale,
+                  int width, int height, int maxiterations,
+                  uint32_t *counts, int stride, uint8_t *fb, int pitch);
+
+// Render one tile's counts, CACHE_TILE x CACHE_TILE.
+void cache_render_tile(int level, int64_t tx, int64_t ty, int maxiterations,
+                       uint32_t *counts);
+
+// Fill the tile store at path with the tiles of the (snapped) view and
+// of levels-1 more levels below it, each zoomed in by 2, rendering those
+// it hasn't got on the CPU threads.
+int cache_prebuild(const char *path, double xcentre, double ycentre,
+                   double xscale, int width, int height, int maxiterations,
+                   int levels);
+
+struct CacheStats {
+  uint64_t hits;      // Tiles, since the start
+  uint64_t misses;
+  uint64_t storehits; // Found in the tile store
+  uint64_t evictions;
+  unsigned framehits; // For the last frame
+  unsigned framemisses;
+  unsigned framestorehits;
+  size_t bytes;       // Held now
+  unsigned tiles;
+};
+void cache_stats(CacheStats &stats);
+void cache_print_stats(FILE *fp);
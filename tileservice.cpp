@@ -0,0 +1,640 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include "cpurender.h"
+#include "scheduler.h"
+#include "tileservice.h"
+
+// Beyond this the double-float kernels run out of bits
+#define MAXZOOM 36
+#define MAXSIZE 1024
+#define MAXLINE 256
+// Latencies kept for the percentiles, a random sample of them beyond that
+#define MAXLATENCIES 10000
+// Stop taking requests from a client with this much of its answers
+// unread or still to come in the batch
+#define MAXOUT (4 << 20)
+
+struct TileKey {
+  int zoom;
+  int64_t x, y;
+  int maxiterations;
+  int size;
+  bool operator<(const TileKey &k) const {
+    if (zoom != k.zoom) return zoom < k.zoom;
+    if (x != k.x) return x < k.x;
+    if (y != k.y) return y < k.y;
+    if (maxiterations != k.maxiterations) return maxiterations < k.maxiterations;
+    return size < k.size;
+  }
+};
+
+struct ServiceRequest {
+  unsigned client;  // Client id, as the fd may have been reused
+  TileKey key;
+  bool raw;
+  uint64_t arrived; // usecs
+  unsigned queued;  // Requests ahead of it in the batch
+  const char *error;// Answered with this instead, in its turn, if set
+};
+
+struct Client {
+  int fd;
+  unsigned id;
+  std::string buf;  // Lines not taken yet
+  std::string out;  // Answers not written yet
+  size_t owed;      // Bytes of answers to its requests in the batch
+  bool closing;     // Close once buf is taken and out written
+};
+
+struct BatchTile {
+  RenderParams params;
+  int size;
+  std::vector<uint32_t> counts;
+};
+
+static struct {
+  uint64_t requests;
+  uint64_t coalesced; // Answered with a tile rendered for another
+  uint64_t errors;
+  uint64_t batches;
+  uint64_t tiles;
+  unsigned maxbatch;
+  unsigned maxqueued;
+  uint64_t answered;
+  uint32_t maxlatency;
+  unsigned seed;
+  std::vector<uint32_t> latencies; // usecs, at most MAXLATENCIES
+} stats;
+
+// Reservoir sampling, so the percentiles don't need every latency; a
+// new maximum always goes in, so that's exact
+static void keep_latency(uint32_t usecs) {
+  stats.answered++;
+  if (stats.latencies.size() < MAXLATENCIES) {
+    stats.latencies.push_back(usecs);
+  } else if (usecs > stats.maxlatency) {
+    stats.latencies[rand_r(&stats.seed) % MAXLATENCIES] = usecs;
+  } else {
+    uint64_t i = (((uint64_t)rand_r(&stats.seed) << 31) | rand_r(&stats.seed))
+      % stats.answered;
+    if (i < MAXLATENCIES) stats.latencies[i] = usecs;
+  }
+  stats.maxlatency = std::max(stats.maxlatency, usecs);
+}
+
+static uint64_t now_usecs() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static bool send_all(int fd, const void *data, size_t n) {
+  const uint8_t *p = (const uint8_t*)data;
+  while (n > 0) {
+    ssize_t r = send(fd, p, n, MSG_NOSIGNAL);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return false;
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+static bool recv_all(int fd, void *data, size_t n) {
+  uint8_t *p = (uint8_t*)data;
+  while (n > 0) {
+    ssize_t r = recv(fd, p, n, 0);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return false;
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+// A byte at a time, as it is only the header line
+static bool recv_line(int fd, char *line, size_t n) {
+  size_t i = 0;
+  while (i < n-1) {
+    if (!recv_all(fd, line + i, 1)) return false;
+    if (line[i] == '\n') break;
+    i++;
+  }
+  line[i] = 0;
+  return true;
+}
+
+// The service's sockets don't block, so answers go in the client's out
+// buffer and are written as far as the socket takes them
+static void queue_text(Client &client, const char *status,
+                       const std::string &text) {
+  char header[64];
+  snprintf(header, sizeof(header), "%s text %zu\n", status, text.size());
+  client.out += header;
+  client.out += text;
+}
+
+// Returns false if the client has gone
+static bool flush_out(Client &client) {
+  size_t done = 0;
+  while (done < client.out.size()) {
+    ssize_t r = send(client.fd, client.out.data() + done,
+                     client.out.size() - done, MSG_NOSIGNAL);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (r <= 0) return false;
+    done += r;
+  }
+  client.out.erase(0, done);
+  return true;
+}
+
+static Client *find_client(std::vector<Client> &clients, unsigned id) {
+  for (size_t i = 0; i < clients.size(); i++) {
+    if (clients[i].id == id && clients[i].fd >= 0) return &clients[i];
+  }
+  return NULL;
+}
+
+static void percentiles(std::vector<uint32_t> v, char *buf, size_t n) {
+  if (v.empty()) {
+    snprintf(buf, n, "none");
+    return;
+  }
+  std::sort(v.begin(), v.end());
+  size_t k = v.size();
+  snprintf(buf, n, "p50 %.3f p90 %.3f p99 %.3f max %.3f ms",
+           v[k*50/100] / 1e3, v[k*90/100] / 1e3, v[k*99/100] / 1e3,
+           v[k-1] / 1e3);
+}
+
+static std::string stats_text() {
+  char lat[128], buf[512];
+  percentiles(stats.latencies, lat, sizeof(lat));
+  snprintf(buf, sizeof(buf),
+           "Tile service: %llu requests, %llu errors, %llu coalesced, "
+           "%llu tiles in %llu batches (%.2f requests, max %u, a batch)\n"
+           "  latency %s, max %u queued\n",
+           (unsigned long long)stats.requests,
+           (unsigned long long)stats.errors,
+           (unsigned long long)stats.coalesced,
+           (unsigned long long)stats.tiles,
+           (unsigned long long)stats.batches,
+           stats.batches ? (double)(stats.requests - stats.errors) /
+           stats.batches : 0.0, stats.maxbatch, lat, stats.maxqueued);
+  return buf;
+}
+
+// Queue an answer with an error, so that it goes out after the
+// answers to the client's requests before it
+static void queue_error(Client &client, const char *error,
+                        std::vector<ServiceRequest> &pending) {
+  ServiceRequest req;
+  memset(&req.key, 0, sizeof(req.key));
+  req.client = client.id;
+  req.raw = false;
+  req.arrived = now_usecs();
+  req.queued = pending.size();
+  req.error = error;
+  stats.errors++;
+  client.owed += 32 + strlen(error);
+  pending.push_back(req);
+}
+
+// Check and queue one request line, answering stats straight away
+static void take_line(Client &client, const char *line,
+                      std::vector<ServiceRequest> &pending) {
+  if (strcmp(line, "stats") == 0) {
+    queue_text(client, "OK", stats_text());
+    return;
+  }
+  stats.requests++;
+  ServiceRequest req;
+  long long x, y;
+  char format[8] = "pgm";
+  int n = sscanf(line, "%d %lld %lld %d %d %7s", &req.key.zoom, &x, &y,
+                 &req.key.maxiterations, &req.key.size, format);
+  const char *error = NULL;
+  if (n < 5) {
+    error = "expected: zoom x y maxiterations size [pgm|raw]";
+  } else if (req.key.zoom < 0 || req.key.zoom > MAXZOOM) {
+    error = "zoom out of range";
+  } else if (x < 0 || y < 0 || x >> req.key.zoom || y >> req.key.zoom) {
+    error = "no such tile";
+  } else if (req.key.maxiterations < 1 ||
+             req.key.maxiterations > (1 << 24)) {
+    error = "maxiterations out of range";
+  } else if (req.key.size < 1 || req.key.size > MAXSIZE) {
+    error = "size out of range";
+  } else if (strcmp(format, "pgm") != 0 && strcmp(format, "raw") != 0) {
+    error = "format is pgm or raw";
+  }
+  if (error) {
+    queue_error(client, error, pending);
+    return;
+  }
+  req.key.x = x;
+  req.key.y = y;
+  req.client = client.id;
+  req.raw = strcmp(format, "raw") == 0;
+  req.arrived = now_usecs();
+  req.queued = pending.size();
+  req.error = NULL;
+  stats.maxqueued = std::max(stats.maxqueued, req.queued);
+  size_t npixels = (size_t)req.key.size*req.key.size;
+  client.owed += 64 + (req.raw ? npixels*sizeof(uint32_t) : npixels);
+  pending.push_back(req);
+}
+
+static bool has_line(const Client &client) {
+  return client.buf.find('\n') != std::string::npos;
+}
+
+// Take the client's complete lines, up to MAXOUT of answers; the rest
+// wait in buf for a later batch
+static void take_lines(Client &client, std::vector<ServiceRequest> &pending) {
+  size_t eol;
+  while (client.out.size() + client.owed < MAXOUT &&
+         (eol = client.buf.find('\n')) != std::string::npos) {
+    std::string line = client.buf.substr(0, eol);
+    client.buf.erase(0, eol+1);
+    if (!line.empty() && line[line.size()-1] == '\r') {
+      line.erase(line.size()-1);
+    }
+    take_line(client, line.c_str(), pending);
+  }
+}
+
+// The strips are tile.x of the batch, rows y to y+h
+static void render_strip(const Tile &t, void *arg) {
+  BatchTile &tile = (*(std::vector<BatchTile>*)arg)[t.x];
+  cpu_render_counts(tile.params, 0, t.y, t.w, t.h, &tile.counts[0],
+                    tile.size);
+}
+
+static void run_batch(std::vector<ServiceRequest> &pending,
+                      std::vector<Client> &clients, int tilesize,
+                      FILE *csv) {
+  std::map<TileKey, int> distinct;
+  std::vector<int> which(pending.size());
+  std::vector<BatchTile> tiles;
+  unsigned requests = 0;
+  for (size_t i = 0; i < pending.size(); i++) {
+    if (pending[i].error) continue;
+    requests++;
+    const TileKey &key = pending[i].key;
+    auto it = distinct.find(key);
+    if (it != distinct.end()) {
+      which[i] = it->second;
+      stats.coalesced++;
+      continue;
+    }
+    which[i] = distinct[key] = tiles.size();
+    tiles.push_back(BatchTile());
+    BatchTile &tile = tiles.back();
+    double span = ldexp(4.0, -key.zoom);
+    origin_params(tile.params, -2 + key.x*span, -2 + key.y*span,
+                  span/key.size, key.maxiterations);
+    tile.size = key.size;
+    tile.counts.resize((size_t)key.size*key.size);
+  }
+  std::vector<Tile> strips;
+  for (size_t i = 0; i < tiles.size(); i++) {
+    for (int y = 0; y < tiles[i].size; y += tilesize) {
+      Tile t = { (int)i, y, tiles[i].size,
+                 std::min(tilesize, tiles[i].size - y) };
+      strips.push_back(t);
+    }
+  }
+  if (!tiles.empty()) {
+    sched_run(&strips[0], strips.size(), render_strip, &tiles);
+    stats.batches++;
+    stats.tiles += tiles.size();
+    stats.maxbatch = std::max(stats.maxbatch, requests);
+  }
+
+  // The answers in the order the requests came in
+  for (size_t i = 0; i < pending.size(); i++) {
+    const ServiceRequest &req = pending[i];
+    Client *client = find_client(clients, req.client);
+    if (req.error) {
+      if (client) queue_text(*client, "ERR", req.error);
+      continue;
+    }
+    const BatchTile &tile = tiles[which[i]];
+    size_t npixels = tile.counts.size();
+    char header[64];
+    if (!client) {
+      // Gone, but it still counts
+    } else if (req.raw) {
+      snprintf(header, sizeof(header), "OK raw %zu\n",
+               npixels*sizeof(uint32_t));
+      client->out += header;
+      client->out.append((const char*)&tile.counts[0],
+                         npixels*sizeof(uint32_t));
+    } else {
+      char pgm[32];
+      snprintf(pgm, sizeof(pgm), "P5\n%d %d\n255\n", tile.size, tile.size);
+      snprintf(header, sizeof(header), "OK pgm %zu\n", strlen(pgm) + npixels);
+      client->out += header;
+      client->out += pgm;
+      uint32_t mask = req.key.maxiterations-1;
+      for (size_t j = 0; j < npixels; j++) {
+        client->out.push_back(tile.counts[j] & mask);
+      }
+    }
+    uint32_t usecs = now_usecs() - req.arrived;
+    keep_latency(usecs);
+    if (csv) {
+      fprintf(csv, "%d,%lld,%lld,%d,%d,%s,%u,%zu,%zu,%u\n", req.key.zoom,
+              (long long)req.key.x, (long long)req.key.y,
+              req.key.maxiterations, req.key.size, req.raw ? "raw" : "pgm",
+              req.queued, pending.size(), tiles.size(), usecs);
+    }
+  }
+  pending.clear();
+  for (size_t c = 0; c < clients.size(); c++) clients[c].owed = 0;
+}
+
+int service_main(const ServiceOptions &options)
+{
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(options.socket) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", options.socket);
+    return EXIT_FAILURE;
+  }
+  strcpy(addr.sun_path, options.socket);
+  int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (lfd < 0) {
+    fprintf(stderr, "socket failed: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  unlink(options.socket); // Left over from the last time
+  if (bind(lfd, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(lfd, 64) != 0) {
+    fprintf(stderr, "Can't listen on %s: %s\n", options.socket,
+            strerror(errno));
+    close(lfd);
+    return EXIT_FAILURE;
+  }
+  FILE *csv = NULL;
+  if (options.statsfile) {
+    csv = fopen(options.statsfile, "w");
+    if (!csv) {
+      fprintf(stderr, "Can't open %s for writing\n", options.statsfile);
+      close(lfd);
+      unlink(options.socket);
+      return EXIT_FAILURE;
+    }
+    fprintf(csv, "zoom,x,y,maxiterations,size,format,queued,batch,"
+            "tiles,usecs\n");
+  }
+  fprintf(stderr, "Serving tiles on %s, %s CPU kernel, %d threads\n",
+          options.socket, cpu_kernel_name(), sched_threads());
+
+  std::vector<Client> clients;
+  std::vector<ServiceRequest> pending;
+  std::vector<pollfd> fds;
+  unsigned nextid = 0;
+  while (!*options.stop) {
+    fds.clear();
+    pollfd p = { lfd, POLLIN, 0 };
+    fds.push_back(p);
+    bool waiting = false; // Lines left from the last batch can be taken
+    for (size_t i = 0; i < clients.size(); i++) {
+      // A client that isn't reading its answers is left to wait until
+      // it does, rather than sending more, and one with lines left over
+      // isn't read from until they have been taken
+      Client &client = clients[i];
+      bool room = client.out.size() < MAXOUT;
+      p.fd = client.fd;
+      p.events = 0;
+      if (!client.closing && room && !has_line(client)) p.events |= POLLIN;
+      if (!client.out.empty()) p.events |= POLLOUT;
+      if (room && has_line(client)) waiting = true;
+      fds.push_back(p);
+    }
+    if (poll(&fds[0], fds.size(), waiting ? 0 : -1) < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "poll failed: %s\n", strerror(errno));
+      break;
+    }
+    // Everything that has come in makes the batch
+    for (size_t i = 0; i < clients.size(); i++) {
+      Client &client = clients[i];
+      if (!(fds[i+1].events & POLLIN) ||
+          !(fds[i+1].revents & (POLLIN | POLLHUP | POLLERR))) {
+        take_lines(client, pending);
+        continue;
+      }
+      char buf[4096];
+      ssize_t n = recv(client.fd, buf, sizeof(buf), 0);
+      if (n < 0 && (errno == EINTR || errno == EAGAIN ||
+                    errno == EWOULDBLOCK)) continue;
+      if (n < 0) {
+        close(client.fd);
+        client.fd = -1;
+        continue;
+      }
+      if (n == 0) {
+        // Finished asking, but still wants the answers
+        client.closing = true;
+        continue;
+      }
+      client.buf.append(buf, n);
+      take_lines(client, pending);
+      if (!has_line(client) && client.buf.size() > MAXLINE) {
+        queue_error(client, "line too long", pending);
+        client.buf.clear();
+        client.closing = true;
+      }
+    }
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(lfd, NULL, NULL);
+      if (fd >= 0 && fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+        close(fd);
+        fd = -1;
+      }
+      if (fd >= 0) {
+        Client client;
+        client.fd = fd;
+        client.id = nextid++;
+        client.owed = 0;
+        client.closing = false;
+        clients.push_back(client);
+      }
+    }
+    if (!pending.empty()) run_batch(pending, clients, options.tilesize, csv);
+    // Write what the sockets will take now, and the rest on POLLOUT
+    for (size_t i = clients.size(); i-- > 0; ) {
+      Client &client = clients[i];
+      if (client.fd >= 0 && !client.out.empty() && !flush_out(client)) {
+        close(client.fd);
+        client.fd = -1;
+      }
+      if (client.closing && client.fd >= 0 && client.out.empty() &&
+          !has_line(client)) {
+        close(client.fd);
+        client.fd = -1;
+      }
+      if (client.fd < 0) clients.erase(clients.begin() + i);
+    }
+  }
+
+  for (size_t i = 0; i < clients.size(); i++) close(clients[i].fd);
+  close(lfd);
+  unlink(options.socket);
+  fputs(stats_text().c_str(), stderr);
+  if (csv && fclose(csv) != 0) {
+    fprintf(stderr, "Error writing %s\n", options.statsfile);
+    return EXIT_FAILURE;
+  }
+  return 0;
+}
+
+static int connect_to(const char *path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+struct LoadThread {
+  const LoadOptions *options;
+  int index;
+  pthread_t thread;
+  std::vector<uint32_t> latencies;
+  uint64_t bytes;
+  int errors;
+};
+
+static void *load_thread(void *arg) {
+  LoadThread *lt = (LoadThread*)arg;
+  const LoadOptions &options = *lt->options;
+  int fd = connect_to(options.socket);
+  if (fd < 0) {
+    fprintf(stderr, "Can't connect to %s: %s\n", options.socket,
+            strerror(errno));
+    lt->errors = options.requests;
+    return NULL;
+  }
+  unsigned seed = lt->index*7919 + 1;
+  std::vector<uint8_t> data;
+  for (int r = 0; r < options.requests; r++) {
+    int zoom;
+    long long x, y;
+    if (rand_r(&seed) & 1) {
+      // The hot set, 16 tiles on the edge of the set at zoom 3
+      int h = rand_r(&seed);
+      zoom = 3;
+      x = 1 + h % 4;
+      y = 2 + (h / 4) % 4;
+    } else {
+      // Anywhere near the set, from the whole of it to small details
+      zoom = 2 + rand_r(&seed) % 7;
+      double px = -2 + 2.5*rand_r(&seed)/RAND_MAX;
+      double py = -1.25 + 2.5*rand_r(&seed)/RAND_MAX;
+      double span = ldexp(4.0, -zoom);
+      x = (long long)((px + 2)/span);
+      y = (long long)((py + 2)/span);
+    }
+    char line[MAXLINE];
+    snprintf(line, sizeof(line), "%d %lld %lld %d %d %s\n", zoom, x, y,
+             options.maxiterations, options.size, options.raw ? "raw" : "pgm");
+    uint64_t start = now_usecs();
+    char format[8];
+    size_t n;
+    if (!send_all(fd, line, strlen(line)) ||
+        !recv_line(fd, line, sizeof(line))) {
+      fprintf(stderr, "Connection to %s lost\n", options.socket);
+      lt->errors += options.requests - r;
+      break;
+    }
+    if (sscanf(line, "OK %7s %zu", format, &n) != 2) {
+      fprintf(stderr, "Request failed: %s\n", line);
+      lt->errors++;
+      if (strncmp(line, "ERR text ", 9) != 0) break;
+      n = strtoul(line + 9, NULL, 10);
+    }
+    data.resize(n);
+    if (n > 0 && !recv_all(fd, &data[0], n)) {
+      lt->errors += options.requests - r;
+      break;
+    }
+    lt->latencies.push_back(now_usecs() - start);
+    lt->bytes += n;
+  }
+  close(fd);
+  return NULL;
+}
+
+int service_load(const LoadOptions &options)
+{
+  std::vector<LoadThread> threads(options.connections);
+  uint64_t start = now_usecs();
+  for (int i = 0; i < options.connections; i++) {
+    threads[i].options = &options;
+    threads[i].index = i;
+    threads[i].bytes = 0;
+    threads[i].errors = 0;
+    pthread_create(&threads[i].thread, NULL, load_thread, &threads[i]);
+  }
+  std::vector<uint32_t> latencies;
+  uint64_t bytes = 0;
+  int errors = 0;
+  for (int i = 0; i < options.connections; i++) {
+    pthread_join(threads[i].thread, NULL);
+    latencies.insert(latencies.end(), threads[i].latencies.begin(),
+                     threads[i].latencies.end());
+    bytes += threads[i].bytes;
+    errors += threads[i].errors;
+  }
+  double secs = (now_usecs() - start) / 1e6;
+  char lat[128];
+  percentiles(latencies, lat, sizeof(lat));
+  size_t done = latencies.size();
+  fprintf(stderr, "Load: %d connections, %zu requests, %d errors, %.3f s\n"
+          "  %.1f requests/s, %.2f Mpixels/s, %.2f Mbytes/s\n"
+          "  latency %s\n",
+          options.connections, done, errors, secs, done/secs,
+          (double)done*options.size*options.size/secs/1e6,
+          bytes/secs/1048576.0, lat);
+
+  // And what the service made of it
+  int fd = connect_to(options.socket);
+  char line[MAXLINE];
+  size_t n;
+  if (fd >= 0 && send_all(fd, "stats\n", 6) &&
+      recv_line(fd, line, sizeof(line)) &&
+      sscanf(line, "OK text %zu", &n) == 1) {
+    std::string text(n, 0);
+    if (recv_all(fd, &text[0], n)) fputs(text.c_str(), stderr);
+  }
+  if (fd >= 0) close(fd);
+  return errors ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,48 @@
+// Tile rendering service on a Unix domain socket, and a load generator
+// for it.
+//
+// Tiles are addressed as in a slippy map: at zoom z the square from
+// (-2,-2) to (2,2) is cut into 2^z x 2^z tiles, x going right and y
+// down, each rendered size x size pixels. A request is a line
+//   zoom x y maxiterations size [pgm|raw]
+// answered with a line "OK pgm|raw <bytes>" and then the tile, as a
+// PGM (the 8-bit values the QPUs would put in the framebuffer) or raw
+// 32-bit counts, or with "ERR text <bytes>" and then the reason.
+// Answers come in the order of the requests, except that "stats" gets
+// "OK text <bytes>" and the figures so far at once rather than after
+// any tiles the client has still queued.
+//
+// One thread takes the requests from all the clients, so those that
+// come in while a batch is being rendered queue up in the sockets and
+// are taken together as the next batch: the same tile asked for more
+// than once in it is rendered once, and the distinct tiles are cut into
+// strips and rendered in one scheduler run, so a batch of small tiles
+// keeps all the threads busy. The sockets don't block: answers wait in
+// a buffer for each client until its socket takes them, and a client
+// with a lot waiting isn't read from until it catches up, so one that
+// stops reading doesn't hold the others up. Each request's latency,
+// from its line being read to its answer being ready to write, and how
+// many were queued ahead of it are kept for the stats.
+
+struct ServiceOptions {
+  const char *socket;   // Path to listen on, or connect to
+  int tilesize;         // Scheduler strips, in rows
+  const char *statsfile;// CSV of every request, or NULL
+  volatile bool *stop;  // Set by the signal handler
+};
+
+int service_main(const ServiceOptions &options);
+
+// Run connections clients at once, each asking for requests tiles of
+// size x size one after the other, at random but half of them from a
+// small set every client asks for, and print the throughput and latency.
+struct LoadOptions {
+  const char *socket;
+  int connections;
+  int requests;         // Per connection
+  int size;
+  int maxiterations;
+  bool raw;
+};
+
+int service_load(const LoadOptions &options);
@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include "cpukernel.h"
+#include "tilestore.h"
+
+#define STORE_MAGIC "MANDTILE"
+#define STORE_VERSION 1
+// Tiles start a page in, after the header
+#define STORE_DATA 4096
+
+struct StoreHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t tilesize;
+  uint64_t count;       // Tiles
+  uint64_t capacity;    // Index slots, a power of 2
+  uint64_t indexoffset; // capacity StoreEntrys
+};
+
+struct StoreEntry {
+  int64_t tx, ty;
+  uint64_t offset;      // Of the tile, 0 for an empty slot
+  int32_t level;
+  uint32_t maxiterations;
+};
+
+static uint64_t key_hash(int level, int64_t tx, int64_t ty,
+                         int maxiterations) {
+  uint64_t h = (uint64_t)tx * 0x9e3779b97f4a7c15ULL;
+  h ^= (uint64_t)ty + 0x632be59bd9b4e019ULL + (h << 6) + (h >> 2);
+  h ^= ((uint64_t)level << 32 | (uint32_t)maxiterations) +
+    (h << 6) + (h >> 2);
+  return h ^ (h >> 29);
+}
+
+// The slot with the key, or the empty one where it would go, or
+// capacity if the index is full without it (only if the file's damaged)
+static uint64_t probe(const StoreEntry *index, uint64_t capacity, int level,
+                      int64_t tx, int64_t ty, int maxiterations) {
+  uint64_t i = key_hash(level, tx, ty, maxiterations) & (capacity-1);
+  for (uint64_t n = 0; n < capacity; n++) {
+    if (index[i].offset == 0 ||
+        (index[i].level == level && index[i].tx == tx &&
+         index[i].ty == ty &&
+         index[i].maxiterations == (uint32_t)maxiterations)) return i;
+    i = (i + 1) & (capacity-1);
+  }
+  return capacity;
+}
+
+// The mapping, for reading
+static const uint8_t *map = NULL;
+static size_t mapsize = 0;
+static const StoreHeader *header = NULL;
+static const StoreEntry *mapindex = NULL;
+static size_t tilebytes = 0;
+
+bool store_open(const char *path, int tilesize) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(StoreHeader)) {
+    fprintf(stderr, "%s is not a tile store\n", path);
+    close(fd);
+    return false;
+  }
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "Can't map %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  const StoreHeader *h = (const StoreHeader*)p;
+  const char *error = NULL;
+  if (memcmp(h->magic, STORE_MAGIC, 8) != 0) {
+    error = "not a tile store";
+  } else if (h->version != STORE_VERSION) {
+    error = "a different version of tile store";
+  } else if (h->tilesize != (uint32_t)tilesize) {
+    error = "the wrong size of tiles";
+  } else if (h->capacity == 0 || (h->capacity & (h->capacity-1)) ||
+             h->indexoffset > (uint64_t)st.st_size ||
+             h->capacity > (st.st_size - h->indexoffset)/sizeof(StoreEntry)) {
+    error = "damaged";
+  }
+  if (error) {
+    fprintf(stderr, "%s is %s\n", path, error);
+    munmap(p, st.st_size);
+    return false;
+  }
+  map = (const uint8_t*)p;
+  mapsize = st.st_size;
+  header = h;
+  mapindex = (const StoreEntry*)(map + h->indexoffset);
+  tilebytes = (size_t)tilesize*tilesize*sizeof(uint16_t);
+  fprintf(stderr, "Tile store %s: %llu tiles, %.1f Mbytes\n", path,
+          (unsigned long long)h->count, mapsize/1048576.0);
+  return true;
+}
+
+void store_close() {
+  if (map) munmap((void*)map, mapsize);
+  map = NULL;
+  header = NULL;
+  mapindex = NULL;
+}
+
+bool store_enabled() {
+  return map != NULL;
+}
+
+bool store_holds(int maxiterations) {
+  return maxiterations > 0 &&
+    (uint32_t)(maxiterations + UNROLL-1) / UNROLL * UNROLL <= 65535;
+}
+
+const uint16_t *store_find(int level, int64_t tx, int64_t ty,
+                           int maxiterations) {
+  if (!map || !store_holds(maxiterations)) return NULL;
+  uint64_t i = probe(mapindex, header->capacity, level, tx, ty,
+                     maxiterations);
+  if (i == header->capacity) return NULL;
+  const StoreEntry &e = mapindex[i];
+  if (e.offset == 0 || e.offset + tilebytes > mapsize) return NULL;
+  return (const uint16_t*)(map + e.offset);
+}
+
+// The store being added to
+static int wfd = -1;
+static const char *wpath = NULL;
+static StoreHeader wheader;
+static std::vector<StoreEntry> windex;
+static uint64_t wend;   // Where the next tile goes
+static size_t wtilebytes;
+
+static bool write_at(const void *data, size_t n, uint64_t offset) {
+  const uint8_t *p = (const uint8_t*)data;
+  while (n > 0) {
+    ssize_t r = pwrite(wfd, p, n, offset);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) {
+      fprintf(stderr, "Error writing %s: %s\n", wpath, strerror(errno));
+      return false;
+    }
+    p += r;
+    n -= r;
+    offset += r;
+  }
+  return true;
+}
+
+// The index is kept at most half full, so there's always a slot
+static void add_entry(std::vector<StoreEntry> &index, const StoreEntry &e) {
+  index[probe(&index[0], index.size(), e.level, e.tx, e.ty,
+              e.maxiterations)] = e;
+}
+
+bool store_create(const char *path, int tilesize) {
+  wfd = open(path, O_RDWR | O_CREAT, 0644);
+  if (wfd < 0) {
+    fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  wpath = path;
+  wtilebytes = (size_t)tilesize*tilesize*sizeof(uint16_t);
+  struct stat st;
+  if (fstat(wfd, &st) != 0) {
+    fprintf(stderr, "Can't read %s: %s\n", path, strerror(errno));
+    close(wfd);
+    wfd = -1;
+    return false;
+  }
+  if (st.st_size == 0) {
+    memset(&wheader, 0, sizeof(wheader));
+    memcpy(wheader.magic, STORE_MAGIC, 8);
+    wheader.version = STORE_VERSION;
+    wheader.tilesize = tilesize;
+    wheader.capacity = 1024;
+    windex.assign(wheader.capacity, StoreEntry());
+    wend = STORE_DATA;
+    return true;
+  }
+  // Carry on from the tiles already there, the new ones going after
+  // the old index
+  bool ok = pread(wfd, &wheader, sizeof(wheader), 0) == sizeof(wheader) &&
+    memcmp(wheader.magic, STORE_MAGIC, 8) == 0 &&
+    wheader.version == STORE_VERSION &&
+    wheader.tilesize == (uint32_t)tilesize && wheader.capacity > 0 &&
+    (wheader.capacity & (wheader.capacity-1)) == 0 &&
+    wheader.indexoffset <= (uint64_t)st.st_size &&
+    wheader.capacity <= (st.st_size - wheader.indexoffset)/sizeof(StoreEntry);
+  if (ok) {
+    windex.resize(wheader.capacity);
+    size_t n = wheader.capacity*sizeof(StoreEntry);
+    ok = pread(wfd, &windex[0], n, wheader.indexoffset) == (ssize_t)n;
+  }
+  if (ok) {
+    // Counted again rather than trusted, so the index is grown in time
+    wheader.count = 0;
+    for (size_t i = 0; i < windex.size(); i++) {
+      if (windex[i].offset != 0) wheader.count++;
+    }
+  }
+  if (!ok) {
+    fprintf(stderr, "%s is not a tile store of %dx%d tiles\n", path,
+            tilesize, tilesize);
+    close(wfd);
+    wfd = -1;
+    return false;
+  }
+  wend = st.st_size;
+  return true;
+}
+
+bool store_has(int level, int64_t tx, int64_t ty, int maxiterations) {
+  uint64_t i = probe(&windex[0], windex.size(), level, tx, ty, maxiterations);
+  return i < windex.size() && windex[i].offset != 0;
+}
+
+bool store_add(int level, int64_t tx, int64_t ty, int maxiterations,
+               const uint16_t *tile) {
+  if (!store_holds(maxiterations)) {
+    fprintf(stderr, "The tile store only holds 16 bit counts\n");
+    return false;
+  }
+  if (!write_at(tile, wtilebytes, wend)) return false;
+  // Kept at most half full
+  if (2*(wheader.count+1) > windex.size()) {
+    std::vector<StoreEntry> bigger(2*windex.size());
+    for (size_t i = 0; i < windex.size(); i++) {
+      if (windex[i].offset != 0) add_entry(bigger, windex[i]);
+    }
+    windex.swap(bigger);
+  }
+  StoreEntry e = { tx, ty, wend, level, (uint32_t)maxiterations };
+  add_entry(windex, e);
+  wheader.count++;
+  wend += wtilebytes;
+  return true;
+}
+
+bool store_finish() {
+  wheader.capacity = windex.size();
+  wheader.indexoffset = wend;
+  bool ok = write_at(&windex[0], windex.size()*sizeof(StoreEntry), wend) &&
+    fsync(wfd) == 0 && write_at(&wheader, sizeof(wheader), 0);
+  if (close(wfd) != 0) ok = false;
+  wfd = -1;
+  windex.clear();
+  return ok;
+}
@@ -0,0 +1,37 @@
+// Tile store: rendered tiles kept in a file, so popular regions are
+// rendered once rather than in every session.
+//
+// The file is a fixed header, the tiles themselves, each tilesize x
+// tilesize 16-bit counts, and an index of (level, x, y, maxiterations)
+// to where the tile is, an open addressed hash table. It is read with
+// mmap, so finding a tile is a probe or two of the index and the tile
+// is used where it lies in the mapping, no copy. Tiles are raw rather
+// than compressed for the same reason. Numbers are in the machine's
+// byte order.
+//
+// Adding tiles appends them to the end of the file, then a new index
+// after them, and only then points the header at it, so the file is
+// good at every point and a reader sees either the old tiles or the
+// new ones.
+
+// Map the store, of tilesize x tilesize tiles, for reading. false
+// (with a message) if it can't be.
+bool store_open(const char *path, int tilesize);
+void store_close();
+bool store_enabled();
+
+// Whether the store can hold tiles of this limit: points inside the set
+// count it rounded up to whole unrolled groups, which has to fit 16 bits.
+bool store_holds(int maxiterations);
+
+// The tile, in the mapping, or NULL if it isn't in the store.
+const uint16_t *store_find(int level, int64_t tx, int64_t ty,
+                           int maxiterations);
+
+// Open (or create) the store for adding tilesize x tilesize tiles.
+bool store_create(const char *path, int tilesize);
+bool store_has(int level, int64_t tx, int64_t ty, int maxiterations);
+bool store_add(int level, int64_t tx, int64_t ty, int maxiterations,
+               const uint16_t *tile);
+// Write the index and header, and close it.
+bool store_finish();
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+
+#include "trace.h"
+
+struct TraceEvent {
+  uint64_t start; // ns
+  uint32_t duration;
+  uint16_t phase;
+  uint16_t thread;
+  uint32_t frame;
+};
+
+static const char *phasenames[TRACE_NPHASES] = {
+  "frame", "input", "setscale", "execute", "dispatch", "colourise",
+  "flip", "vsync"
+};
+
+static TraceEvent *events = NULL;
+static unsigned capacity = 0;
+static unsigned next = 0;  // Total recorded, taken atomically
+static uint64_t origin = 0;
+
+// Small numbers for the threads, in the order they first record
+static __thread int threadid = -1;
+static int nthreads = 0;
+
+uint64_t trace_now() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+void trace_start(unsigned n) {
+  events = (TraceEvent*)calloc(n, sizeof(TraceEvent));
+  if (!events) {
+    fprintf(stderr, "Can't allocate %u trace events\n", n);
+    return;
+  }
+  capacity = n;
+  origin = trace_now();
+}
+
+bool trace_enabled() {
+  return events != NULL;
+}
+
+void trace_end(TracePhase phase, uint64_t start, unsigned frame) {
+  if (!events) return;
+  uint64_t end = trace_now();
+  if (threadid < 0) {
+    threadid = __atomic_fetch_add(&nthreads, 1, __ATOMIC_RELAXED);
+  }
+  unsigned i = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+  TraceEvent &e = events[i % capacity];
+  e.start = start;
+  e.duration = std::min(end - start, (uint64_t)UINT32_MAX);
+  e.phase = phase;
+  e.thread = threadid;
+  e.frame = frame;
+}
+
+// The events still in the ring, oldest first
+static unsigned first_event() {
+  return next > capacity ? next - capacity : 0;
+}
+
+bool trace_write(const char *filename) {
+  if (!events) return true;
+  FILE *f = fopen(filename, "w");
+  if (!f) {
+    perror(filename);
+    return false;
+  }
+  fprintf(f, "{\"traceEvents\":[\n");
+  for (unsigned i = first_event(); i < next; i++) {
+    const TraceEvent &e = events[i % capacity];
+    // Microseconds, but keep the ns
+    fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+            "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u}}",
+            i == first_event() ? "" : ",\n", phasenames[e.phase],
+            e.thread + 1, (e.start - origin) / 1e3, e.duration / 1e3,
+            e.frame);
+  }
+  fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+  if (fclose(f) != 0) {
+    perror(filename);
+    return false;
+  }
+  if (next > capacity) {
+    fprintf(stderr, "Trace: first %u events dropped\n", next - capacity);
+  }
+  return true;
+}
+
+void trace_print_stats(FILE *f) {
+  if (!events) return;
+  std::vector<uint32_t> durations[TRACE_NPHASES];
+  for (unsigned i = first_event(); i < next; i++) {
+    const TraceEvent &e = events[i % capacity];
+    durations[e.phase].push_back(e.duration);
+  }
+  fprintf(f, "%-10s %7s %9s %9s %9s %9s (usecs)\n",
+          "phase", "count", "p50", "p90", "p99", "max");
+  for (int p = 0; p < TRACE_NPHASES; p++) {
+    std::vector<uint32_t> &d = durations[p];
+    if (d.empty()) continue;
+    std::sort(d.begin(), d.end());
+    size_t n = d.size();
+    fprintf(f, "%-10s %7zu %9.1f %9.1f %9.1f %9.1f\n", phasenames[p], n,
+            d[n*50/100] / 1e3, d[n*90/100] / 1e3, d[n*99/100] / 1e3,
+            d[n-1] / 1e3);
+  }
+}
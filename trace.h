@@ -0,0 +1,37 @@
+// Tracing the phases of the frame loop.
+//
+// Each phase, from reading the keys to the page flip, is recorded as
+// an event (start and duration) in a ring allocated up front, so
+// recording is a couple of clock reads and a store. At the end the
+// events can be written out in the Chrome trace event format (load it
+// in chrome://tracing or ui.perfetto.dev), and the percentiles of
+// each phase's duration printed. The newest events are kept if the
+// ring fills up.
+
+enum TracePhase {
+  TRACE_FRAME,     // The whole of one time round the loop
+  TRACE_INPUT,     // Taking keys, not counting waiting for them
+  TRACE_SETSCALE,  // Working out the view
+  TRACE_EXECUTE,   // Rendering, on the QPUs or the CPU
+  TRACE_DISPATCH,  // Starting the QPUs, through the registers
+  TRACE_COLOURISE, // Counts to palette indices (-C)
+  TRACE_FLIP,      // Showing the new page
+  TRACE_VSYNC,     // Waiting for the next page to go off the screen
+  TRACE_NPHASES
+};
+
+// Allocate room for capacity events and start recording
+void trace_start(unsigned capacity);
+bool trace_enabled();
+
+// Nanoseconds, on the clock the events use
+uint64_t trace_now();
+
+// Record phase as running from start until now, in frame
+void trace_end(TracePhase phase, uint64_t start, unsigned frame);
+
+// Write the events as Chrome trace JSON. Returns false on error.
+bool trace_write(const char *filename);
+
+// p50, p90, p99 and max of each phase
+void trace_print_stats(FILE *f);
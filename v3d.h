@@ -0,0 +1,34 @@
+// V3D register indices, as word offsets from IO_BASE.
+
+#define REG(x) ((0xC00000 + x) >>2)
+//#define REG(x) ((x)>>2)
+
+// Address base is at 0x7ec00000 on BCM2835
+// Translates to IO_BASE + c00000 + register offset
+
+// V3D spec: http://www.broadcom.com/docs/support/videocore/VideoCoreIV-AG100-R.pdf
+#define V3D_IDENT0   REG(0x00)
+#define V3D_IDENT1   REG(0x04)
+#define V3D_IDENT2   REG(0x08)
+#define V3D_SQCNTL   REG(0x418)
+#define V3D_VPACNTL  REG(0x500)
+#define V3D_VPMBASE  REG(0x504)
+#define V3D_PCTRC    REG(0x670)
+#define V3D_PCTRE    REG(0x674)
+#define V3D_PCTR(i) (REG(0x680) + 2*i)
+#define V3D_PCTRS(i)(REG(0x684) + 2*i)
+#define V3D_ERRSTAT  REG(0xf20)
+
+#define V3D_SQRSV0   REG(0x410)
+#define V3D_SQRSV1   REG(0x414)
+
+#define V3D_L2CACTL (0xC00020>>2)
+#define V3D_SLCACTL (0xC00024>>2)
+#define V3D_SRQPC   (0xC00430>>2)
+#define V3D_SRQUA   (0xC00434>>2)
+#define V3D_SRQUL   (0xC00438>>2)
+#define V3D_SRQCS   (0xC0043c>>2)
+
+#define V3D_DBCFG   (0xC00e00>>2)
+#define V3D_DBQITE  (0xC00e2c>>2)
+#define V3D_DBQITC  (0xC00e30>>2)
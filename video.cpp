@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include "cpurender.h"
+#include "scheduler.h"
+#include "colour.h"
+#include "expmap.h"
+#include "video.h"
+
+struct Keyframe {
+  double xcentre;
+  double ycentre;
+  double xscale;
+  int maxiterations;
+  int frames; // To the next one
+};
+
+static bool read_keyframes(const char *filename, std::vector<Keyframe> &keys)
+{
+  FILE *fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "Can't open keyframes %s\n", filename);
+    return false;
+  }
+  char line[512];
+  int lineno = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    lineno++;
+    char *p = line + strspn(line, " \t");
+    if (*p == '#' || *p == '\n' || *p == 0) continue;
+    Keyframe k;
+    k.frames = 100;
+    int n = sscanf(p, "%lf %lf %lf %d %d", &k.xcentre, &k.ycentre,
+                   &k.xscale, &k.maxiterations, &k.frames);
+    if (n < 4 || k.xscale <= 0 || k.maxiterations <= 0 || k.frames <= 0) {
+      fprintf(stderr, "%s:%d: bad keyframe\n", filename, lineno);
+      fclose(fp);
+      return false;
+    }
+    keys.push_back(k);
+  }
+  fclose(fp);
+  if (keys.size() < 2) {
+    fprintf(stderr, "%s: need at least 2 keyframes\n", filename);
+    return false;
+  }
+  return true;
+}
+
+// The view t (0 to 1) of the way from a to b. The zoom goes as
+// a.xscale*r^t, and the centre so that the one point p with
+// (p - centre)*xscale the same throughout stays where it is on the
+// screen: centre = p + (a.centre - p)*a.xscale/xscale.
+static Keyframe interpolate(const Keyframe &a, const Keyframe &b, double t) {
+  Keyframe k;
+  double r = b.xscale / a.xscale;
+  k.xscale = a.xscale * pow(r, t);
+  if (fabs(r - 1) < 1e-9) {
+    // Just panning
+    k.xcentre = a.xcentre + (b.xcentre - a.xcentre)*t;
+    k.ycentre = a.ycentre + (b.ycentre - a.ycentre)*t;
+  } else {
+    double f = a.xscale / k.xscale;
+    double px = (b.xcentre - a.xcentre/r) / (1 - 1/r);
+    double py = (b.ycentre - a.ycentre/r) / (1 - 1/r);
+    k.xcentre = px + (a.xcentre - px)*f;
+    k.ycentre = py + (a.ycentre - py)*f;
+  }
+  k.maxiterations = (int)(a.maxiterations *
+                          pow((double)b.maxiterations/a.maxiterations, t) + 0.5);
+  k.frames = 1;
+  return k;
+}
+
+struct VideoFrame {
+  int index;
+  RenderParams params;
+  std::vector<uint32_t> counts;
+  std::vector<uint8_t> pixels; // Palette indices
+  std::vector<uint8_t> yuv;
+};
+
+// Frames waiting for a stage. pop gives NULL once the queue has been
+// closed and emptied.
+struct FrameQueue {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  std::deque<VideoFrame*> frames;
+  bool closed;
+};
+
+static void queue_init(FrameQueue &q) {
+  pthread_mutex_init(&q.lock, NULL);
+  pthread_cond_init(&q.ready, NULL);
+  q.closed = false;
+}
+
+static void queue_push(FrameQueue &q, VideoFrame *f) {
+  pthread_mutex_lock(&q.lock);
+  q.frames.push_back(f);
+  pthread_cond_signal(&q.ready);
+  pthread_mutex_unlock(&q.lock);
+}
+
+static void queue_close(FrameQueue &q) {
+  pthread_mutex_lock(&q.lock);
+  q.closed = true;
+  pthread_cond_broadcast(&q.ready);
+  pthread_mutex_unlock(&q.lock);
+}
+
+static VideoFrame *queue_pop(FrameQueue &q) {
+  pthread_mutex_lock(&q.lock);
+  while (q.frames.empty() && !q.closed) pthread_cond_wait(&q.ready, &q.lock);
+  VideoFrame *f = NULL;
+  if (!q.frames.empty()) {
+    f = q.frames.front();
+    q.frames.pop_front();
+  }
+  pthread_mutex_unlock(&q.lock);
+  return f;
+}
+
+enum { STAGE_COMPUTE, STAGE_COLOUR, STAGE_ENCODE, NSTAGES };
+static const char *stagenames[NSTAGES] = { "compute", "colour", "encode" };
+
+struct Video {
+  int width, height, tilesize;
+  FILE *out;
+  FrameQueue freeq, colourq, encodeq;
+  uint8_t ys[256], us[256], vs[256]; // The palette in YUV
+  double busy[NSTAGES];              // Seconds
+  volatile bool failed;              // Set by the encoder
+};
+
+static double now_seconds() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+struct ComputeFrame {
+  const RenderParams *params;
+  uint32_t *counts;
+  int width;
+};
+
+static void compute_tile(const Tile &tile, void *arg) {
+  ComputeFrame *frame = (ComputeFrame*)arg;
+  cpu_render_counts(*frame->params, tile.x, tile.y, tile.w, tile.h,
+                    frame->counts, frame->width);
+}
+
+static void *colour_thread(void *arg) {
+  Video *v = (Video*)arg;
+  while (VideoFrame *f = queue_pop(v->colourq)) {
+    double start = now_seconds();
+    // A fixed colour cycle, so raising the limit doesn't change them
+    colourise(&f->counts[0], v->width, v->width, v->height, &f->pixels[0],
+              v->width, f->params.maxiterations, 256, 0);
+    v->busy[STAGE_COLOUR] += now_seconds() - start;
+    queue_push(v->encodeq, f);
+  }
+  queue_close(v->encodeq);
+  return NULL;
+}
+
+// 4:2:0, the chroma planes half the size each way (rounded up), each
+// value the average of the 2x2 pixels it covers.
+static void encode_frame(const Video *v, VideoFrame *f) {
+  int w = v->width, h = v->height;
+  int cw = (w+1)/2, ch = (h+1)/2;
+  const uint8_t *pix = &f->pixels[0];
+  uint8_t *y = &f->yuv[0];
+  uint8_t *u = y + w*h;
+  uint8_t *vp = u + cw*ch;
+  for (int i = 0; i < w*h; i++) y[i] = v->ys[pix[i]];
+  for (int cy = 0; cy < ch; cy++) {
+    int y0 = 2*cy, y1 = std::min(2*cy+1, h-1);
+    for (int cx = 0; cx < cw; cx++) {
+      int x0 = 2*cx, x1 = std::min(2*cx+1, w-1);
+      uint8_t p[4] = { pix[y0*w+x0], pix[y0*w+x1],
+                       pix[y1*w+x0], pix[y1*w+x1] };
+      unsigned su = 2, sv = 2;
+      for (int k = 0; k < 4; k++) {
+        su += v->us[p[k]];
+        sv += v->vs[p[k]];
+      }
+      u[cy*cw+cx] = su / 4;
+      vp[cy*cw+cx] = sv / 4;
+    }
+  }
+}
+
+static void *encode_thread(void *arg) {
+  Video *v = (Video*)arg;
+  while (VideoFrame *f = queue_pop(v->encodeq)) {
+    double start = now_seconds();
+    encode_frame(v, f);
+    if (!v->failed &&
+        (fputs("FRAME\n", v->out) < 0 ||
+         fwrite(&f->yuv[0], 1, f->yuv.size(), v->out) != f->yuv.size())) {
+      fprintf(stderr, "Error writing frame %d\n", f->index);
+      v->failed = true;
+    }
+    v->busy[STAGE_ENCODE] += now_seconds() - start;
+    queue_push(v->freeq, f);
+  }
+  return NULL;
+}
+
+int video_main(const VideoOptions &options)
+{
+  std::vector<Keyframe> keys;
+  if (!read_keyframes(options.keyframes, keys)) return EXIT_FAILURE;
+  int nframes = 1;
+  for (size_t i = 0; i+1 < keys.size(); i++) nframes += keys[i].frames;
+  // Checked before the output is opened, so a mistake doesn't leave an
+  // empty file
+  for (size_t i = 1; options.expmap && i < keys.size(); i++) {
+    if (keys[i].xcentre != keys[0].xcentre ||
+        keys[i].ycentre != keys[0].ycentre) {
+      fprintf(stderr, "%s: the exponential map needs every keyframe "
+              "to have the same centre\n", options.keyframes);
+      return EXIT_FAILURE;
+    }
+  }
+
+  Video v;
+  v.width = options.width;
+  v.height = options.height;
+  v.tilesize = options.tilesize;
+  v.out = options.output ? fopen(options.output, "wb") : stdout;
+  if (!v.out) {
+    fprintf(stderr, "Can't open %s for writing\n", options.output);
+    return EXIT_FAILURE;
+  }
+  v.failed = false;
+  memset(v.busy, 0, sizeof(v.busy));
+  // Full range BT.601, as C420jpeg says
+  unsigned palette[256];
+  make_palette(palette, 256);
+  for (int i = 0; i < 256; i++) {
+    double r = palette_r(palette[i]), g = palette_g(palette[i]);
+    double b = palette_b(palette[i]);
+    double y = 0.299*r + 0.587*g + 0.114*b;
+    double u = 128 - 0.168736*r - 0.331264*g + 0.5*b;
+    double vv = 128 + 0.5*r - 0.418688*g - 0.081312*b;
+    v.ys[i] = std::min(255.0, std::max(0.0, y + 0.5));
+    v.us[i] = std::min(255.0, std::max(0.0, u + 0.5));
+    v.vs[i] = std::min(255.0, std::max(0.0, vv + 0.5));
+  }
+  queue_init(v.freeq);
+  queue_init(v.colourq);
+  queue_init(v.encodeq);
+  size_t npixels = (size_t)v.width*v.height;
+  size_t yuvbytes = npixels + 2*(size_t)((v.width+1)/2)*((v.height+1)/2);
+  int inflight = std::max(1, options.inflight);
+  std::vector<VideoFrame> slots(inflight);
+  for (int i = 0; i < inflight; i++) {
+    slots[i].counts.resize(npixels);
+    slots[i].pixels.resize(npixels);
+    slots[i].yuv.resize(yuvbytes);
+    queue_push(v.freeq, &slots[i]);
+  }
+
+  fprintf(stderr, "Video: %d frames of %dx%d at %d fps, %d in flight, "
+          "%s kernel, %d threads\n", nframes, v.width, v.height, options.fps,
+          inflight, cpu_kernel_name(), sched_threads());
+  double start = now_seconds();
+  ExpMap map;
+  ExpMapLookup lookup;
+  if (options.expmap) {
+    // One strip for the lot, at the highest limit of any of them
+    double minscale = keys[0].xscale, maxscale = keys[0].xscale;
+    int maxiterations = keys[0].maxiterations;
+    for (size_t i = 1; i < keys.size(); i++) {
+      minscale = std::min(minscale, keys[i].xscale);
+      maxscale = std::max(maxscale, keys[i].xscale);
+      maxiterations = std::max(maxiterations, keys[i].maxiterations);
+    }
+    expmap_render(map, keys[0].xcentre, keys[0].ycentre, minscale, maxscale,
+                  v.width, v.height, maxiterations);
+    expmap_prepare(map, v.width, v.height, lookup);
+    double t = now_seconds() - start;
+    fprintf(stderr, "Exponential map: %dx%d, %.2f Mpoints (%.1f frames' "
+            "worth), %.3f s\n", map.cols, map.rows,
+            (double)map.rows*map.cols/1e6,
+            (double)map.rows*map.cols/npixels, t);
+  }
+  fprintf(v.out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+          v.width, v.height, options.fps);
+  pthread_t colour, encode;
+  pthread_create(&colour, NULL, colour_thread, &v);
+  pthread_create(&encode, NULL, encode_thread, &v);
+
+  size_t key = 0;
+  int within = 0; // Frames since keys[key]
+  for (int i = 0; i < nframes && !v.failed; i++) {
+    VideoFrame *f = queue_pop(v.freeq);
+    double t0 = now_seconds();
+    Keyframe k = key+1 < keys.size()
+      ? interpolate(keys[key], keys[key+1], (double)within / keys[key].frames)
+      : keys[key];
+    if (++within == keys[key].frames && key+1 < keys.size()) {
+      key++;
+      within = 0;
+    }
+    f->index = i;
+    if (options.expmap) {
+      view_params(f->params, k.xcentre, k.ycentre, k.xscale, v.width,
+                  v.height, map.maxiterations);
+      expmap_frame(map, lookup, k.xscale, &f->counts[0]);
+    } else {
+      view_params(f->params, k.xcentre, k.ycentre, k.xscale, v.width,
+                  v.height, k.maxiterations);
+      ComputeFrame frame = { &f->params, &f->counts[0], v.width };
+      sched_frame(v.width, v.height, v.tilesize, compute_tile, &frame);
+    }
+    v.busy[STAGE_COMPUTE] += now_seconds() - t0;
+    queue_push(v.colourq, f);
+  }
+  queue_close(v.colourq);
+  pthread_join(colour, NULL);
+  pthread_join(encode, NULL);
+  double secs = now_seconds() - start;
+  if (options.expmap) {
+    expmap_free(map);
+    expmap_free_lookup(lookup);
+  }
+  bool ok = !v.failed;
+  if (fflush(v.out) != 0) ok = false;
+  if (options.output && fclose(v.out) != 0) ok = false;
+  if (!ok) {
+    fprintf(stderr, "Error writing the video\n");
+    return EXIT_FAILURE;
+  }
+
+  fprintf(stderr, "Video: %d frames in %.3f s (all told), %.2f frames/s, "
+          "%.2f Mpixels/s\n", nframes, secs, nframes/secs,
+          nframes*npixels/secs/1e6);
+  for (int s = 0; s < NSTAGES; s++) {
+    fprintf(stderr, "  %-8s %9.3f ms a frame (%5.1f%% busy)\n",
+            stagenames[s], v.busy[s]/nframes*1e3, 100*v.busy[s]/secs);
+  }
+  return 0;
+}
@@ -0,0 +1,34 @@
+// Zoom videos, as uncompressed YUV4MPEG2 (.y4m).
+//
+// The path is given as keyframes, one per line:
+//   xcentre ycentre zoom maxiterations [frames]
+// where frames (default 100) is how many frames it takes to get to the
+// next one. Between keyframes the zoom goes exponentially, about the one
+// point that stays put on the screen, so the zoom looks steady and the
+// next centre is homed in on; the maximum iterations go geometrically.
+//
+// Frames go through three stages, each a thread of its own: the
+// computing (on the scheduler threads), colouring the counts with the
+// usual palette, and turning those into YUV 4:2:0 and writing them out.
+// So while one frame is being written the next is coloured and the one
+// after computed. A fixed number of frames is in flight, so a slow
+// output holds the computing up rather than filling the memory, and
+// frames come out in order as each stage takes them in turn.
+//
+// For a zoom into a single point, the frames can instead be looked up
+// in an exponential map of the whole zoom, rendered once before the
+// first, which makes the computing stage nearly free.
+
+struct VideoOptions {
+  int width;
+  int height;
+  int tilesize;
+  const char *keyframes;
+  const char *output; // NULL for stdout
+  int fps;
+  int inflight;       // Frames between the stages at once
+  bool expmap;        // Look the frames up in an exponential map (see
+                      // expmap.h), for zooms into one point
+};
+
+int video_main(const VideoOptions &options);